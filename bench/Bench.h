@@ -0,0 +1,60 @@
+#pragma once
+
+#include <duktape.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+/**
+ * Helpers shared by the benchmark programs
+ */
+namespace bench {
+
+/**
+ * Milliseconds since an arbitrary point
+ */
+inline double now()
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Runs the function "runs" times, returns the best time in milliseconds
+ */
+inline double best(int runs, const std::function<void()> &func)
+{
+	double ret = 0;
+	for (int i = 0; i < runs; i++)
+	{
+		double start = now();
+		func();
+		double elapsed = now() - start;
+		if (i == 0 || elapsed < ret)
+			ret = elapsed;
+	}
+	return ret;
+}
+
+/**
+ * Integer argument "index" of the command line, or "def" if it is missing
+ */
+inline long arg(int argc, char *argv[], int index, long def)
+{
+	return argc > index ? std::atol(argv[index]) : def;
+}
+
+/**
+ * Evaluates the script, throwing its error. The result is left on the stack.
+ */
+inline void eval(duk_context *ctx, const char *script)
+{
+	if (duk_peval_string(ctx, script) != 0)
+		throw std::runtime_error(duk_safe_to_string(ctx, -1));
+}
+
+}
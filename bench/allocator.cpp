@@ -0,0 +1,61 @@
+#include <dtel/SlabAllocator.h>
+
+#include "Bench.h"
+
+#include <cstdio>
+
+using namespace dtel;
+
+/**
+ * Allocation heavy scripts on a heap with the default allocator, with SlabAllocator and with SlabAllocator
+ * on huge pages. Each run creates the heap, runs the script and destroys the heap.
+ *
+ * Usage: bench_allocator [runs, default 5]
+ */
+
+struct Script
+{
+	const char *name;
+	const char *source;
+};
+
+static const Script scripts[] = {
+	{ "object churn", "var a = []; for (var i = 0; i < 300000; i++) { a.push({x: i, s: 'k' + i}); if (a.length > 1000) a = []; }" },
+	{ "string concat", "var s = ''; for (var i = 0; i < 200000; i++) { s = 'abc' + i + 'def'; var o = {a: [1, 2, 3], b: s}; }" },
+	{ "buffers + JSON", "for (var i = 0; i < 20000; i++) { var b = new Uint8Array(100 + (i % 5000)); "
+		"var j = JSON.stringify({v: [i, i + 1, {z: 'q' + i}]}); JSON.parse(j); }" },
+};
+
+enum heap_t {
+	HEAP_DEFAULT,
+	HEAP_SLAB,
+	HEAP_SLAB_HUGE,
+};
+
+static double run(heap_t heap, const Script &script, int runs)
+{
+	return bench::best(runs, [&] {
+		duk_context *ctx = heap == HEAP_DEFAULT ? duk_create_heap_default() : SlabAllocator::createHeap(heap == HEAP_SLAB_HUGE);
+		bench::eval(ctx, script.source);
+		duk_pop(ctx);
+		if (heap == HEAP_DEFAULT)
+			duk_destroy_heap(ctx);
+		else
+			SlabAllocator::destroyHeap(ctx);
+	});
+}
+
+int main(int argc, char *argv[])
+{
+	int runs = static_cast<int>(bench::arg(argc, argv, 1, 5));
+
+	std::printf("%-16s %12s %12s %12s\n", "best of runs", "default", "slab", "slab+huge");
+	for (auto &script : scripts)
+	{
+		double def = run(HEAP_DEFAULT, script, runs);
+		double slab = run(HEAP_SLAB, script, runs);
+		double huge = run(HEAP_SLAB_HUGE, script, runs);
+		std::printf("%-16s %9.1f ms %9.1f ms %9.1f ms\n", script.name, def, slab, huge);
+	}
+	return 0;
+}
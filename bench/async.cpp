@@ -0,0 +1,122 @@
+#include <dtel.h>
+#include <dtel/Async.h>
+
+#include "Bench.h"
+
+#include <cstdio>
+#include <iostream>
+
+using namespace dtel;
+
+/**
+ * Async native operations: round trip of a chain of no-op RunAsyncCallback calls, each one started from
+ * the callback of the previous, and throughput of many calls in flight at once.
+ * The round trip covers the javascript call, the hop to a task thread, the loop event and the callback.
+ *
+ * Usage: bench_async [chained calls, default 20000] [calls in flight, default 100000]
+ */
+
+class BenchEL : public EventLoop
+{
+public:
+	BenchEL(duk_context *ctx) : EventLoop(ctx) {}
+
+	bool processException(const std::exception &e) override
+	{
+		std::cerr << "EXCEPTION: " << e.what() << std::endl;
+		terminate();
+		return true;
+	}
+};
+
+static EventLoop *benchLoop = NULL;
+
+static duk_ret_t r_noop(duk_context *ctx)
+{
+	// 0: callback
+	RunAsyncCallback(benchLoop, 0, [] {});
+	return 0;
+}
+
+static duk_ret_t r_now(duk_context *ctx)
+{
+	duk_push_number(ctx, bench::now());
+	return 1;
+}
+
+static duk_ret_t r_report(duk_context *ctx)
+{
+	// 0: name, 1: milliseconds, 2: count
+	double ms = duk_to_number(ctx, 1);
+	double count = duk_to_number(ctx, 2);
+	std::printf("%-10s %8.0f calls %10.1f ms %10.2f us each\n", duk_to_string(ctx, 0), count, ms, ms * 1000 / count);
+	return 0;
+}
+
+static duk_ret_t r_done(duk_context *ctx)
+{
+	benchLoop->terminate();
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	long chained = bench::arg(argc, argv, 1, 20000);
+	long inflight = bench::arg(argc, argv, 2, 100000);
+
+	duk_context *ctx = duk_create_heap_default();
+
+	{
+		BenchEL el(ctx);
+		benchLoop = &el;
+
+		duk_push_global_object(ctx);
+		duk_push_c_function(ctx, &r_noop, 1);
+		duk_put_prop_string(ctx, -2, "noop");
+		duk_push_c_function(ctx, &r_now, 0);
+		duk_put_prop_string(ctx, -2, "now");
+		duk_push_c_function(ctx, &r_report, 3);
+		duk_put_prop_string(ctx, -2, "report");
+		duk_push_c_function(ctx, &r_done, 0);
+		duk_put_prop_string(ctx, -2, "done");
+		duk_push_int(ctx, static_cast<duk_int_t>(chained));
+		duk_put_prop_string(ctx, -2, "CHAINED");
+		duk_push_int(ctx, static_cast<duk_int_t>(inflight));
+		duk_put_prop_string(ctx, -2, "INFLIGHT");
+		duk_pop(ctx);
+
+		bench::eval(ctx, R"(
+
+var n = 0, t0 = now();
+
+function chain() {
+	if (++n < CHAINED) {
+		noop(chain);
+		return;
+	}
+	report('chained', now() - t0, CHAINED);
+
+	n = 0;
+	t0 = now();
+	for (var i = 0; i < INFLIGHT; i++)
+		noop(parallel);
+}
+
+function parallel() {
+	if (++n === INFLIGHT) {
+		report('in flight', now() - t0, INFLIGHT);
+		done();
+	}
+}
+
+noop(chain);
+
+		)");
+		duk_pop(ctx);
+
+		el.run();
+	}
+
+	duk_destroy_heap(ctx);
+	return 0;
+}
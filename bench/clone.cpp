@@ -0,0 +1,67 @@
+#include <dtel.h>
+#include <dtel/detail/clone.h>
+#include <dtel/detail/util.h>
+
+#include "Bench.h"
+
+#include <cstdio>
+#include <string>
+
+using namespace dtel;
+
+/**
+ * Worker message serialization: encode + decode round trip of the native structured clone, against
+ * the JX text used before.
+ *
+ * Usage: bench_clone [iterations scale, default 1]
+ */
+
+static void run(duk_context *ctx, const char *name, const char *script, long iterations)
+{
+	bench::eval(ctx, script);
+
+	size_t jxsize = 0;
+	double jx = bench::best(3, [&] {
+		for (long i = 0; i < iterations; i++)
+		{
+			std::string data(detail::util::json_custom_encode(ctx, -1));
+			jxsize = data.size();
+			detail::util::json_custom_decode_push(ctx, data);
+			duk_pop(ctx);
+		}
+	}) / iterations;
+
+	size_t clonesize = 0;
+	double clone = bench::best(3, [&] {
+		for (long i = 0; i < iterations; i++)
+		{
+			detail::clone::Message message;
+			if (!detail::clone::encode(ctx, -1, DUK_INVALID_INDEX, message) || !detail::clone::decode_push(ctx, message))
+				throw std::runtime_error(duk_safe_to_string(ctx, -1));
+			clonesize = message.data.size();
+			for (auto &block : message.transfers)
+				clonesize += block->size();
+			duk_pop(ctx);
+		}
+	}) / iterations;
+
+	std::printf("%-10s jx %10.4f ms %10zu bytes   clone %10.4f ms %10zu bytes   x%.1f\n",
+		name, jx, jxsize, clone, clonesize, jx / clone);
+	duk_pop(ctx);
+}
+
+int main(int argc, char *argv[])
+{
+	long scale = bench::arg(argc, argv, 1, 1);
+
+	duk_context *ctx = duk_create_heap_default();
+
+	run(ctx, "small", "({a: 1, b: 'hello', c: [1, 2, 3], d: true})", 20000 * scale);
+	run(ctx, "1000 objs", "(function() { var r = []; for (var i = 0; i < 1000; i++) "
+		"r.push({id: i, name: 'item' + i, v: i * 1.5, tags: ['a', 'b']}); return r; })()", 100 * scale);
+	run(ctx, "10MB", "(function() { var u = new Uint8Array(10 * 1024 * 1024); "
+		"for (var i = 0; i < u.length; i += 4096) u[i] = i & 255; return u; })()", 5 * scale);
+
+	duk_destroy_heap(ctx);
+	return 0;
+}
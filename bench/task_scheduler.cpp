@@ -0,0 +1,119 @@
+#include <dtel/TaskScheduler.h>
+
+#include "Bench.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+using namespace dtel;
+
+/**
+ * Task posting overhead: 1M tasks that each do an atomic add, on TaskScheduler and on a pool with a
+ * single locked queue of allocated std::function, like the ctpl pool TaskScheduler replaced.
+ * The nested test posts the tasks from inside the scheduler threads.
+ *
+ * Usage: bench_task_scheduler [threads, default 3] [tasks, default 1000000]
+ */
+
+/**
+ * One mutex protected queue shared by all the threads, each task allocated
+ */
+class LockedPool
+{
+public:
+	explicit LockedPool(size_t threads) : _lock(), _cv(), _tasks(), _stop(false), _threads()
+	{
+		for (size_t i = 0; i < threads; i++)
+			_threads.emplace_back(&LockedPool::run, this);
+	}
+
+	/**
+	 * Runs the remaining tasks and joins the threads
+	 */
+	~LockedPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_stop = true;
+		}
+		_cv.notify_all();
+		for (auto &thread : _threads)
+			thread.join();
+	}
+
+	void post(std::function<void()> func)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_tasks.emplace(new std::function<void()>(std::move(func)));
+		}
+		_cv.notify_one();
+	}
+private:
+	void run()
+	{
+		for (;;)
+		{
+			std::unique_ptr<std::function<void()>> task;
+			{
+				std::unique_lock<std::mutex> lock(_lock);
+				_cv.wait(lock, [this] { return _stop || !_tasks.empty(); });
+				if (_tasks.empty())
+					return;
+				task = std::move(_tasks.front());
+				_tasks.pop();
+			}
+			(*task)();
+		}
+	}
+
+	std::mutex _lock;
+	std::condition_variable _cv;
+	std::queue<std::unique_ptr<std::function<void()>>> _tasks;
+	bool _stop;
+	std::vector<std::thread> _threads;
+};
+
+int main(int argc, char *argv[])
+{
+	size_t threads = static_cast<size_t>(bench::arg(argc, argv, 1, 3));
+	long tasks = bench::arg(argc, argv, 2, 1000000);
+
+	std::atomic<long> sum(0);
+
+	double locked = bench::best(3, [&] {
+		LockedPool pool(threads);
+		for (long i = 0; i < tasks; i++)
+			pool.post([&sum, i] { sum.fetch_add(i, std::memory_order_relaxed); });
+	});
+
+	double scheduler = bench::best(3, [&] {
+		TaskScheduler pool(threads);
+		for (long i = 0; i < tasks; i++)
+			pool.post([&sum, i] { sum.fetch_add(i, std::memory_order_relaxed); });
+	});
+
+	double nested = bench::best(3, [&] {
+		TaskScheduler pool(threads);
+		for (long j = 0; j < 100; j++)
+		{
+			pool.post([&pool, &sum, tasks] {
+				for (long i = 0; i < tasks / 100; i++)
+					pool.post([&sum, i] { sum.fetch_add(i, std::memory_order_relaxed); });
+			});
+		}
+	});
+
+	std::printf("%zu threads, %ld tasks\n", threads, tasks);
+	std::printf("locked queue        %8.0f ns/task\n", locked * 1000000 / tasks);
+	std::printf("TaskScheduler       %8.0f ns/task\n", scheduler * 1000000 / tasks);
+	std::printf("TaskScheduler nested%8.0f ns/task\n", nested * 1000000 / tasks);
+	return 0;
+}
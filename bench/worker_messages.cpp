@@ -0,0 +1,139 @@
+#include <dtel.h>
+#include <dtel/lib/eventtarget/EventTarget.h>
+#include <dtel/lib/worker/Worker.h>
+
+#include "Bench.h"
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+using namespace dtel;
+
+/**
+ * Worker message passing: ping-pong round trip latency between the main loop and a worker, and the
+ * throughput of a worker streaming messages to the main loop.
+ *
+ * Usage: bench_worker_messages [round trips, default 20000] [streamed messages, default 200000]
+ */
+
+class BenchEL : public EventLoop
+{
+public:
+	BenchEL(duk_context *ctx) : EventLoop(ctx) {}
+
+	bool processException(const std::exception &e) override
+	{
+		std::cerr << "EXCEPTION: " << e.what() << std::endl;
+		terminate();
+		return true;
+	}
+};
+
+class BenchWorker : public worker::WorkerWorker
+{
+public:
+	void initContext(duk_context *ctx, EventLoop *eventloop) override
+	{
+		eventtarget::RegisterEventTarget(eventloop);
+	}
+
+	void loadUrl(duk_context *ctx, EventLoop *eventloop, const std::string &url) override
+	{
+		// the url is the script
+		if (duk_peval_string(ctx, url.c_str()) != 0)
+		{
+			ThrowError(ctx, -1);
+		}
+		duk_pop(ctx);
+	}
+};
+
+static EventLoop *benchLoop = NULL;
+
+static duk_ret_t r_now(duk_context *ctx)
+{
+	duk_push_number(ctx, bench::now());
+	return 1;
+}
+
+static duk_ret_t r_report(duk_context *ctx)
+{
+	// 0: name, 1: milliseconds, 2: count
+	double ms = duk_to_number(ctx, 1);
+	double count = duk_to_number(ctx, 2);
+	std::printf("%-10s %8.0f x %10.1f ms %10.2f us each\n", duk_to_string(ctx, 0), count, ms, ms * 1000 / count);
+	return 0;
+}
+
+static duk_ret_t r_done(duk_context *ctx)
+{
+	benchLoop->terminate();
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	long rounds = bench::arg(argc, argv, 1, 20000);
+	long messages = bench::arg(argc, argv, 2, 200000);
+
+	duk_context *ctx = duk_create_heap_default();
+
+	{
+		BenchEL el(ctx);
+		benchLoop = &el;
+
+		eventtarget::RegisterEventTarget(&el);
+		auto WKHandler = worker::RegisterWorker(&el);
+		WKHandler->setWorker(make_intrusive<BenchWorker>());
+
+		duk_push_global_object(ctx);
+		duk_push_c_function(ctx, &r_now, 0);
+		duk_put_prop_string(ctx, -2, "now");
+		duk_push_c_function(ctx, &r_report, 3);
+		duk_put_prop_string(ctx, -2, "report");
+		duk_push_c_function(ctx, &r_done, 0);
+		duk_put_prop_string(ctx, -2, "done");
+		duk_push_int(ctx, static_cast<duk_int_t>(rounds));
+		duk_put_prop_string(ctx, -2, "ROUNDS");
+		duk_push_int(ctx, static_cast<duk_int_t>(messages));
+		duk_put_prop_string(ctx, -2, "MESSAGES");
+		duk_pop(ctx);
+
+		bench::eval(ctx, R"(
+
+var w = new Worker("onmessage = function(e) { " +
+	"if (typeof e.data === 'number' && e.data < 0) { for (var i = 0; i < -e.data; i++) postMessage(i); } " +
+	"else postMessage(e.data); }; postMessage('ready');");
+var phase = 'start', n = 0, t0 = 0;
+
+w.onmessage = function(e) {
+	if (phase === 'start') {
+		phase = 'pingpong';
+		t0 = now();
+		w.postMessage(0);
+	} else if (phase === 'pingpong') {
+		if (++n < ROUNDS) {
+			w.postMessage(n);
+			return;
+		}
+		report('ping-pong', now() - t0, ROUNDS);
+		phase = 'stream';
+		n = 0;
+		t0 = now();
+		w.postMessage(-MESSAGES);
+	} else if (++n === MESSAGES) {
+		report('stream', now() - t0, MESSAGES);
+		done();
+	}
+};
+
+		)");
+		duk_pop(ctx);
+
+		el.run();
+	}
+
+	duk_destroy_heap(ctx);
+	return 0;
+}
@@ -2852,7 +2852,13 @@ typedef struct duk_hthread duk_context;
 #undef DUK_USE_EXEC_INDIRECT_BOUND_CHECK
 #undef DUK_USE_EXEC_PREFER_SIZE
 #define DUK_USE_EXEC_REGCONST_OPTIMIZE
+#if defined(__cplusplus)
+/* dtel: lets Worker.terminate() abort running scripts */
+#include <dtel/detail/interrupt.h>
+#define DUK_USE_EXEC_TIMEOUT_CHECK(udata) dtel_exec_timeout_check((udata))
+#else
 #undef DUK_USE_EXEC_TIMEOUT_CHECK
+#endif
 #undef DUK_USE_EXPLICIT_NULL_INIT
 #undef DUK_USE_EXTSTR_FREE
 #undef DUK_USE_EXTSTR_INTERN_CHECK
@@ -2893,7 +2899,11 @@ typedef struct duk_hthread duk_context;
 #define DUK_USE_HTML_COMMENTS
 #define DUK_USE_IDCHAR_FASTPATH
 #undef DUK_USE_INJECT_HEAP_ALLOC_ERROR
+#if defined(__cplusplus)
+#define DUK_USE_INTERRUPT_COUNTER
+#else
 #undef DUK_USE_INTERRUPT_COUNTER
+#endif
 #undef DUK_USE_INTERRUPT_DEBUG_FIXUP
 #define DUK_USE_JC
 #define DUK_USE_JSON_BUILTIN
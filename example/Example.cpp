@@ -1,11 +1,23 @@
 #include <dtel.h>
+#include <dtel/AccountingAllocator.h>
 #include <dtel/lib/eventtarget/EventTarget.h>
 #include <dtel/lib/console/Console.h>
+#include <dtel/lib/console/AsyncConsole.h>
 #include <dtel/lib/settimeout/SetTimeout.h>
 #include <dtel/lib/worker/Worker.h>
+#include <dtel/lib/sharedarraybuffer/SharedArrayBuffer.h>
+#include <dtel/lib/fs/FS.h>
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#endif
+
 using namespace dtel;
 
 class MyEL : public EventLoop
@@ -18,6 +30,16 @@ public:
 		std::cout << "@@@@@@@ EXCEPTION: " << e.what() << " @@@@@@@" << std::endl;
 		return true;
 	}
+
+#ifdef __linux__
+	// set DTEL_EPOLL to run on the epoll backend
+	IOBackend::Ptr createIOBackend() override
+	{
+		if (std::getenv("DTEL_EPOLL"))
+			return EpollBackend::create();
+		return EventLoop::createIOBackend();
+	}
+#endif
 };
 
 
@@ -39,24 +61,45 @@ private:
 	std::mutex _lock;
 };
 
+// all the loops log through one background thread, they never wait for std::cout
+static console::AsyncConsole::Ptr asyncConsole()
+{
+	static console::AsyncConsole::Ptr ret(new console::AsyncConsole(make_intrusive<Console>()));
+	return ret;
+}
+
 class Worker : public worker::WorkerWorker
 {
 public:
-	void loadUrl(duk_context *ctx, EventLoop *eventloop, const std::string &url) override
+	duk_context *createContext() override
 	{
-		// for testing, treat url as javascript eval
+		return AccountingAllocator::createHeap(memoryLimit(), true);
+	}
 
+	void destroyContext(duk_context *ctx) override
+	{
+		AccountingAllocator::destroyHeap(ctx);
+	}
+
+	void initContext(duk_context *ctx, EventLoop *eventloop) override
+	{
 		// register all libs on the worker context
 		eventtarget::RegisterEventTarget(eventloop);
 
 		auto CNHandler = console::RegisterConsole(eventloop);
-		CNHandler->setWorker(make_intrusive<Console>());
+		CNHandler->setWorker(asyncConsole()->writer());
 
 		auto STHandler = settimeout::RegisterSetTimeout(eventloop);
 
 		auto WKHandler = worker::RegisterWorker(eventloop);
 		WKHandler->setWorker(make_intrusive<Worker>());
 
+		sharedarraybuffer::RegisterSharedArrayBuffer(eventloop);
+	}
+
+	void loadUrl(duk_context *ctx, EventLoop *eventloop, const std::string &url) override
+	{
+		// for testing, treat url as javascript eval
 		if (duk_peval_string(ctx, url.c_str()) != 0)
 		{
 			ThrowError(ctx, -1);
@@ -118,6 +161,100 @@ w.postMessage("Message from main loop");
 
 }
 
+void test_sharedArrayBuffer(EventLoop &el)
+{
+	if (duk_peval_string(el.ctx(), R"(	
+
+var counter = new Int32Array(new SharedArrayBuffer(4));
+var sw = new Worker("onmessage = function(e) { for (var i = 0; i < 1000; i++) Atomics.add(e.data, 0, 1); postMessage('counted'); };");
+sw.addEventListener("message", function(e) { console.log("Shared counter from WORKER: " + Atomics.load(counter, 0)); } );
+
+sw.postMessage(counter);
+
+	)") != 0)
+	{
+		ThrowError(el.ctx(), -1);
+	}
+
+}
+
+// file written by test_fs, outside of the source tree
+static std::string tempFile()
+{
+	const char *dir = std::getenv("TMPDIR");
+	if (!dir)
+		dir = std::getenv("TEMP");
+	return std::string(dir ? dir : "/tmp") + "/dtel_example.txt";
+}
+
+void test_fs(EventLoop &el)
+{
+	duk_push_string(el.ctx(), tempFile().c_str());
+	duk_put_global_string(el.ctx(), "tempFile");
+
+	if (duk_peval_string(el.ctx(), R"(	
+
+fs.writeFile(tempFile, "Message from a file", function(err) {
+	if (err) { console.error("FS Error! " + err); return; }
+	fs.readFile(tempFile, "utf8", function(err, data) {
+		console.log("File contents: " + data);
+	});
+});
+
+	)") != 0)
+	{
+		ThrowError(el.ctx(), -1);
+	}
+
+}
+
+// polls and reads a pipe through the I/O backend of the loop, the callbacks must run on the loop thread
+void test_io(EventLoop &el, console::ConsoleWorker::Ptr out)
+{
+#ifdef __linux__
+	IOBackend *io = el.io();
+	int fds[2];
+	if (!io || ::pipe(fds) != 0)
+	{
+		out->output("error", "I/O backend not available");
+		return;
+	}
+
+	std::thread::id loop = std::this_thread::get_id();
+	auto check = [loop, out](const std::string &op) {
+		if (std::this_thread::get_id() != loop)
+			out->output("error", "I/O " + op + " callback NOT on the loop thread");
+	};
+
+	static const char message[] = "Message from a pipe";
+	std::shared_ptr<std::vector<char>> buffer(new std::vector<char>(64));
+	int rd = fds[0], wr = fds[1];
+
+	io->poll(rd, POLLIN, [=](int result) {
+		check("poll");
+		if (!(result & POLLIN))
+		{
+			out->output("error", "I/O poll result " + std::to_string(result));
+			return;
+		}
+		io->read(rd, buffer->data(), buffer->size(), -1, [=](int result) {
+			check("read");
+			if (result < 0)
+				out->output("error", "I/O read error " + std::to_string(-result));
+			else
+				out->output("log", "I/O " + std::string(io->name()) + " read: " + std::string(buffer->data(), result));
+			::close(rd);
+			::close(wr);
+		});
+	});
+	io->write(wr, message, std::strlen(message), -1, [=](int result) {
+		check("write");
+		if (result != static_cast<int>(std::strlen(message)))
+			out->output("error", "I/O write result " + std::to_string(result));
+	});
+#endif
+}
+
 int main(int argc, char *argv[])
 {
 	duk_context *ctx = duk_create_heap_default();
@@ -128,16 +265,28 @@ int main(int argc, char *argv[])
 		eventtarget::RegisterEventTarget(&el);
 
 		auto CNHandler = console::RegisterConsole(&el);
-		CNHandler->setWorker(make_intrusive<Console>());
+		CNHandler->setWorker(asyncConsole()->writer());
 
 		settimeout::RegisterSetTimeout(&el);
 
 		auto WKHandler = worker::RegisterWorker(&el);
-		WKHandler->setWorker(make_intrusive<Worker>());
+		auto worker = make_intrusive<Worker>();
+		// each worker heap can use up to 64MB
+		worker->setMemoryLimit(64 * 1024 * 1024);
+		WKHandler->setWorker(worker);
+		// keep 1 to 4 worker heaps warmed up
+		WKHandler->setPool(1, 4);
+
+		sharedarraybuffer::RegisterSharedArrayBuffer(&el);
+
+		fs::RegisterFS(&el);
 
 		test_console(el);
 		test_setTimeout(el);
 		test_worker(el);
+		test_sharedArrayBuffer(el);
+		test_fs(el);
+		test_io(el, CNHandler->worker());
 
 		std::thread t([&el] {
 			std::this_thread::sleep_for(std::chrono::milliseconds(7000));
@@ -151,6 +300,8 @@ int main(int argc, char *argv[])
 	}
 
 	duk_destroy_heap(ctx);
+	asyncConsole()->flush();
+	std::remove(tempFile().c_str());
 
 	std::cout << "PRESS ANY KEY TO CONTINUE";
 	std::cin.ignore();
@@ -0,0 +1,216 @@
+#pragma once
+
+#include "SlabAllocator.h"
+
+#include <duktape.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+
+namespace dtel {
+
+/**
+ * Memory usage of a heap
+ */
+struct HeapMemoryStats
+{
+	// bytes currently allocated by the heap
+	size_t live;
+	// highest amount of live bytes
+	size_t peak;
+	size_t allocations;
+	size_t frees;
+	// allocations refused by the limit
+	size_t failures;
+	// 0 = no limit
+	size_t limit;
+};
+
+/**
+ * Memory functions for duk_create_heap that account the memory used by the heap, and enforce a limit.
+ *
+ * An allocation that would go over the limit fails: duktape then runs a mark-and-sweep and retries, and
+ * if there is still no room the script receives a RangeError ("alloc failed"). In a Worker it is reported
+ * as an "error" event.
+ *
+ * Every allocation has a 16 byte header with its size. The memory comes from malloc, or from an owned
+ * SlabAllocator. The stats can be read from any thread.
+ */
+class AccountingAllocator
+{
+public:
+	explicit AccountingAllocator(size_t limit = 0, bool slab = false) :
+		_slab(slab ? new SlabAllocator() : NULL), _live(0), _peak(0), _allocations(0), _frees(0), _failures(0),
+		_limit(limit)
+	{
+	}
+
+	/**
+	 * Creates a heap that owns a new allocator, destroy it with destroyHeap
+	 */
+	static duk_context *createHeap(size_t limit = 0, bool slab = false, duk_fatal_function fatal = NULL)
+	{
+		AccountingAllocator *allocator = new AccountingAllocator(limit, slab);
+		duk_context *ctx = duk_create_heap(&AccountingAllocator::alloc, &AccountingAllocator::realloc,
+			&AccountingAllocator::free, allocator, fatal);
+		if (!ctx)
+			delete allocator;
+		return ctx;
+	}
+
+	/**
+	 * Destroys a heap created by createHeap, and its allocator
+	 */
+	static void destroyHeap(duk_context *ctx)
+	{
+		AccountingAllocator *allocator = get(ctx);
+		duk_destroy_heap(ctx);
+		delete allocator;
+	}
+
+	/**
+	 * Returns the allocator of the heap, or NULL if it doesn't use one
+	 */
+	static AccountingAllocator *get(duk_context *ctx)
+	{
+		duk_memory_functions funcs;
+		duk_get_memory_functions(ctx, &funcs);
+		if (funcs.alloc_func != &AccountingAllocator::alloc)
+			return NULL;
+		return static_cast<AccountingAllocator*>(funcs.udata);
+	}
+
+	static void *alloc(void *udata, duk_size_t size)
+	{
+		return static_cast<AccountingAllocator*>(udata)->allocate(size);
+	}
+
+	static void *realloc(void *udata, void *ptr, duk_size_t size)
+	{
+		return static_cast<AccountingAllocator*>(udata)->reallocate(ptr, size);
+	}
+
+	static void free(void *udata, void *ptr)
+	{
+		static_cast<AccountingAllocator*>(udata)->deallocate(ptr);
+	}
+
+	void *allocate(size_t size)
+	{
+		if (!reserve(size))
+			return NULL;
+		void *raw = _slab ? _slab->allocate(size + HEADER) : std::malloc(size + HEADER);
+		if (!raw)
+		{
+			release(size);
+			return NULL;
+		}
+		static_cast<Header*>(raw)->size = size;
+		_allocations.store(_allocations.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return static_cast<char*>(raw) + HEADER;
+	}
+
+	void *reallocate(void *ptr, size_t size)
+	{
+		if (!ptr)
+			return allocate(size);
+		if (size == 0)
+		{
+			deallocate(ptr);
+			return NULL;
+		}
+
+		Header *header = reinterpret_cast<Header*>(static_cast<char*>(ptr) - HEADER);
+		size_t oldSize = header->size;
+		if (size > oldSize && !reserve(size - oldSize))
+			return NULL;
+		void *raw = _slab ? _slab->reallocate(header, size + HEADER) : std::realloc(header, size + HEADER);
+		if (!raw)
+		{
+			if (size > oldSize)
+				release(size - oldSize);
+			return NULL;
+		}
+		if (size < oldSize)
+			release(oldSize - size);
+		static_cast<Header*>(raw)->size = size;
+		return static_cast<char*>(raw) + HEADER;
+	}
+
+	void deallocate(void *ptr)
+	{
+		if (!ptr)
+			return;
+		Header *header = reinterpret_cast<Header*>(static_cast<char*>(ptr) - HEADER);
+		release(header->size);
+		_frees.store(_frees.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		if (_slab)
+			_slab->deallocate(header);
+		else
+			std::free(header);
+	}
+
+	/**
+	 * Sets the maximum amount of live bytes, 0 = no limit. A lower limit than the current usage only
+	 * makes the next allocations fail.
+	 */
+	void setLimit(size_t limit)
+	{
+		_limit.store(limit, std::memory_order_relaxed);
+	}
+
+	HeapMemoryStats stats() const
+	{
+		return HeapMemoryStats{
+			_live.load(std::memory_order_relaxed),
+			_peak.load(std::memory_order_relaxed),
+			_allocations.load(std::memory_order_relaxed),
+			_frees.load(std::memory_order_relaxed),
+			_failures.load(std::memory_order_relaxed),
+			_limit.load(std::memory_order_relaxed),
+		};
+	}
+
+	AccountingAllocator(const AccountingAllocator &) = delete;
+	AccountingAllocator &operator=(const AccountingAllocator &) = delete;
+private:
+	struct Header
+	{
+		size_t size;
+	};
+
+	// keeps the 16 byte alignment of the memory
+	static const size_t HEADER = 16;
+
+	// only the heap thread writes the counters, so they don't need atomic increments
+	bool reserve(size_t size)
+	{
+		size_t live = _live.load(std::memory_order_relaxed) + size;
+		size_t limit = _limit.load(std::memory_order_relaxed);
+		if (limit > 0 && live > limit)
+		{
+			_failures.store(_failures.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return false;
+		}
+		_live.store(live, std::memory_order_relaxed);
+		if (live > _peak.load(std::memory_order_relaxed))
+			_peak.store(live, std::memory_order_relaxed);
+		return true;
+	}
+
+	void release(size_t size)
+	{
+		_live.store(_live.load(std::memory_order_relaxed) - size, std::memory_order_relaxed);
+	}
+
+	std::unique_ptr<SlabAllocator> _slab;
+	std::atomic<size_t> _live;
+	std::atomic<size_t> _peak;
+	std::atomic<size_t> _allocations;
+	std::atomic<size_t> _frees;
+	std::atomic<size_t> _failures;
+	std::atomic<size_t> _limit;
+};
+
+}
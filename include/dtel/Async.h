@@ -0,0 +1,374 @@
+#pragma once
+
+#include "EventLoop.h"
+#include "Event.h"
+#include "Ref.h"
+#include "Value.h"
+#include "ValueObject.h"
+#include "Exception.h"
+#include "detail/external.h"
+#include "detail/optional.hpp"
+
+#include <duktape.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace dtel {
+
+/**
+ * Result of an async operation: the value returned by the work, or the message of the exception it threw
+ */
+template <typename R>
+class AsyncResult
+{
+public:
+	AsyncResult() : _value(), _failed(false), _error() {}
+
+	bool ok() const
+	{
+		return !_failed;
+	}
+
+	R &value()
+	{
+		return *_value;
+	}
+
+	const std::string &error() const
+	{
+		return _error;
+	}
+
+	void setValue(R &&value)
+	{
+		_value = std::move(value);
+	}
+
+	void setError(const std::string &error)
+	{
+		_failed = true;
+		_error = error;
+	}
+private:
+	std::experimental::optional<R> _value;
+	bool _failed;
+	std::string _error;
+};
+
+template <>
+class AsyncResult<void>
+{
+public:
+	AsyncResult() : _failed(false), _error() {}
+
+	bool ok() const
+	{
+		return !_failed;
+	}
+
+	const std::string &error() const
+	{
+		return _error;
+	}
+
+	void setError(const std::string &error)
+	{
+		_failed = true;
+		_error = error;
+	}
+private:
+	bool _failed;
+	std::string _error;
+};
+
+//
+// Push the value of an async result. Overloads for other types can be declared in the namespace of the type.
+//
+
+inline void PushAsyncValue(duk_context *ctx, bool value)
+{
+	duk_push_boolean(ctx, value);
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_arithmetic<T>::value>::type PushAsyncValue(duk_context *ctx, T value)
+{
+	duk_push_number(ctx, static_cast<duk_double_t>(value));
+}
+
+inline void PushAsyncValue(duk_context *ctx, const std::string &value)
+{
+	duk_push_lstring(ctx, value.data(), value.size());
+}
+
+/**
+ * Bytes are pushed as an ArrayBuffer
+ */
+inline void PushAsyncValue(duk_context *ctx, const std::vector<uint8_t> &value)
+{
+	void *data = duk_push_fixed_buffer(ctx, value.size());
+	if (!value.empty())
+		std::memcpy(data, value.data(), value.size());
+	duk_push_buffer_object(ctx, -1, 0, value.size(), DUK_BUFOBJ_ARRAYBUFFER);
+	duk_remove(ctx, -2);
+}
+
+/**
+ * External blocks are pushed as an ArrayBuffer over their memory, without copying. A null block pushes null.
+ */
+inline void PushAsyncValue(duk_context *ctx, const detail::ExternalBlock::Ptr &value)
+{
+	if (value)
+		detail::push_external_arraybuffer(ctx, value.get());
+	else
+		duk_push_null(ctx);
+}
+
+inline void PushAsyncValue(duk_context *ctx, const Value::Ptr &value)
+{
+	if (!value || value->push(ctx) == 0)
+		duk_push_undefined(ctx);
+}
+
+inline void PushAsyncValue(duk_context *ctx, const linb::any &value)
+{
+	PushAnyValue(ctx, value);
+}
+
+namespace detail {
+
+	static const char* PROP_ASYNC_RESOLVERS = "\xFF" "DTEL_ASYNC_RESOLVERS";
+
+	template <typename R>
+	struct AsyncInvoke
+	{
+		template <typename W>
+		static void run(W &work, AsyncResult<R> &result)
+		{
+			result.setValue(work());
+		}
+
+		static void push(duk_context *ctx, AsyncResult<R> &result)
+		{
+			PushAsyncValue(ctx, result.value());
+		}
+	};
+
+	template <>
+	struct AsyncInvoke<void>
+	{
+		template <typename W>
+		static void run(W &work, AsyncResult<void> &result)
+		{
+			work();
+		}
+
+		static void push(duk_context *ctx, AsyncResult<void> &result)
+		{
+			duk_push_undefined(ctx);
+		}
+	};
+
+	/**
+	 * Event that delivers the result of an async operation on the loop thread
+	 */
+	template <typename R, typename C>
+	class AsyncEvent : public Event
+	{
+	public:
+		AsyncEvent(C &&complete) :
+			Event(), result(), _complete(std::move(complete))
+		{}
+
+		void apply(duk_context *ctx) override
+		{
+			_complete(ctx, result);
+		}
+
+		void release(duk_context *ctx) override
+		{
+
+		}
+
+		AsyncResult<R> result;
+	private:
+		C _complete;
+	};
+
+	/**
+	 * Calls the function on the top of the stack with the result, as (error, result) or
+	 * (error) on failure, and pops it
+	 */
+	template <typename R>
+	void async_call(duk_context *ctx, AsyncResult<R> &result, bool errorFirst)
+	{
+		duk_int_t callret;
+		if (result.ok())
+		{
+			if (errorFirst)
+				duk_push_null(ctx);
+			AsyncInvoke<R>::push(ctx, result);
+			callret = duk_pcall(ctx, errorFirst ? 2 : 1);
+		}
+		else
+		{
+			duk_push_error_object(ctx, DUK_ERR_ERROR, "%s", result.error().c_str());
+			callret = duk_pcall(ctx, 1);
+		}
+
+		if (callret != DUK_EXEC_SUCCESS)
+		{
+			ThrowError(ctx, -1);
+		}
+		duk_pop(ctx);
+	}
+
+	inline duk_ret_t r_async_promise_executor(duk_context *ctx)
+	{
+		// keep [resolve, reject] until PushAsyncPromise gets them
+		duk_push_heap_stash(ctx);
+		duk_push_array(ctx);
+		duk_dup(ctx, 0);
+		duk_put_prop_index(ctx, -2, 0);
+		duk_dup(ctx, 1);
+		duk_put_prop_index(ctx, -2, 1);
+		duk_put_prop_string(ctx, -2, PROP_ASYNC_RESOLVERS);
+		duk_pop(ctx);
+		return 0;
+	}
+
+}
+
+namespace detail {
+
+	/**
+	 * Owns the event of an async operation until it is posted to the loop. If the task is dropped
+	 * without running, the event is posted with an error, so it is still released on the loop thread.
+	 */
+	template <typename E>
+	class AsyncDelivery
+	{
+	public:
+		AsyncDelivery(EventLoop *eventloop, IntrusiveRefCntPtr<E> event) :
+			_eventloop(eventloop), _event(std::move(event)) {}
+
+		AsyncDelivery(AsyncDelivery &&other) noexcept :
+			_eventloop(other._eventloop), _event(std::move(other._event)) {}
+
+		~AsyncDelivery()
+		{
+			if (_event)
+			{
+				_event->result.setError("Task cancelled");
+				deliver();
+			}
+		}
+
+		E *event() const
+		{
+			return _event.get();
+		}
+
+		void deliver()
+		{
+			_eventloop->postEvent(std::move(_event));
+		}
+
+		AsyncDelivery(const AsyncDelivery &) = delete;
+		AsyncDelivery &operator=(const AsyncDelivery &) = delete;
+	private:
+		EventLoop *_eventloop;
+		IntrusiveRefCntPtr<E> _event;
+	};
+
+}
+
+/**
+ * Runs "work" on the task threads of the loop, then calls "complete" on the loop thread with
+ * (duk_context *ctx, AsyncResult<R> &result), R being the type returned by work.
+ * An exception thrown by work is delivered as the result error, one thrown by complete goes to
+ * the loop processException. If the task is dropped because of the options, the result error is
+ * "Task cancelled".
+ */
+template <typename W, typename C>
+void RunAsync(EventLoop *eventloop, W &&work, C &&complete, const TaskOptions &options = TaskOptions())
+{
+	typedef decltype(work()) result_t;
+	typedef detail::AsyncEvent<result_t, typename std::decay<C>::type> event_t;
+
+	IntrusiveRefCntPtr<event_t> event(new event_t(typename std::decay<C>::type(std::forward<C>(complete))));
+	detail::AsyncDelivery<event_t> delivery(eventloop, std::move(event));
+	eventloop->postTask([delivery = std::move(delivery), work = std::forward<W>(work)]() mutable {
+		try
+		{
+			detail::AsyncInvoke<result_t>::run(work, delivery.event()->result);
+		}
+		catch (std::exception &e)
+		{
+			delivery.event()->result.setError(e.what());
+		}
+		catch (...)
+		{
+			delivery.event()->result.setError("Unknown error");
+		}
+		// no reference is kept on this thread, the event and its refs are released by the loop
+		delivery.deliver();
+	}, options);
+}
+
+/**
+ * Runs "work" on the task threads of the loop, then calls the javascript function at "callback" on
+ * the loop thread, as callback(null, result) or callback(error)
+ */
+template <typename W>
+void RunAsyncCallback(EventLoop *eventloop, duk_idx_t callback, W &&work, const TaskOptions &options = TaskOptions())
+{
+	duk_context *ctx = eventloop->ctx();
+	duk_require_function(ctx, callback);
+	duk_dup(ctx, callback);
+	Ref::Ptr ref(new Ref(ctx));
+
+	RunAsync(eventloop, std::forward<W>(work), [ref](duk_context *ctx, auto &result) {
+		ref->push(ctx);
+		detail::async_call(ctx, result, true);
+	}, options);
+}
+
+/**
+ * Runs "work" on the task threads of the loop, and pushes a promise settled with its result on the
+ * loop thread. The heap must have a Promise implementation, duktape doesn't include one.
+ */
+template <typename W>
+void PushAsyncPromise(EventLoop *eventloop, W &&work, const TaskOptions &options = TaskOptions())
+{
+	duk_context *ctx = eventloop->ctx();
+	if (!duk_get_global_string(ctx, "Promise") || !duk_is_constructable(ctx, -1))
+	{
+		duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "Promise is not available");
+		duk_throw(ctx);
+	}
+
+	duk_push_c_function(ctx, detail::r_async_promise_executor, 2);
+	duk_new(ctx, 1);
+
+	duk_push_heap_stash(ctx);
+	duk_get_prop_string(ctx, -1, detail::PROP_ASYNC_RESOLVERS);
+	duk_del_prop_string(ctx, -2, detail::PROP_ASYNC_RESOLVERS);
+	duk_remove(ctx, -2);
+	// the promise stays on the stack
+	Ref::Ptr resolvers(new Ref(ctx));
+
+	RunAsync(eventloop, std::forward<W>(work), [resolvers](duk_context *ctx, auto &result) {
+		resolvers->push(ctx);
+		duk_get_prop_index(ctx, -1, result.ok() ? 0 : 1);
+		duk_remove(ctx, -2);
+		detail::async_call(ctx, result, false);
+	}, options);
+}
+
+}
@@ -0,0 +1,278 @@
+#pragma once
+
+#include "IOBackend.h"
+#include "Exception.h"
+
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace dtel {
+
+/**
+ * IOBackend over epoll, for when io_uring is not available. The loop sleeps in epoll_wait, and is woken
+ * by an eventfd.
+ *
+ * Reads and writes wait for the readiness of the descriptor, then run the syscall. Regular files are
+ * always ready, their operations run when submitted and complete on the next wait.
+ */
+class EpollBackend : public IOBackend
+{
+public:
+	/**
+	 * Creates the epoll instance, or returns NULL on failure
+	 */
+	static IOBackend::Ptr create()
+	{
+		std::unique_ptr<EpollBackend> ret(new EpollBackend());
+		if (!ret->init())
+			return IOBackend::Ptr();
+		return IOBackend::Ptr(ret.release());
+	}
+
+	~EpollBackend()
+	{
+		if (_epollfd >= 0)
+			::close(_epollfd);
+		if (_eventfd >= 0)
+			::close(_eventfd);
+	}
+
+	const char *name() const override
+	{
+		return "epoll";
+	}
+
+	void wait(std::chrono::steady_clock::time_point deadline) override
+	{
+		int timeout = 0;
+		if (_completed.empty())
+		{
+			auto now = std::chrono::steady_clock::now();
+			if (deadline > now)
+			{
+				// round up, so the loop doesn't wake before the deadline
+				auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now +
+					std::chrono::milliseconds(1) - std::chrono::nanoseconds(1)).count();
+				timeout = ms > 0x7fffffff ? 0x7fffffff : static_cast<int>(ms);
+			}
+		}
+
+		epoll_event events[MAX_EVENTS];
+		int count = ::epoll_wait(_epollfd, events, MAX_EVENTS, timeout);
+		if (count < 0 && errno != EINTR)
+			throw Exception(std::string("epoll_wait failed: ") + std::strerror(errno));
+
+		for (int i = 0; i < count; i++)
+		{
+			if (events[i].data.fd == _eventfd)
+			{
+				uint64_t value;
+				while (::read(_eventfd, &value, sizeof(value)) < 0 && errno == EINTR) {}
+				// a wake() after this point writes the eventfd again
+				_notified.store(false, std::memory_order_release);
+				continue;
+			}
+			ready(events[i].data.fd, events[i].events);
+		}
+
+		dispatch();
+	}
+
+	void wake() override
+	{
+		// a single write until the loop consumes it
+		if (!_notified.exchange(true, std::memory_order_acq_rel))
+		{
+			uint64_t value = 1;
+			ssize_t ret;
+			do
+			{
+				ret = ::write(_eventfd, &value, sizeof(value));
+			} while (ret < 0 && errno == EINTR);
+		}
+	}
+
+	void read(int fd, void *data, size_t size, int64_t offset, callback_t callback) override
+	{
+		submit(new Operation(OP_READ, fd, data, size, offset, std::move(callback)));
+	}
+
+	void write(int fd, const void *data, size_t size, int64_t offset, callback_t callback) override
+	{
+		submit(new Operation(OP_WRITE, fd, const_cast<void*>(data), size, offset, std::move(callback)));
+	}
+
+	void poll(int fd, short events, callback_t callback) override
+	{
+		Operation *op = new Operation(OP_POLL, fd, NULL, 0, 0, std::move(callback));
+		op->events = static_cast<uint32_t>(static_cast<uint16_t>(events));
+		submit(op);
+	}
+
+	size_t pending() const override
+	{
+		size_t ret = _completed.size();
+		for (auto &fd : _fds)
+			ret += fd.second.size();
+		return ret;
+	}
+
+	EpollBackend(const EpollBackend &) = delete;
+	EpollBackend &operator=(const EpollBackend &) = delete;
+private:
+	enum operation_t {
+		OP_READ,
+		OP_WRITE,
+		OP_POLL,
+	};
+
+	struct Operation
+	{
+		Operation(operation_t type, int fd, void *data, size_t size, int64_t offset, callback_t &&callback) :
+			type(type), fd(fd), data(data), size(size), offset(offset),
+			events(type == OP_WRITE ? EPOLLOUT : EPOLLIN), callback(std::move(callback)) {}
+
+		operation_t type;
+		int fd;
+		void *data;
+		size_t size;
+		int64_t offset;
+		uint32_t events;
+		callback_t callback;
+	};
+
+	typedef std::unique_ptr<Operation> operation_ptr;
+
+	static const int MAX_EVENTS = 64;
+
+	EpollBackend() : _epollfd(-1), _eventfd(-1), _notified(false), _fds(), _completed() {}
+
+	bool init()
+	{
+		_epollfd = ::epoll_create1(EPOLL_CLOEXEC);
+		if (_epollfd < 0)
+			return false;
+		_eventfd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (_eventfd < 0)
+			return false;
+		epoll_event ev;
+		std::memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = _eventfd;
+		return ::epoll_ctl(_epollfd, EPOLL_CTL_ADD, _eventfd, &ev) == 0;
+	}
+
+	void submit(Operation *op)
+	{
+		operation_ptr owner(op);
+		auto &ops = _fds[op->fd];
+		bool added = ops.empty();
+		ops.push_back(std::move(owner));
+		if (update(op->fd, added))
+			return;
+
+		// not pollable, regular files are always ready
+		operation_ptr done(std::move(ops.back()));
+		ops.pop_back();
+		if (ops.empty())
+			_fds.erase(op->fd);
+		int result = op->type == OP_POLL ? static_cast<int>(op->events) : run(op);
+		_completed.emplace_back(std::move(done), result);
+	}
+
+	/**
+	 * Sets the events of the descriptor to the ones of its operations, returns false if it can't be polled
+	 */
+	bool update(int fd, bool add)
+	{
+		auto i = _fds.find(fd);
+		epoll_event ev;
+		std::memset(&ev, 0, sizeof(ev));
+		ev.data.fd = fd;
+		if (i == _fds.end() || i->second.empty())
+		{
+			if (i != _fds.end())
+				_fds.erase(i);
+			::epoll_ctl(_epollfd, EPOLL_CTL_DEL, fd, &ev);
+			return true;
+		}
+		for (auto &op : i->second)
+			ev.events |= op->events;
+		return ::epoll_ctl(_epollfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) == 0;
+	}
+
+	/**
+	 * Runs the syscall of the operation, returns the result or -errno
+	 */
+	int run(Operation *op)
+	{
+		ssize_t ret;
+		do
+		{
+			if (op->type == OP_READ)
+				ret = op->offset >= 0 ? ::pread(op->fd, op->data, op->size, op->offset) : ::read(op->fd, op->data, op->size);
+			else
+				ret = op->offset >= 0 ? ::pwrite(op->fd, op->data, op->size, op->offset) : ::write(op->fd, op->data, op->size);
+		} while (ret < 0 && errno == EINTR);
+		return ret < 0 ? -errno : static_cast<int>(ret);
+	}
+
+	void ready(int fd, uint32_t events)
+	{
+		auto i = _fds.find(fd);
+		if (i == _fds.end())
+			return;
+		for (auto op = i->second.begin(); op != i->second.end();)
+		{
+			uint32_t matched = events & ((*op)->events | EPOLLERR | EPOLLHUP);
+			if (matched == 0)
+			{
+				++op;
+				continue;
+			}
+			int result = (*op)->type == OP_POLL ? static_cast<int>(matched) : run(op->get());
+			if (result == -EAGAIN || result == -EWOULDBLOCK)
+			{
+				++op;
+				continue;
+			}
+			_completed.emplace_back(std::move(*op), result);
+			op = i->second.erase(op);
+		}
+		update(fd, false);
+	}
+
+	void dispatch()
+	{
+		// the callbacks can submit operations
+		while (!_completed.empty())
+		{
+			auto completed = std::move(_completed.front());
+			_completed.pop_front();
+			completed.first->callback(completed.second);
+		}
+	}
+
+	int _epollfd;
+	int _eventfd;
+	std::atomic<bool> _notified;
+	std::unordered_map<int, std::list<operation_ptr>> _fds;
+	std::list<std::pair<operation_ptr, int>> _completed;
+};
+
+}
+
+#endif
@@ -4,12 +4,18 @@
 
 #include <duktape.h>
 
+#include <functional>
+
 namespace dtel {
 
 class Event : public ThreadSafeRefCountedBase<Event>
 {
 public:
 	typedef IntrusiveRefCntPtr<Event> Ptr;
+	/**
+	 * Error callback of dispatches that deliver several events. Returning false will rethrow the exception
+	 */
+	typedef std::function<bool(const std::exception &e)> error_func_t;
 
 	virtual ~Event() {}
 
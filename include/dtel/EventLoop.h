@@ -2,23 +2,32 @@
 
 #include "Event.h"
 #include "Task.h"
+#include "TaskScheduler.h"
 #include "LoopRunner.h"
+#include "IOBackend.h"
+#include "IOUringBackend.h"
+#include "EpollBackend.h"
 #include "Ref.h"
 #include "ResetStackOnScopeExit.h"
 #include "Value.h"
 #include "ValueObject.h"
 #include "Exception.h"
 #include "detail/refs.h"
-#include "detail/ctpl_stl.h"
 
 #include <duktape.h>
 
+#include <functional>
 #include <list>
 #include <mutex>
 #include <chrono>
 #include <condition_variable>
+#include <algorithm>
 #include <atomic>
+#include <future>
 #include <iostream>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 namespace dtel {
 
@@ -29,15 +38,20 @@ public:
 	 * Constructor
 	 */
 	EventLoop(duk_context *ctx) : 
-		_ctx(ctx), _mutex(), _terminated(false), _events(), _tasks(3)
+		_ctx(ctx), _mutex(), _terminated(false), _events(), _changed(false), _io(), _iowake(NULL), _iocreated(false),
+		_tasks(std::max(1u, std::thread::hardware_concurrency() / 2))
 	{
 		detail::duv_ref_setup(ctx);
 	}
 
 	/**
-	 * Destructor
+	 * Destructor, calls the shutdown handlers first
 	 */
-	virtual ~EventLoop() {}
+	virtual ~EventLoop()
+	{
+		for (auto &handler : _shutdownhandlers)
+			handler();
+	}
 
 	/**
 	 * Returns the duktape context
@@ -49,10 +63,22 @@ public:
 
 	/**
 	 * Notify that the event list must be re-evaluated.
+	 * The notification is kept if the loop is not sleeping, so it is never lost.
 	 */
 	void notifyChanged()
 	{
-		_events_cv.notify_one();
+		IOBackend *io = _iowake.load(std::memory_order_acquire);
+		if (io)
+			io->wake();
+		else
+		{
+			{
+				std::lock_guard<std::mutex> lock(_events_mt);
+				_changed = true;
+			}
+			_events_cv.notify_one();
+		}
+		onChanged();
 	}
 
 	/**
@@ -67,9 +93,57 @@ public:
 		notifyChanged();
 	}
 
-	void postTask(Task::Ptr task)
+	/**
+	 * Runs the task on the task threads, by default the ones of TaskScheduler::shared().
+	 * At most the task thread count of the loop tasks run at the same time, the others wait their turn,
+	 * by priority. Tasks cancelled or past their deadline before starting are dropped.
+	 */
+	void postTask(Task::Ptr task, const TaskOptions &options = TaskOptions())
+	{
+		_tasks.post([task] { task->run(); }, options);
+	}
+
+	/**
+	 * Runs the functor on the task threads, small functors are stored without allocating
+	 */
+	template <typename F, typename = typename std::enable_if<!std::is_convertible<F, Task::Ptr>::value>::type>
+	void postTask(F &&func, const TaskOptions &options = TaskOptions())
+	{
+		_tasks.post(std::forward<F>(func), options);
+	}
+
+	/**
+	 * Runs the functor on the task threads, the future receives its result or exception, or a
+	 * broken_promise error if the task is dropped
+	 */
+	template <typename F>
+	auto submitTask(F &&func, const TaskOptions &options = TaskOptions()) -> std::future<decltype(func())>
+	{
+		return _tasks.submit(std::forward<F>(func), options);
+	}
+
+	/**
+	 * Queue metrics of the loop tasks of the priority class
+	 */
+	TaskQueueStats taskStats(task_priority_t priority) const
+	{
+		return _tasks.stats(priority);
+	}
+
+	/**
+	 * Returns the I/O backend the loop waits on, created by createIOBackend on first use, or NULL if there is
+	 * none and run() waits on a condition variable.
+	 * Operations must be submitted on the loop thread, their callbacks run on it while run() waits.
+	 */
+	IOBackend *io()
 	{
-		_tasks.push([task](int id) { task->run(); });
+		if (!_iocreated)
+		{
+			_iocreated = true;
+			_io = createIOBackend();
+			_iowake.store(_io.get(), std::memory_order_release);
+		}
+		return _io.get();
 	}
 
 	/**
@@ -84,11 +158,23 @@ public:
 		});
 	}
 
+	/**
+	 * Adds a function called when the loop is destroyed, while its heap still exists, to detach what other
+	 * threads post events through
+	 */
+	void addShutdownHandler(std::function<void()> handler)
+	{
+		std::lock_guard<std::recursive_mutex> lock(_mutex);
+		_shutdownhandlers.push_back(std::move(handler));
+	}
+
 	/**
 	 * Runs the event loop
 	 */
 	void run()
 	{
+		IOBackend *io = this->io();
+
 		_terminated = false;
 		while (!_terminated)
 		{
@@ -96,69 +182,33 @@ public:
 			// wait 2000 ms by default
 			auto timeout(now + std::chrono::milliseconds(2000));
 
-			// loop runners
-			{
-				std::unique_lock<std::recursive_mutex> lock(_mutex);
-				for (auto lr : _looprunners)
-				{
-					auto newtimeout = lr.second->looped(_ctx);
-					if (newtimeout && *newtimeout < timeout)
-						timeout = *newtimeout;
-				}
-			}
+			LoopRunner::looped_result_t next;
+			step(next);
+			if (next && *next < timeout)
+				timeout = *next;
 
-			// run events
-			while (true)
+			if (io)
 			{
-				Event::Ptr event;
-
+				// sleep, and run the callbacks of the completed I/O
+				ResetStackOnScopeExit r(_ctx);
+				try
 				{
-					// retrieve the first event
-					std::unique_lock<std::recursive_mutex> lock(_mutex);
-					if (!_events.empty())
-					{
-						event = _events.front();
-						_events.pop_front();
-					}
+					io->wait(timeout);
 				}
-
-				if (event)
+				catch (std::exception &e)
 				{
-					ResetStackOnScopeExit r(_ctx);
-
-					// call event
-					try
-					{
-						event->apply(_ctx);
-					}
-					catch (std::exception &e) 
-					{
-						if (!processException(e))
-							throw;
-					}
-
-					// release event
-					try
-					{
-						event->release(_ctx);
-					}
-					catch (std::exception &e)
-					{
-						if (!processException(e))
-							throw;
-					}
+					if (!processException(e))
+						throw;
 				}
-				else
-					break;
 			}
-
-
+			else
 			{
 				// sleep the time needed for the next event
 				std::unique_lock<std::mutex> cvlock(_events_mt);
 				
 				//std::cout << "--- SLEEP FOR " << std::chrono::duration_cast<std::chrono::milliseconds>(timeout - now).count() << std::endl;
-				_events_cv.wait_until(cvlock, timeout);
+				_events_cv.wait_until(cvlock, timeout, [this] { return _changed; });
+				_changed = false;
 			}
 	
 		}
@@ -168,11 +218,83 @@ public:
 	}
 
 	/**
-	 * Terminate the message loop
+	 * Runs the loop runners and the pending events once, without waiting, so the loop can be driven
+	 * by a scheduler instead of run(). At most maxEvents events are applied (0 = all), none
+	 * after terminate().
+	 * "timeout" receives the time the loop runners must run again, if any.
+	 * Returns whether events are still pending.
+	 */
+	bool step(LoopRunner::looped_result_t &timeout, size_t maxEvents = 0)
+	{
+		// loop runners
+		{
+			std::unique_lock<std::recursive_mutex> lock(_mutex);
+			for (auto lr : _looprunners)
+			{
+				auto newtimeout = lr.second->looped(_ctx);
+				if (newtimeout && (!timeout || *newtimeout < *timeout))
+					timeout = newtimeout;
+			}
+		}
+
+		// run events
+		for (size_t count = 0; maxEvents == 0 || count < maxEvents; count++)
+		{
+			if (_terminated)
+				return false;
+
+			Event::Ptr event;
+
+			{
+				// retrieve the first event
+				std::unique_lock<std::recursive_mutex> lock(_mutex);
+				if (!_events.empty())
+				{
+					event = _events.front();
+					_events.pop_front();
+				}
+			}
+
+			if (!event)
+				return false;
+
+			ResetStackOnScopeExit r(_ctx);
+
+			// call event
+			try
+			{
+				event->apply(_ctx);
+			}
+			catch (std::exception &e) 
+			{
+				if (!processException(e))
+					throw;
+			}
+
+			// release event
+			try
+			{
+				event->release(_ctx);
+			}
+			catch (std::exception &e)
+			{
+				if (!processException(e))
+					throw;
+			}
+		}
+
+		std::unique_lock<std::recursive_mutex> lock(_mutex);
+		return !_events.empty();
+	}
+
+	/**
+	 * Terminate the message loop, waking it if it is sleeping.
+	 * No more events are applied, including the remaining ones of a step.
 	 */
 	void terminate()
 	{
 		_terminated = true;
+		notifyChanged();
 	}
 
 	/**
@@ -185,11 +307,41 @@ public:
 	}
 
 	/**
-	 * Sets the task thread count
+	 * Creates the I/O backend of the loop: io_uring, or epoll if it is not available
+	 */
+	virtual IOBackend::Ptr createIOBackend()
+	{
+#ifdef __linux__
+		IOBackend::Ptr ret(IOUringBackend::create());
+		if (!ret)
+			ret = EpollBackend::create();
+		return ret;
+#else
+		return IOBackend::Ptr();
+#endif
+	}
+
+	/**
+	 * Called by notifyChanged, from any thread. A loop driven by a scheduler uses it to be scheduled again.
+	 */
+	virtual void onChanged()
+	{
+	}
+
+	/**
+	 * Sets the maximum amount of tasks of this loop running at the same time, by default half the cores
 	 */
 	void setTaskThreadCount(int count)
 	{
-		_tasks.resize(count);
+		_tasks.setConcurrency(count > 0 ? count : 1);
+	}
+
+	/**
+	 * Sets the scheduler that runs the tasks, before posting any. NULL = the shared scheduler.
+	 */
+	void setTaskScheduler(TaskScheduler *scheduler)
+	{
+		_tasks.setScheduler(scheduler);
 	}
 
 private:
@@ -202,8 +354,15 @@ private:
 	events_t _events;
 	std::mutex _events_mt;
 	std::condition_variable _events_cv;
+	bool _changed;
 	looprunners_t _looprunners;
-	ctpl::thread_pool _tasks;
+	std::vector<std::function<void()>> _shutdownhandlers;
+	IOBackend::Ptr _io;
+	// the backend, once run() can be waiting on it
+	std::atomic<IOBackend*> _iowake;
+	bool _iocreated;
+	// destroyed first: it waits for the running tasks, which can still post events and wake the backend
+	TaskGroup _tasks;
 };
 
 }
\ No newline at end of file
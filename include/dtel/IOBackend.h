@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace dtel {
+
+/**
+ * What the event loop waits on: it sleeps until woken, until a deadline, or until a submitted operation
+ * completes, and runs the callbacks of the completed operations.
+ *
+ * Only wake() can be called from any thread, everything else runs on the loop thread.
+ */
+class IOBackend
+{
+public:
+	typedef std::unique_ptr<IOBackend> Ptr;
+	/**
+	 * Receives the result of an operation: the amount of bytes, the ready poll events, or -errno
+	 */
+	typedef std::function<void(int result)> callback_t;
+
+	virtual ~IOBackend() {}
+
+	/**
+	 * Name of the backend, for diagnostics
+	 */
+	virtual const char *name() const = 0;
+
+	/**
+	 * Sleeps until wake() is called, an operation completes or the deadline passes, then runs the callbacks
+	 * of the completed operations. An exception thrown by a callback leaves the next completions for the next wait.
+	 */
+	virtual void wait(std::chrono::steady_clock::time_point deadline) = 0;
+
+	/**
+	 * Wakes the wait, from any thread. If the loop is not waiting, its next wait returns at once.
+	 */
+	virtual void wake() = 0;
+
+	/**
+	 * Reads into the memory, which must stay valid until the callback. A negative offset reads from the
+	 * current position of the file. Like the system call, it can transfer less than the size.
+	 */
+	virtual void read(int fd, void *data, size_t size, int64_t offset, callback_t callback) = 0;
+
+	/**
+	 * Writes the memory, which must stay valid until the callback. A negative offset writes at the
+	 * current position of the file. Like the system call, it can transfer less than the size.
+	 */
+	virtual void write(int fd, const void *data, size_t size, int64_t offset, callback_t callback) = 0;
+
+	/**
+	 * Waits until the descriptor has any of the poll events (POLLIN, POLLOUT), the result are the ready events
+	 */
+	virtual void poll(int fd, short events, callback_t callback) = 0;
+
+	/**
+	 * Amount of operations waiting for completion
+	 */
+	virtual size_t pending() const = 0;
+};
+
+}
@@ -0,0 +1,337 @@
+#pragma once
+
+#include "IOBackend.h"
+#include "Exception.h"
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+namespace dtel {
+
+/**
+ * IOBackend over an io_uring, used through the raw syscalls. The sleep, the wakeup (a read on an eventfd),
+ * the deadline and the submission of the pending operations all happen in a single io_uring_enter.
+ *
+ * Needs Linux 5.11 (IORING_FEAT_EXT_ARG), create() returns NULL if the ring can't be used.
+ */
+class IOUringBackend : public IOBackend
+{
+public:
+	/**
+	 * Creates the ring, or returns NULL if io_uring is not available
+	 */
+	static IOBackend::Ptr create(unsigned entries = 256)
+	{
+		std::unique_ptr<IOUringBackend> ret(new IOUringBackend());
+		if (!ret->init(entries))
+			return IOBackend::Ptr();
+		return IOBackend::Ptr(ret.release());
+	}
+
+	~IOUringBackend()
+	{
+		// the kernel cancels the operations still running when the ring is closed
+		if (_ringfd >= 0)
+			::close(_ringfd);
+		if (_eventfd >= 0)
+			::close(_eventfd);
+		if (_sqes)
+			::munmap(_sqes, _sqesSize);
+		if (_cqRing && _cqRing != _sqRing)
+			::munmap(_cqRing, _cqRingSize);
+		if (_sqRing)
+			::munmap(_sqRing, _sqRingSize);
+		for (Operation *op : _operations)
+			delete op;
+	}
+
+	const char *name() const override
+	{
+		return "io_uring";
+	}
+
+	void wait(std::chrono::steady_clock::time_point deadline) override
+	{
+		auto timeout = deadline - std::chrono::steady_clock::now();
+		if (timeout < std::chrono::steady_clock::duration::zero())
+			timeout = std::chrono::steady_clock::duration::zero();
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+
+		struct __kernel_timespec ts;
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		struct io_uring_getevents_arg arg;
+		std::memset(&arg, 0, sizeof(arg));
+		arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+		// submits and sleeps in one call, returns as soon as there is a completion
+		int ret = enter(_toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		if (ret > 0)
+			_toSubmit -= static_cast<unsigned>(ret);
+		else if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+			throw Exception(std::string("io_uring_enter failed: ") + std::strerror(errno));
+
+		dispatch();
+	}
+
+	void wake() override
+	{
+		// a single write until the loop consumes it
+		if (!_notified.exchange(true, std::memory_order_acq_rel))
+		{
+			uint64_t value = 1;
+			ssize_t ret;
+			do
+			{
+				ret = ::write(_eventfd, &value, sizeof(value));
+			} while (ret < 0 && errno == EINTR);
+		}
+	}
+
+	void read(int fd, void *data, size_t size, int64_t offset, callback_t callback) override
+	{
+		io_uring_sqe *sqe = prepare(IORING_OP_READ, fd, new Operation(std::move(callback)));
+		sqe->addr = reinterpret_cast<uint64_t>(data);
+		sqe->len = length(size);
+		sqe->off = static_cast<uint64_t>(offset);
+	}
+
+	void write(int fd, const void *data, size_t size, int64_t offset, callback_t callback) override
+	{
+		io_uring_sqe *sqe = prepare(IORING_OP_WRITE, fd, new Operation(std::move(callback)));
+		sqe->addr = reinterpret_cast<uint64_t>(data);
+		sqe->len = length(size);
+		sqe->off = static_cast<uint64_t>(offset);
+	}
+
+	void poll(int fd, short events, callback_t callback) override
+	{
+		io_uring_sqe *sqe = prepare(IORING_OP_POLL_ADD, fd, new Operation(std::move(callback)));
+		sqe->poll32_events = static_cast<uint16_t>(events);
+	}
+
+	size_t pending() const override
+	{
+		return _operations.size();
+	}
+
+	IOUringBackend(const IOUringBackend &) = delete;
+	IOUringBackend &operator=(const IOUringBackend &) = delete;
+private:
+	struct Operation
+	{
+		explicit Operation(callback_t &&callback) : callback(std::move(callback)), index(0) {}
+
+		callback_t callback;
+		// position in _operations
+		size_t index;
+	};
+
+	// user_data of the eventfd read
+	static const uint64_t WAKE_DATA = 0;
+
+	IOUringBackend() :
+		_ringfd(-1), _eventfd(-1), _sqRing(NULL), _cqRing(NULL), _sqes(NULL), _sqRingSize(0), _cqRingSize(0),
+		_sqesSize(0), _sqHead(NULL), _sqTail(NULL), _sqMask(0), _sqEntries(0), _cqHead(NULL), _cqTail(NULL),
+		_cqMask(0), _cqes(NULL), _localTail(0), _toSubmit(0), _wakeValue(0), _notified(false), _operations()
+	{
+	}
+
+	bool init(unsigned entries)
+	{
+		struct io_uring_params params;
+		std::memset(&params, 0, sizeof(params));
+		_ringfd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+		if (_ringfd < 0)
+			return false;
+		// the timeout of the wait is passed to io_uring_enter, and completions must never be dropped
+		if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+			return false;
+
+		_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+		_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single && _cqRingSize > _sqRingSize)
+			_sqRingSize = _cqRingSize;
+
+		void *sqRing = ::mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd,
+			IORING_OFF_SQ_RING);
+		if (sqRing == MAP_FAILED)
+			return false;
+		_sqRing = static_cast<char*>(sqRing);
+		if (single)
+			_cqRing = _sqRing;
+		else
+		{
+			void *cqRing = ::mmap(NULL, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd,
+				IORING_OFF_CQ_RING);
+			if (cqRing == MAP_FAILED)
+				return false;
+			_cqRing = static_cast<char*>(cqRing);
+		}
+		_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		void *sqes = ::mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringfd,
+			IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+			return false;
+		_sqes = static_cast<io_uring_sqe*>(sqes);
+
+		_sqHead = reinterpret_cast<unsigned*>(_sqRing + params.sq_off.head);
+		_sqTail = reinterpret_cast<unsigned*>(_sqRing + params.sq_off.tail);
+		_sqMask = *reinterpret_cast<unsigned*>(_sqRing + params.sq_off.ring_mask);
+		_sqEntries = params.sq_entries;
+		_cqHead = reinterpret_cast<unsigned*>(_cqRing + params.cq_off.head);
+		_cqTail = reinterpret_cast<unsigned*>(_cqRing + params.cq_off.tail);
+		_cqMask = *reinterpret_cast<unsigned*>(_cqRing + params.cq_off.ring_mask);
+		_cqes = reinterpret_cast<io_uring_cqe*>(_cqRing + params.cq_off.cqes);
+		_localTail = *_sqTail;
+
+		// the submission entries are always used in order
+		unsigned *array = reinterpret_cast<unsigned*>(_sqRing + params.sq_off.array);
+		for (unsigned i = 0; i < _sqEntries; i++)
+			array[i] = i;
+
+		// blocking, io_uring would complete the read at once with EAGAIN
+		_eventfd = ::eventfd(0, EFD_CLOEXEC);
+		if (_eventfd < 0)
+			return false;
+		armWake();
+		return true;
+	}
+
+	int enter(unsigned toSubmit, unsigned minComplete, unsigned flags, const void *arg, size_t argSize)
+	{
+		return static_cast<int>(::syscall(__NR_io_uring_enter, _ringfd, toSubmit, minComplete, flags, arg, argSize));
+	}
+
+	io_uring_sqe *nextSqe()
+	{
+		if (_localTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries)
+		{
+			// full, submit without waiting
+			int ret = enter(_toSubmit, 0, 0, NULL, 0);
+			if (ret < 0)
+				throw Exception(std::string("io_uring submit failed: ") + std::strerror(errno));
+			_toSubmit -= static_cast<unsigned>(ret);
+			if (_localTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries)
+				throw Exception("io_uring submission queue is full");
+		}
+		io_uring_sqe *sqe = &_sqes[_localTail & _sqMask];
+		std::memset(sqe, 0, sizeof(*sqe));
+		return sqe;
+	}
+
+	void push()
+	{
+		_localTail++;
+		_toSubmit++;
+		__atomic_store_n(_sqTail, _localTail, __ATOMIC_RELEASE);
+	}
+
+	// the length of a request is 32 bits, larger sizes become a short read or write
+	static uint32_t length(size_t size)
+	{
+		return size > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(size);
+	}
+
+	io_uring_sqe *prepare(uint8_t opcode, int fd, Operation *op)
+	{
+		std::unique_ptr<Operation> owner(op);
+		io_uring_sqe *sqe = nextSqe();
+		op->index = _operations.size();
+		_operations.push_back(op);
+		owner.release();
+
+		sqe->opcode = opcode;
+		sqe->fd = fd;
+		sqe->user_data = reinterpret_cast<uint64_t>(op);
+		// filled by the caller, submitted by the next wait
+		push();
+		return sqe;
+	}
+
+	void armWake()
+	{
+		io_uring_sqe *sqe = nextSqe();
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = _eventfd;
+		sqe->addr = reinterpret_cast<uint64_t>(&_wakeValue);
+		sqe->len = sizeof(_wakeValue);
+		sqe->user_data = WAKE_DATA;
+		push();
+	}
+
+	void dispatch()
+	{
+		for (;;)
+		{
+			unsigned head = *_cqHead;
+			if (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+				break;
+			io_uring_cqe cqe = _cqes[head & _cqMask];
+			// consumed before the callback, which may throw
+			__atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+
+			if (cqe.user_data == WAKE_DATA)
+			{
+				// a wake() after this point writes the eventfd again
+				_notified.store(false, std::memory_order_release);
+				armWake();
+				continue;
+			}
+
+			std::unique_ptr<Operation> op(reinterpret_cast<Operation*>(cqe.user_data));
+			// swap remove
+			_operations[op->index] = _operations.back();
+			_operations[op->index]->index = op->index;
+			_operations.pop_back();
+			op->callback(cqe.res);
+		}
+	}
+
+	int _ringfd;
+	int _eventfd;
+	char *_sqRing;
+	char *_cqRing;
+	io_uring_sqe *_sqes;
+	size_t _sqRingSize;
+	size_t _cqRingSize;
+	size_t _sqesSize;
+	unsigned *_sqHead;
+	unsigned *_sqTail;
+	unsigned _sqMask;
+	unsigned _sqEntries;
+	unsigned *_cqHead;
+	unsigned *_cqTail;
+	unsigned _cqMask;
+	io_uring_cqe *_cqes;
+	unsigned _localTail;
+	unsigned _toSubmit;
+	uint64_t _wakeValue;
+	std::atomic<bool> _notified;
+	std::vector<Operation*> _operations;
+};
+
+}
+
+#endif
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <duktape.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace dtel {
+
+/**
+ * Size-class slab allocator for a duktape heap, used as the memory functions of duk_create_heap.
+ *
+ * Small allocations (up to 2048 bytes) are carved from 64KB chunks, one free list per size class, with
+ * no per-allocation header: the size class is found from the chunk header at the aligned chunk start.
+ * Larger allocations go to malloc with a small header, and are told apart by being 8 mod 16 aligned
+ * (slots are 16 byte aligned). A heap is never used by two threads at the same time, so the allocator
+ * is not locked. Freed slots are reused by the heap, and all the chunks are released at once when the allocator is
+ * destroyed, after the heap.
+ *
+ * Chunks are cut from 2MB arenas, which can be backed by huge pages on Linux.
+ */
+class SlabAllocator
+{
+public:
+	explicit SlabAllocator(bool hugePages = false) :
+		_hugePages(hugePages), _arenas(), _arenaNext(NULL), _arenaEnd(NULL)
+	{
+		for (auto &c : _classes)
+		{
+			c.free = NULL;
+			c.next = NULL;
+			c.end = NULL;
+		}
+	}
+
+	~SlabAllocator()
+	{
+		for (auto &arena : _arenas)
+			releaseArena(arena);
+	}
+
+	/**
+	 * Creates a heap that owns a new allocator, destroy it with destroyHeap
+	 */
+	static duk_context *createHeap(bool hugePages = false, duk_fatal_function fatal = NULL)
+	{
+		SlabAllocator *allocator = new SlabAllocator(hugePages);
+		duk_context *ctx = duk_create_heap(&SlabAllocator::alloc, &SlabAllocator::realloc, &SlabAllocator::free,
+			allocator, fatal);
+		if (!ctx)
+			delete allocator;
+		return ctx;
+	}
+
+	/**
+	 * Destroys a heap created by createHeap, and releases all its memory
+	 */
+	static void destroyHeap(duk_context *ctx)
+	{
+		duk_memory_functions funcs;
+		duk_get_memory_functions(ctx, &funcs);
+		duk_destroy_heap(ctx);
+		delete static_cast<SlabAllocator*>(funcs.udata);
+	}
+
+	static void *alloc(void *udata, duk_size_t size)
+	{
+		return static_cast<SlabAllocator*>(udata)->allocate(size);
+	}
+
+	static void *realloc(void *udata, void *ptr, duk_size_t size)
+	{
+		return static_cast<SlabAllocator*>(udata)->reallocate(ptr, size);
+	}
+
+	static void free(void *udata, void *ptr)
+	{
+		static_cast<SlabAllocator*>(udata)->deallocate(ptr);
+	}
+
+	void *allocate(size_t size)
+	{
+		if (size > MAX_SMALL)
+			return allocateLarge(size);
+
+		SizeClass &c = _classes[sizeClass(size)];
+		if (c.free)
+		{
+			FreeSlot *slot = c.free;
+			c.free = slot->next;
+			return slot;
+		}
+		size_t index = &c - _classes;
+		if (c.next == c.end && !refill(c, index))
+			return NULL;
+		void *ret = c.next;
+		c.next += classSize(index);
+		return ret;
+	}
+
+	void *reallocate(void *ptr, size_t size)
+	{
+		if (!ptr)
+			return allocate(size);
+		if (size == 0)
+		{
+			deallocate(ptr);
+			return NULL;
+		}
+
+		size_t oldSize = usableSize(ptr);
+		if (isLarge(ptr) && size > MAX_SMALL)
+		{
+			LargeHeader *header = largeHeader(ptr);
+			size_t offset = static_cast<char*>(ptr) - static_cast<char*>(header->raw);
+			void *raw = std::realloc(header->raw, size + LARGE_OVERHEAD);
+			if (!raw)
+				return NULL;
+			// the new block may have another alignment, move the data to the right offset
+			char *ret = largePointer(raw);
+			if (ret != static_cast<char*>(raw) + offset)
+				std::memmove(ret, static_cast<char*>(raw) + offset, oldSize < size ? oldSize : size);
+			*largeHeader(ret) = LargeHeader{ raw, size };
+			return ret;
+		}
+		// still fits its slot, and isn't wasting a much larger one
+		if (!isLarge(ptr) && size <= oldSize && sizeClass(size) == sizeClass(oldSize))
+			return ptr;
+
+		void *ret = allocate(size);
+		if (!ret)
+			return NULL;
+		std::memcpy(ret, ptr, oldSize < size ? oldSize : size);
+		deallocate(ptr);
+		return ret;
+	}
+
+	void deallocate(void *ptr)
+	{
+		if (!ptr)
+			return;
+		if (isLarge(ptr))
+		{
+			std::free(largeHeader(ptr)->raw);
+			return;
+		}
+		SizeClass &c = _classes[chunkOf(ptr)->sizeClass];
+		FreeSlot *slot = static_cast<FreeSlot*>(ptr);
+		slot->next = c.free;
+		c.free = slot;
+	}
+
+	/**
+	 * Returns the amount of bytes usable in an allocation
+	 */
+	static size_t usableSize(void *ptr)
+	{
+		if (isLarge(ptr))
+			return largeHeader(ptr)->size;
+		return classSize(chunkOf(ptr)->sizeClass);
+	}
+
+	SlabAllocator(const SlabAllocator &) = delete;
+	SlabAllocator &operator=(const SlabAllocator &) = delete;
+private:
+	static const size_t CHUNK_SIZE = 64 * 1024;
+	static const size_t ARENA_SIZE = 2 * 1024 * 1024;
+	static const size_t MAX_SMALL = 2048;
+	static const size_t CLASS_COUNT = 24;
+	static const size_t CHUNK_HEADER = 16;
+
+	static size_t classSize(size_t index)
+	{
+		static const size_t sizes[CLASS_COUNT] = {
+			16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+			320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+		};
+		return sizes[index];
+	}
+
+	struct FreeSlot
+	{
+		FreeSlot *next;
+	};
+
+	struct ChunkHeader
+	{
+		uint32_t sizeClass;
+	};
+
+	struct LargeHeader
+	{
+		void *raw;
+		size_t size;
+	};
+
+	// header, and room to align the pointer to 8 mod 16
+	static const size_t LARGE_OVERHEAD = sizeof(LargeHeader) + 24;
+
+	struct SizeClass
+	{
+		FreeSlot *free;
+		// bump allocation in the current chunk
+		char *next;
+		char *end;
+	};
+
+	struct Arena
+	{
+		void *raw;
+		size_t size;
+		bool mapped;
+	};
+
+	static size_t sizeClass(size_t size)
+	{
+		// 16 byte steps up to 128, then 4 classes for each power of two
+		if (size <= 128)
+			return size == 0 ? 0 : (size - 1) / 16;
+		size_t ret = 8;
+		size_t base = 128;
+		while (size > base * 2)
+		{
+			base *= 2;
+			ret += 4;
+		}
+		return ret + (size - base - 1) / (base / 4);
+	}
+
+	static bool isLarge(void *ptr)
+	{
+		return (reinterpret_cast<uintptr_t>(ptr) & 15) == 8;
+	}
+
+	static ChunkHeader *chunkOf(void *ptr)
+	{
+		return reinterpret_cast<ChunkHeader*>(reinterpret_cast<uintptr_t>(ptr) & ~static_cast<uintptr_t>(CHUNK_SIZE - 1));
+	}
+
+	static LargeHeader *largeHeader(void *ptr)
+	{
+		return reinterpret_cast<LargeHeader*>(static_cast<char*>(ptr) - sizeof(LargeHeader));
+	}
+
+	/**
+	 * Position of the large allocation in the malloc block, after the header and 8 mod 16 aligned
+	 */
+	static char *largePointer(void *raw)
+	{
+		return alignUp(static_cast<char*>(raw) + sizeof(LargeHeader), 16) + 8;
+	}
+
+	void *allocateLarge(size_t size)
+	{
+		void *raw = std::malloc(size + LARGE_OVERHEAD);
+		if (!raw)
+			return NULL;
+		char *ret = largePointer(raw);
+		*largeHeader(ret) = LargeHeader{ raw, size };
+		return ret;
+	}
+
+	bool refill(SizeClass &c, size_t index)
+	{
+		if (_arenaNext == _arenaEnd && !newArena())
+			return false;
+		char *chunk = _arenaNext;
+		_arenaNext += CHUNK_SIZE;
+		reinterpret_cast<ChunkHeader*>(chunk)->sizeClass = static_cast<uint32_t>(index);
+		size_t slotSize = classSize(index);
+		c.next = chunk + CHUNK_HEADER;
+		c.end = c.next + (CHUNK_SIZE - CHUNK_HEADER) / slotSize * slotSize;
+		return true;
+	}
+
+	bool newArena()
+	{
+		Arena arena{ NULL, 0, false };
+		char *start = NULL;
+#if defined(__linux__)
+		if (_hugePages)
+		{
+			void *p = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (p != MAP_FAILED)
+			{
+				arena = Arena{ p, ARENA_SIZE, true };
+				start = static_cast<char*>(p);
+			}
+		}
+		if (!start)
+		{
+			// over-allocate to align the arena, transparent huge pages need 2MB alignment
+			size_t size = ARENA_SIZE * 2;
+			void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED)
+				return false;
+			arena = Arena{ p, size, true };
+			start = alignUp(static_cast<char*>(p), ARENA_SIZE);
+#if defined(MADV_HUGEPAGE)
+			if (_hugePages)
+				madvise(start, ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+		}
+#else
+		void *p = std::malloc(ARENA_SIZE + CHUNK_SIZE);
+		if (!p)
+			return false;
+		arena = Arena{ p, ARENA_SIZE + CHUNK_SIZE, false };
+		start = alignUp(static_cast<char*>(p), CHUNK_SIZE);
+#endif
+		try
+		{
+			_arenas.push_back(arena);
+		}
+		catch (std::bad_alloc &)
+		{
+			releaseArena(arena);
+			return false;
+		}
+		_arenaNext = start;
+		_arenaEnd = start + ARENA_SIZE;
+		return true;
+	}
+
+	static void releaseArena(const Arena &arena)
+	{
+#if defined(__linux__)
+		if (arena.mapped)
+		{
+			munmap(arena.raw, arena.size);
+			return;
+		}
+#endif
+		std::free(arena.raw);
+	}
+
+	static char *alignUp(char *p, size_t alignment)
+	{
+		return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1));
+	}
+
+	bool _hugePages;
+	SizeClass _classes[CLASS_COUNT];
+	std::vector<Arena> _arenas;
+	char *_arenaNext;
+	char *_arenaEnd;
+};
+
+}
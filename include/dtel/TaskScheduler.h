@@ -0,0 +1,920 @@
+#pragma once
+
+#include "IntrusiveRefCntPtr.h"
+#include "detail/optional.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace dtel {
+
+namespace detail {
+
+	/**
+	 * Move-only callable with inline storage for small functors, so posting a lambda with a few
+	 * captures doesn't allocate.
+	 */
+	class InlineTask
+	{
+	public:
+		// functors up to this size are stored inline
+		static const size_t INLINE_SIZE = 48;
+
+		InlineTask() : _ops(NULL) {}
+
+		template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InlineTask>::value>::type>
+		InlineTask(F &&func) : _ops(NULL)
+		{
+			typedef typename std::decay<F>::type functor_t;
+			construct<functor_t>(std::forward<F>(func), std::integral_constant<bool, fitsInline<functor_t>()>());
+		}
+
+		InlineTask(InlineTask &&other) noexcept : _ops(other._ops)
+		{
+			if (_ops)
+			{
+				_ops->move(&other._storage, &_storage);
+				other._ops = NULL;
+			}
+		}
+
+		InlineTask &operator=(InlineTask &&other) noexcept
+		{
+			if (this != &other)
+			{
+				reset();
+				_ops = other._ops;
+				if (_ops)
+				{
+					_ops->move(&other._storage, &_storage);
+					other._ops = NULL;
+				}
+			}
+			return *this;
+		}
+
+		~InlineTask()
+		{
+			reset();
+		}
+
+		explicit operator bool() const
+		{
+			return _ops != NULL;
+		}
+
+		void operator()()
+		{
+			_ops->invoke(&_storage);
+		}
+
+		void reset()
+		{
+			if (_ops)
+			{
+				_ops->destroy(&_storage);
+				_ops = NULL;
+			}
+		}
+
+		InlineTask(const InlineTask &) = delete;
+		InlineTask &operator=(const InlineTask &) = delete;
+	private:
+		typedef typename std::aligned_storage<INLINE_SIZE, alignof(void*)>::type storage_t;
+
+		struct Ops
+		{
+			void (*invoke)(void *storage);
+			// move constructs into "to" and destroys "from"
+			void (*move)(void *from, void *to);
+			void (*destroy)(void *storage);
+		};
+
+		template <typename T>
+		static constexpr bool fitsInline()
+		{
+			return sizeof(T) <= INLINE_SIZE && alignof(T) <= alignof(storage_t) && std::is_nothrow_move_constructible<T>::value;
+		}
+
+		template <typename T, typename F>
+		void construct(F &&func, std::true_type)
+		{
+			static const Ops ops = {
+				[](void *s) { (*static_cast<T*>(s))(); },
+				[](void *from, void *to) { new (to) T(std::move(*static_cast<T*>(from))); static_cast<T*>(from)->~T(); },
+				[](void *s) { static_cast<T*>(s)->~T(); },
+			};
+			new (&_storage) T(std::forward<F>(func));
+			_ops = &ops;
+		}
+
+		template <typename T, typename F>
+		void construct(F &&func, std::false_type)
+		{
+			// too large, keep a pointer inline
+			static const Ops ops = {
+				[](void *s) { (**static_cast<T**>(s))(); },
+				[](void *from, void *to) { *static_cast<T**>(to) = *static_cast<T**>(from); },
+				[](void *s) { delete *static_cast<T**>(s); },
+			};
+			*reinterpret_cast<T**>(&_storage) = new T(std::forward<F>(func));
+			_ops = &ops;
+		}
+
+		storage_t _storage;
+		const Ops *_ops;
+	};
+
+}
+
+/**
+ * Task priority classes, the higher priorities are taken first
+ */
+enum task_priority_t
+{
+	TASK_PRIORITY_HIGH,
+	TASK_PRIORITY_NORMAL,
+	TASK_PRIORITY_LOW,
+};
+
+static const size_t TASK_PRIORITY_COUNT = 3;
+
+/**
+ * Cancels the tasks posted with it that didn't start yet. Running tasks can check cancelled().
+ */
+class CancellationToken : public ThreadSafeRefCountedBase<CancellationToken>
+{
+public:
+	typedef IntrusiveRefCntPtr<CancellationToken> Ptr;
+
+	CancellationToken() : _cancelled(false) {}
+
+	void cancel()
+	{
+		_cancelled.store(true, std::memory_order_release);
+	}
+
+	bool cancelled() const
+	{
+		return _cancelled.load(std::memory_order_acquire);
+	}
+private:
+	std::atomic_bool _cancelled;
+};
+
+/**
+ * Scheduling options of a task
+ */
+struct TaskOptions
+{
+	TaskOptions(task_priority_t priority = TASK_PRIORITY_NORMAL, CancellationToken::Ptr token = CancellationToken::Ptr()) :
+		priority(priority), deadline(), token(token) {}
+
+	/**
+	 * Options of a task dropped if it doesn't start in "timeout"
+	 */
+	static TaskOptions withTimeout(std::chrono::milliseconds timeout, task_priority_t priority = TASK_PRIORITY_NORMAL)
+	{
+		TaskOptions ret(priority);
+		ret.deadline = std::chrono::steady_clock::now() + timeout;
+		return ret;
+	}
+
+	task_priority_t priority;
+	// the task is dropped if it didn't start before the deadline
+	std::experimental::optional<std::chrono::steady_clock::time_point> deadline;
+	CancellationToken::Ptr token;
+};
+
+/**
+ * Queue metrics of a priority class. A growing wait time or queue while the other classes run shows
+ * starvation. Reading the clock costs about as much as scheduling a small task, so the scheduler
+ * only measures the wait of one task in WAIT_SAMPLE_INTERVAL of each class, and of the tasks with a
+ * deadline. TaskGroup measures all.
+ */
+struct TaskQueueStats
+{
+	// waiting now
+	size_t queued;
+	size_t run;
+	// dropped because of the deadline
+	size_t expired;
+	size_t cancelled;
+	// time between post and start of the sampled tasks that run
+	size_t waitSamples;
+	std::chrono::microseconds waitTotal;
+	std::chrono::microseconds waitMax;
+
+	static const size_t WAIT_SAMPLE_INTERVAL = 8;
+};
+
+namespace detail {
+
+	/**
+	 * A task waiting on a queue, with its options. The deadline and token are rarely used, and are
+	 * only allocated when set, to keep the queues compact.
+	 */
+	struct ScheduledTask
+	{
+		ScheduledTask() : task(), priority(TASK_PRIORITY_NORMAL), queued(), options() {}
+
+		ScheduledTask(InlineTask &&task, const TaskOptions &options, bool sampleAll = false) :
+			task(std::move(task)), priority(options.priority), queued(), options()
+		{
+			static thread_local size_t counters[TASK_PRIORITY_COUNT] = {};
+			if (options.deadline || options.token)
+				this->options.reset(new TaskOptions(options));
+			if (sampleAll || options.deadline || counters[priority]++ % TaskQueueStats::WAIT_SAMPLE_INTERVAL == 0)
+				queued = std::chrono::steady_clock::now();
+		}
+
+		bool cancelled() const
+		{
+			return options && options->token && options->token->cancelled();
+		}
+
+		bool expired(std::chrono::steady_clock::time_point now) const
+		{
+			return options && options->deadline && *options->deadline < now;
+		}
+
+		InlineTask task;
+		task_priority_t priority;
+		// only set if the wait is measured
+		std::chrono::steady_clock::time_point queued;
+		std::unique_ptr<TaskOptions> options;
+	};
+
+	/**
+	 * Per priority counters. Each instance must only be updated by one thread at a time, the
+	 * counters are atomic so they can be read at any time.
+	 */
+	class TaskMetrics
+	{
+	public:
+		TaskMetrics()
+		{
+			for (auto &c : _classes)
+			{
+				c.posted = 0;
+				c.run = 0;
+				c.expired = 0;
+				c.cancelled = 0;
+				c.waitSamples = 0;
+				c.waitTotal = 0;
+				c.waitMax = 0;
+			}
+		}
+
+		void posted(task_priority_t priority)
+		{
+			increment(_classes[priority].posted);
+		}
+
+		/**
+		 * Counts a task taken from the queue, returns whether it must run or be dropped
+		 */
+		bool taken(const ScheduledTask &task)
+		{
+			Class &c = _classes[task.priority];
+			if (task.cancelled())
+			{
+				increment(c.cancelled);
+				return false;
+			}
+			if (task.queued == std::chrono::steady_clock::time_point())
+			{
+				increment(c.run);
+				return true;
+			}
+
+			auto now = std::chrono::steady_clock::now();
+			if (task.expired(now))
+			{
+				increment(c.expired);
+				return false;
+			}
+			uint64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(now - task.queued).count();
+			increment(c.run);
+			increment(c.waitSamples);
+			increment(c.waitTotal, wait);
+			if (wait > c.waitMax.load(std::memory_order_relaxed))
+				c.waitMax.store(wait, std::memory_order_relaxed);
+			return true;
+		}
+
+		/**
+		 * Adds the counters of the priority class to "stats"
+		 */
+		void addTo(TaskQueueStats &stats, task_priority_t priority) const
+		{
+			const Class &c = _classes[priority];
+			size_t posted = c.posted.load(std::memory_order_relaxed);
+			size_t run = c.run.load(std::memory_order_relaxed);
+			size_t expired = c.expired.load(std::memory_order_relaxed);
+			size_t cancelled = c.cancelled.load(std::memory_order_relaxed);
+			// the tasks posted on one thread and taken on another are only balanced in the sum
+			stats.queued += posted - run - expired - cancelled;
+			stats.run += run;
+			stats.expired += expired;
+			stats.cancelled += cancelled;
+			stats.waitSamples += c.waitSamples.load(std::memory_order_relaxed);
+			stats.waitTotal += std::chrono::microseconds(c.waitTotal.load(std::memory_order_relaxed));
+			std::chrono::microseconds waitMax(c.waitMax.load(std::memory_order_relaxed));
+			if (waitMax > stats.waitMax)
+				stats.waitMax = waitMax;
+		}
+
+		TaskQueueStats stats(task_priority_t priority) const
+		{
+			TaskQueueStats ret = emptyStats();
+			addTo(ret, priority);
+			return ret;
+		}
+
+		static TaskQueueStats emptyStats()
+		{
+			return TaskQueueStats{ 0, 0, 0, 0, 0, std::chrono::microseconds(0), std::chrono::microseconds(0) };
+		}
+	private:
+		struct Class
+		{
+			std::atomic<size_t> posted;
+			std::atomic<size_t> run;
+			std::atomic<size_t> expired;
+			std::atomic<size_t> cancelled;
+			std::atomic<size_t> waitSamples;
+			std::atomic<uint64_t> waitTotal;
+			std::atomic<uint64_t> waitMax;
+		};
+
+		// single writer, so no atomic read-modify-write is needed
+		template <typename T>
+		static void increment(std::atomic<T> &counter, T value = 1)
+		{
+			counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		}
+
+		Class _classes[TASK_PRIORITY_COUNT];
+	};
+
+	/**
+	 * Queues of each priority
+	 */
+	class PriorityQueues
+	{
+	public:
+		PriorityQueues() : _queues(), _ticks(0) {}
+
+		bool empty() const
+		{
+			for (auto &q : _queues)
+				if (!q.empty())
+					return false;
+			return true;
+		}
+
+		size_t size() const
+		{
+			size_t ret = 0;
+			for (auto &q : _queues)
+				ret += q.size();
+			return ret;
+		}
+
+		void push(ScheduledTask &&task)
+		{
+			_queues[task.priority].push_back(std::move(task));
+		}
+
+		/**
+		 * Pops the oldest task of the highest priority not empty, up to maxPriority, or of the lowest
+		 */
+		bool pop(ScheduledTask &task, size_t maxPriority = TASK_PRIORITY_COUNT - 1, bool lowestFirst = false)
+		{
+			for (size_t i = 0; i <= maxPriority; i++)
+			{
+				auto &q = _queues[lowestFirst ? maxPriority - i : i];
+				if (!q.empty())
+				{
+					task = std::move(q.front());
+					q.pop_front();
+					return true;
+				}
+			}
+			return false;
+		}
+
+		/**
+		 * Like pop, but every few pops the lower priorities are taken first, so they progress even
+		 * when the higher ones are always busy
+		 */
+		bool popAged(ScheduledTask &task)
+		{
+			return pop(task, TASK_PRIORITY_COUNT - 1, ++_ticks % AGING_INTERVAL == 0);
+		}
+
+		/**
+		 * Priority of the task pop would return, if not empty
+		 */
+		task_priority_t top() const
+		{
+			for (size_t i = 0; i < TASK_PRIORITY_COUNT; i++)
+				if (!_queues[i].empty())
+					return static_cast<task_priority_t>(i);
+			return TASK_PRIORITY_LOW;
+		}
+	private:
+		static const size_t AGING_INTERVAL = 31;
+
+		std::deque<ScheduledTask> _queues[TASK_PRIORITY_COUNT];
+		size_t _ticks;
+	};
+
+}
+
+/**
+ * Work-stealing task scheduler.
+ *
+ * Each thread has its own deque: normal priority tasks posted from a scheduler thread go to its deque,
+ * and are taken back newest first, while the other tasks go to the shared queues, one per priority.
+ * An idle thread takes the high priority tasks, then its own, then the normal priority shared ones,
+ * then steals the oldest task of the other threads, and then takes the low priority ones. Every few
+ * tasks the shared queues are checked first, lowest priority first, so no class is starved forever.
+ * Threads only sleep when there is nothing to run, and posting only locks the sleep mutex when a
+ * thread is sleeping.
+ *
+ * Cancelled tasks and tasks past their deadline are dropped without running when taken, which
+ * destroys their functor on the scheduler thread.
+ *
+ * Threads are started when a task is posted and no thread is idle, up to the thread count.
+ *
+ * post() doesn't create a future, use submit() to get one. Exceptions thrown by posted tasks are
+ * ignored.
+ */
+class TaskScheduler
+{
+public:
+	/**
+	 * Maximum amount of threads, 0 = the amount of cores
+	 */
+	explicit TaskScheduler(size_t threadCount = 0) :
+		_lock(), _threadcount(threadCount > 0 ? threadCount : defaultThreadCount()), _workers(), _workercount(0),
+		_injectLock(), _inject(), _injectMetrics(), _injectCount(0), _injectHigh(0), _pending(0), _sleeping(0), _sleepLock(), _sleepCV(), _stop(false)
+	{
+	}
+
+	/**
+	 * Waits for the posted tasks to finish
+	 */
+	~TaskScheduler()
+	{
+		{
+			// no threads are started after this, so the list can be read without the lock
+			std::lock_guard<std::mutex> lock(_lock);
+			std::lock_guard<std::mutex> sleepLock(_sleepLock);
+			_stop = true;
+		}
+		_sleepCV.notify_all();
+		for (auto &w : _workers)
+			w->thread.join();
+	}
+
+	/**
+	 * The scheduler shared by all the event loops of the process, with one thread per core
+	 */
+	static TaskScheduler &shared()
+	{
+		static TaskScheduler scheduler;
+		return scheduler;
+	}
+
+	static size_t defaultThreadCount()
+	{
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	/**
+	 * Sets the maximum amount of threads. Threads already started are kept.
+	 */
+	void setThreadCount(size_t count)
+	{
+		_threadcount.store(count > 0 ? count : 1, std::memory_order_relaxed);
+	}
+
+	size_t threadCount() const
+	{
+		return _threadcount.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Runs the functor on a scheduler thread
+	 */
+	template <typename F>
+	void post(F &&func, const TaskOptions &options = TaskOptions())
+	{
+		push(detail::ScheduledTask(detail::InlineTask(std::forward<F>(func)), options));
+	}
+
+	/**
+	 * Like post, but always queued behind the tasks waiting on the shared queue, even when called from
+	 * a scheduler thread. Used to yield to the other sources of tasks.
+	 */
+	template <typename F>
+	void postQueued(F &&func, const TaskOptions &options = TaskOptions())
+	{
+		push(detail::ScheduledTask(detail::InlineTask(std::forward<F>(func)), options), true);
+	}
+
+	/**
+	 * Runs the functor on a scheduler thread, the future receives its result or exception.
+	 * If the task is dropped the future receives a broken_promise error.
+	 */
+	template <typename F>
+	auto submit(F &&func, const TaskOptions &options = TaskOptions()) -> std::future<decltype(func())>
+	{
+		std::packaged_task<decltype(func())()> task(std::forward<F>(func));
+		auto ret = task.get_future();
+		post(std::move(task), options);
+		return ret;
+	}
+
+	/**
+	 * Queue metrics of the priority class, of the tasks posted directly to the scheduler
+	 */
+	TaskQueueStats stats(task_priority_t priority) const
+	{
+		TaskQueueStats ret = detail::TaskMetrics::emptyStats();
+		{
+			std::lock_guard<std::mutex> lock(_injectLock);
+			_injectMetrics.addTo(ret, priority);
+		}
+		size_t count = _workercount.load(std::memory_order_acquire);
+		for (size_t i = 0; i < count; i++)
+			_workers[i]->metrics.addTo(ret, priority);
+		return ret;
+	}
+
+	TaskScheduler(const TaskScheduler &) = delete;
+	TaskScheduler &operator=(const TaskScheduler &) = delete;
+private:
+	struct WorkerThread
+	{
+		WorkerThread(size_t index) : index(index), ticks(0), lock(), tasks(), thread(), metrics() {}
+
+		size_t index;
+		size_t ticks;
+		std::mutex lock;
+		std::deque<detail::ScheduledTask> tasks;
+		std::thread thread;
+		detail::TaskMetrics metrics;
+	};
+
+	/**
+	 * The scheduler and thread running the current thread, if any
+	 */
+	static const TaskScheduler *&currentScheduler()
+	{
+		static thread_local const TaskScheduler *scheduler = NULL;
+		return scheduler;
+	}
+
+	static WorkerThread *&currentWorker()
+	{
+		static thread_local WorkerThread *worker = NULL;
+		return worker;
+	}
+
+	void push(detail::ScheduledTask &&task, bool queued = false)
+	{
+		if (_sleeping.load(std::memory_order_relaxed) == 0 &&
+			_workercount.load(std::memory_order_relaxed) < _threadcount.load(std::memory_order_relaxed))
+			startThread();
+
+		// a thread going to sleep counts itself before checking _pending, so one of the two sees the other
+		_pending.fetch_add(1, std::memory_order_seq_cst);
+
+		// the metrics of a scheduler thread are only updated by itself, the others under _injectLock
+		WorkerThread *w = currentScheduler() == this ? currentWorker() : NULL;
+		if (w)
+			w->metrics.posted(task.priority);
+
+		if (w && !queued && task.priority == TASK_PRIORITY_NORMAL)
+		{
+			std::lock_guard<std::mutex> lock(w->lock);
+			w->tasks.push_back(std::move(task));
+		}
+		else
+		{
+			std::lock_guard<std::mutex> lock(_injectLock);
+			if (!w)
+				_injectMetrics.posted(task.priority);
+			// only changed under the lock
+			_injectCount.store(_injectCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			if (task.priority == TASK_PRIORITY_HIGH)
+				_injectHigh.store(_injectHigh.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			_inject.push(std::move(task));
+		}
+
+		if (_sleeping.load(std::memory_order_seq_cst) > 0)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_sleepLock);
+			}
+			_sleepCV.notify_one();
+		}
+	}
+
+	void startThread()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		if (_stop || _workers.size() >= _threadcount.load(std::memory_order_relaxed) || _workers.size() >= MAX_THREADS)
+			return;
+		// the worker list is read without locking by the running threads, so it can't be reallocated
+		if (_workers.capacity() == 0)
+			_workers.reserve(MAX_THREADS);
+		_workers.emplace_back(new WorkerThread(_workers.size()));
+		WorkerThread *w = _workers.back().get();
+		w->thread = std::thread([this, w] { run(w); });
+		_workercount.store(_workers.size(), std::memory_order_release);
+	}
+
+	bool takeShared(detail::ScheduledTask &task, task_priority_t maxPriority, bool lowestFirst = false)
+	{
+		// the counts avoid locking on each task when the shared queues are empty, a task missed
+		// because of a stale count is seen on the next take
+		if ((maxPriority == TASK_PRIORITY_HIGH ? _injectHigh : _injectCount).load(std::memory_order_relaxed) == 0)
+			return false;
+		std::lock_guard<std::mutex> lock(_injectLock);
+		if (!_inject.pop(task, maxPriority, lowestFirst))
+			return false;
+		_injectCount.store(_injectCount.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+		if (task.priority == TASK_PRIORITY_HIGH)
+			_injectHigh.store(_injectHigh.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	bool take(WorkerThread *self, detail::ScheduledTask &task)
+	{
+		// look at the shared queues first from time to time, so local tasks can't starve them
+		if (++self->ticks % SHARED_CHECK_INTERVAL == 0 && takeShared(task, TASK_PRIORITY_LOW, true))
+			return true;
+		if (takeShared(task, TASK_PRIORITY_HIGH))
+			return true;
+		{
+			std::lock_guard<std::mutex> lock(self->lock);
+			if (!self->tasks.empty())
+			{
+				task = std::move(self->tasks.back());
+				self->tasks.pop_back();
+				return true;
+			}
+		}
+		if (takeShared(task, TASK_PRIORITY_NORMAL))
+			return true;
+		// steal, starting after this thread so the victims are spread
+		size_t count = _workercount.load(std::memory_order_acquire);
+		for (size_t i = 1; i < count; i++)
+		{
+			WorkerThread *victim = _workers[(self->index + i) % count].get();
+			std::lock_guard<std::mutex> lock(victim->lock);
+			if (!victim->tasks.empty())
+			{
+				task = std::move(victim->tasks.front());
+				victim->tasks.pop_front();
+				return true;
+			}
+		}
+		return takeShared(task, TASK_PRIORITY_LOW);
+	}
+
+	void run(WorkerThread *self)
+	{
+		currentScheduler() = this;
+		currentWorker() = self;
+
+		detail::ScheduledTask task;
+		while (true)
+		{
+			// _pending is counted before the task is queued, and a task can be missed while it is being queued
+			if (_pending.load(std::memory_order_acquire) > 0 && take(self, task))
+			{
+				_pending.fetch_sub(1, std::memory_order_relaxed);
+				if (self->metrics.taken(task))
+				{
+					try
+					{
+						task.task();
+					}
+					catch (...)
+					{
+					}
+				}
+				task = detail::ScheduledTask();
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(_sleepLock);
+			_sleeping.fetch_add(1, std::memory_order_seq_cst);
+			_sleepCV.wait(lock, [this] { return _stop || _pending.load(std::memory_order_seq_cst) > 0; });
+			_sleeping.fetch_sub(1, std::memory_order_seq_cst);
+			if (_stop && _pending.load(std::memory_order_seq_cst) == 0)
+				return;
+		}
+	}
+
+	static const size_t MAX_THREADS = 256;
+	static const size_t SHARED_CHECK_INTERVAL = 31;
+
+	std::mutex _lock;
+	std::atomic<size_t> _threadcount;
+	std::vector<std::unique_ptr<WorkerThread>> _workers;
+	std::atomic<size_t> _workercount;
+	mutable std::mutex _injectLock;
+	detail::PriorityQueues _inject;
+	detail::TaskMetrics _injectMetrics;
+	std::atomic<size_t> _injectCount;
+	std::atomic<size_t> _injectHigh;
+	std::atomic<size_t> _pending;
+	std::atomic<size_t> _sleeping;
+	std::mutex _sleepLock;
+	std::condition_variable _sleepCV;
+	bool _stop;
+};
+
+/**
+ * Runs tasks on a TaskScheduler, with at most "concurrency" of them running at the same time, so a
+ * source of many tasks can't take all the scheduler threads. The other tasks wait on the group by
+ * priority, and each finished task makes room for the next one. Dropped tasks are counted on the
+ * group metrics, which measure the wait from post to start.
+ */
+class TaskGroup
+{
+public:
+	/**
+	 * NULL scheduler = the shared scheduler
+	 */
+	explicit TaskGroup(size_t concurrency = 1, TaskScheduler *scheduler = NULL) :
+		_lock(), _cv(), _scheduler(scheduler ? scheduler : &TaskScheduler::shared()),
+		_concurrency(concurrency > 0 ? concurrency : 1), _running(0), _tasks(), _metrics()
+	{
+	}
+
+	/**
+	 * Waits for the posted tasks to finish
+	 */
+	~TaskGroup()
+	{
+		std::unique_lock<std::mutex> lock(_lock);
+		_cv.wait(lock, [this] { return _running == 0; });
+	}
+
+	/**
+	 * Sets the maximum amount of tasks running at the same time
+	 */
+	void setConcurrency(size_t concurrency)
+	{
+		std::unique_lock<std::mutex> lock(_lock);
+		_concurrency = concurrency > 0 ? concurrency : 1;
+		dispatch(lock);
+	}
+
+	size_t concurrency() const
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		return _concurrency;
+	}
+
+	/**
+	 * Sets the scheduler that runs the tasks, only before posting any
+	 */
+	void setScheduler(TaskScheduler *scheduler)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_scheduler = scheduler ? scheduler : &TaskScheduler::shared();
+	}
+
+	TaskScheduler *scheduler() const
+	{
+		return _scheduler;
+	}
+
+	template <typename F>
+	void post(F &&func, const TaskOptions &options = TaskOptions())
+	{
+		std::unique_lock<std::mutex> lock(_lock);
+		_metrics.posted(options.priority);
+		_tasks.push(detail::ScheduledTask(detail::InlineTask(std::forward<F>(func)), options, true));
+		dispatch(lock);
+	}
+
+	/**
+	 * If the task is dropped the future receives a broken_promise error
+	 */
+	template <typename F>
+	auto submit(F &&func, const TaskOptions &options = TaskOptions()) -> std::future<decltype(func())>
+	{
+		std::packaged_task<decltype(func())()> task(std::forward<F>(func));
+		auto ret = task.get_future();
+		post(std::move(task), options);
+		return ret;
+	}
+
+	/**
+	 * Queue metrics of the priority class
+	 */
+	TaskQueueStats stats(task_priority_t priority) const
+	{
+		return _metrics.stats(priority);
+	}
+
+	TaskGroup(const TaskGroup &) = delete;
+	TaskGroup &operator=(const TaskGroup &) = delete;
+private:
+	/**
+	 * Starts runners for the waiting tasks, while under the concurrency
+	 */
+	void dispatch(std::unique_lock<std::mutex> &lock)
+	{
+		size_t count = 0;
+		while (_running < _concurrency && _running < _tasks.size())
+		{
+			_running++;
+			count++;
+		}
+		TaskScheduler *scheduler = _scheduler;
+		TaskOptions options(_tasks.top());
+		lock.unlock();
+		for (size_t i = 0; i < count; i++)
+			scheduler->post([this] { runNext(); }, options);
+	}
+
+	/**
+	 * Runs one task, and posts itself again if more are waiting, so the groups share the threads
+	 */
+	void runNext()
+	{
+		std::vector<detail::ScheduledTask> dropped;
+		detail::ScheduledTask task;
+		bool found = false;
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			while (_running <= _concurrency && _tasks.popAged(task))
+			{
+				if (_metrics.taken(task))
+				{
+					found = true;
+					break;
+				}
+				dropped.push_back(std::move(task));
+			}
+		}
+		// destroyed outside the lock while still counted as running, their destructors may post tasks
+		dropped.clear();
+
+		if (found)
+		{
+			try
+			{
+				task.task();
+			}
+			catch (...)
+			{
+			}
+			task = detail::ScheduledTask();
+		}
+
+		std::lock_guard<std::mutex> lock(_lock);
+		if (_tasks.empty() || _running > _concurrency)
+		{
+			_running--;
+			_cv.notify_all();
+			return;
+		}
+		_scheduler->postQueued([this] { runNext(); }, TaskOptions(_tasks.top()));
+	}
+
+	mutable std::mutex _lock;
+	std::condition_variable _cv;
+	TaskScheduler *_scheduler;
+	size_t _concurrency;
+	// runners posted to the scheduler
+	size_t _running;
+	detail::PriorityQueues _tasks;
+	detail::TaskMetrics _metrics;
+};
+
+}
@@ -0,0 +1,822 @@
+#pragma once
+
+#include "external.h"
+
+#include <duktape.h>
+
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace dtel {
+namespace detail {
+
+/**
+ * Binary structured clone of duktape values.
+ *
+ * Supports undefined, null, booleans, numbers, strings, arrays, plain objects, Date, RegExp, Error,
+ * ArrayBuffer, typed arrays, DataView and plain buffers. References to the same object, including
+ * cycles, are preserved. Functions and symbols can't be cloned.
+ *
+ * ArrayBuffers in the transfer list reach the receiver as external blocks. Only external ArrayBuffers
+ * (received by a transfer, or created natively) are transferred: they move without copying and are detached
+ * in the sender. Duktape can't detach the fixed buffer of an ArrayBuffer created in script, so listing one
+ * is a copy, not a transfer: the receiver gets an external copy, and the sender keeps its data.
+ * SharedArrayBuffers are never copied, the receiver maps the same memory block.
+ * Native objects can be transferred by implementing Transferable.
+ *
+ * The encoder and decoder run in protected calls, and keep their state outside of the recursive
+ * functions, so a duktape error never skips C++ destructors.
+ */
+namespace clone {
+
+	enum tag_t : unsigned char
+	{
+		TAG_UNDEFINED = '_',
+		TAG_NULL = 'N',
+		TAG_TRUE = 'T',
+		TAG_FALSE = 'F',
+		TAG_INT = 'I',
+		TAG_DOUBLE = 'D',
+		TAG_STRING = 'S',
+		TAG_ARRAY = 'A',
+		TAG_OBJECT = 'O',
+		TAG_DATE = 'd',
+		TAG_REGEXP = 'R',
+		TAG_ERROR = 'E',
+		TAG_ARRAYBUFFER = 'B',
+		TAG_VIEW = 'V',
+		TAG_PLAINBUFFER = 'P',
+		TAG_REF = 'r',
+		TAG_TRANSFER = 'X',
+		TAG_SHARED = 'H',
+		TAG_TRANSFERABLE = 'M',
+	};
+
+	static const char* PROP_TRANSFERABLE = "\xFF" "DTEL_CLONE_TRANSFERABLE";
+
+	/**
+	 * Native object that can be moved to another heap in a transfer list.
+	 * The javascript object must hold a pointer to it in the PROP_TRANSFERABLE property.
+	 */
+	class Transferable : public ThreadSafeRefCountedBase<Transferable>
+	{
+	public:
+		typedef IntrusiveRefCntPtr<Transferable> Ptr;
+
+		virtual ~Transferable() {}
+
+		/**
+		 * Detaches the object at index from the sending heap, once the message was serialized
+		 */
+		virtual void detach(duk_context *ctx, duk_idx_t idx) = 0;
+
+		/**
+		 * Pushes the object in the receiving heap. Must report errors as duktape errors.
+		 */
+		virtual void push(duk_context *ctx) = 0;
+	};
+
+	/**
+	 * A serialized value, with the memory blocks transferred with it
+	 */
+	struct Message
+	{
+		std::string data;
+		std::vector<ExternalBlock::Ptr> transfers;
+		std::vector<ExternalBlock::Ptr> shared;
+		std::vector<Transferable::Ptr> transferables;
+	};
+
+	static const int MAX_DEPTH = 1000;
+
+	struct Encoder
+	{
+		Message *out;
+		// transfer list, ArrayBuffer heap pointer to transfer index
+		std::unordered_map<void*, duk_uint32_t> transfers;
+		// transferred external ArrayBuffers to detach
+		std::vector<void*> detach;
+		// transferable native objects, heap pointer to index
+		std::unordered_map<void*, duk_uint32_t> transferables;
+		std::vector<void*> detachtransferables;
+		// object heap pointer to reference id
+		std::unordered_map<void*, duk_uint32_t> refs;
+		// Object.prototype.toString, to get the object class
+		duk_idx_t tostring;
+		// Object.prototype, objects inheriting directly from it are plain objects
+		void *objectprototype;
+	};
+
+	struct Decoder
+	{
+		const unsigned char *p;
+		const unsigned char *end;
+		// array of the decoded objects, by reference id
+		duk_idx_t refs;
+		duk_uarridx_t refcount;
+		const Message *message;
+	};
+
+	//
+	// Encoder
+	//
+
+	inline void write_varint(Encoder *e, duk_uint32_t value)
+	{
+		while (value >= 0x80)
+		{
+			e->out->data.push_back(static_cast<char>((value & 0x7F) | 0x80));
+			value >>= 7;
+		}
+		e->out->data.push_back(static_cast<char>(value));
+	}
+
+	inline void write_bytes(Encoder *e, const void *data, duk_size_t len)
+	{
+		write_varint(e, static_cast<duk_uint32_t>(len));
+		// avoid growing the output many times for large buffers
+		if (len >= 4096)
+			e->out->data.reserve(e->out->data.size() + len + 64);
+		e->out->data.append(static_cast<const char*>(data), len);
+	}
+
+	inline void write_double(Encoder *e, duk_double_t value)
+	{
+		e->out->data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+	}
+
+	inline void write_string(Encoder *e, duk_context *ctx, duk_idx_t idx)
+	{
+		duk_size_t len;
+		const char *str = duk_get_lstring(ctx, idx, &len);
+		write_bytes(e, str, len);
+	}
+
+	/**
+	 * Writes the string of property "prop" of the object at "idx"
+	 */
+	inline void write_prop_string(Encoder *e, duk_context *ctx, duk_idx_t idx, const char *prop)
+	{
+		duk_get_prop_string(ctx, idx, prop);
+		duk_to_string(ctx, -1);
+		write_string(e, ctx, -1);
+		duk_pop(ctx);
+	}
+
+	/**
+	 * Returns the typed array type of the buffer object class, or -1 if it is not a typed array
+	 */
+	inline int view_type(const char *cls)
+	{
+		static const struct { const char *name; int type; } types[] = {
+			{ "DataView", DUK_BUFOBJ_DATAVIEW },
+			{ "Int8Array", DUK_BUFOBJ_INT8ARRAY },
+			{ "Uint8Array", DUK_BUFOBJ_UINT8ARRAY },
+			{ "Uint8ClampedArray", DUK_BUFOBJ_UINT8CLAMPEDARRAY },
+			{ "Int16Array", DUK_BUFOBJ_INT16ARRAY },
+			{ "Uint16Array", DUK_BUFOBJ_UINT16ARRAY },
+			{ "Int32Array", DUK_BUFOBJ_INT32ARRAY },
+			{ "Uint32Array", DUK_BUFOBJ_UINT32ARRAY },
+			{ "Float32Array", DUK_BUFOBJ_FLOAT32ARRAY },
+			{ "Float64Array", DUK_BUFOBJ_FLOAT64ARRAY },
+		};
+		for (auto &t : types)
+			if (std::strcmp(cls, t.name) == 0)
+				return t.type;
+		return -1;
+	}
+
+	/**
+	 * Writes a reference if the heap value was already written, otherwise assigns the next reference id to it
+	 */
+	inline bool encode_ref(duk_context *ctx, Encoder *e, duk_idx_t idx)
+	{
+		void *ptr = duk_get_heapptr(ctx, idx);
+		auto ref = e->refs.find(ptr);
+		if (ref != e->refs.end())
+		{
+			e->out->data.push_back(TAG_REF);
+			write_varint(e, ref->second);
+			return true;
+		}
+		duk_uint32_t id = static_cast<duk_uint32_t>(e->refs.size());
+		e->refs[ptr] = id;
+		return false;
+	}
+
+	/**
+	 * Prepares the transfer list at index, creating the blocks to transfer
+	 */
+	inline void encode_transfers(duk_context *ctx, Encoder *e, duk_idx_t idx)
+	{
+		if (duk_is_null_or_undefined(ctx, idx))
+			return;
+		if (!duk_is_array(ctx, idx))
+			duk_error(ctx, DUK_ERR_TYPE_ERROR, "DataCloneError: transfer list must be an array");
+
+		duk_size_t len = duk_get_length(ctx, idx);
+		for (duk_size_t i = 0; i < len; i++)
+		{
+			duk_get_prop_index(ctx, idx, static_cast<duk_uarridx_t>(i));
+
+			if (duk_is_object(ctx, -1) && duk_has_prop_string(ctx, -1, PROP_TRANSFERABLE))
+			{
+				duk_get_prop_string(ctx, -1, PROP_TRANSFERABLE);
+				Transferable *t = static_cast<Transferable*>(duk_get_pointer(ctx, -1));
+				duk_pop(ctx);
+				if (!t)
+					duk_error(ctx, DUK_ERR_TYPE_ERROR, "DataCloneError: object is detached");
+				void *ptr = duk_get_heapptr(ctx, -1);
+				if (e->transferables.find(ptr) != e->transferables.end())
+					duk_error(ctx, DUK_ERR_TYPE_ERROR, "DataCloneError: object is duplicated in the transfer list");
+				e->transferables[ptr] = static_cast<duk_uint32_t>(e->out->transferables.size());
+				e->out->transferables.push_back(t);
+				e->detachtransferables.push_back(ptr);
+				duk_pop(ctx);
+				continue;
+			}
+
+			if (!duk_is_buffer_data(ctx, -1) || duk_is_buffer(ctx, -1))
+				duk_error(ctx, DUK_ERR_TYPE_ERROR, "DataCloneError: only ArrayBuffers can be transferred");
+			// typed arrays transfer their ArrayBuffer
+			if (duk_has_prop_string(ctx, -1, "BYTES_PER_ELEMENT") || duk_has_prop_string(ctx, -1, "getInt8"))
+			{
+				duk_get_prop_string(ctx, -1, "buffer");
+				duk_remove(ctx, -2);
+			}
+
+			if (is_detached_arraybuffer(ctx, -1))
+				duk_error(ctx, DUK_ERR_TYPE_ERROR, "DataCloneError: ArrayBuffer is detached");
+			if (is_shared_arraybuffer(ctx, -1))
+				duk_error(ctx, DUK_ERR_TYPE_ERROR, "DataCloneError: SharedArrayBuffer can't be transferred");
+
+			void *ptr = duk_get_heapptr(ctx, -1);
+			if (e->transfers.find(ptr) != e->transfers.end())
+				duk_error(ctx, DUK_ERR_TYPE_ERROR, "DataCloneError: ArrayBuffer is duplicated in the transfer list");
+			e->transfers[ptr] = static_cast<duk_uint32_t>(e->out->transfers.size());
+
+			ExternalBlock *block = get_external_block(ctx, -1);
+			if (block)
+			{
+				// moved without copying
+				e->out->transfers.push_back(block);
+				e->detach.push_back(ptr);
+			}
+			else
+			{
+				// created in script, duktape can't detach it: copied, and still usable in the sender
+				duk_size_t size;
+				void *data = duk_get_buffer_data(ctx, -1, &size);
+				e->out->transfers.push_back(new ExternalBlock(size));
+				if (size > 0)
+					std::memcpy(e->out->transfers.back()->data(), data, size);
+			}
+			duk_pop(ctx);
+		}
+	}
+
+	inline void encode_value(duk_context *ctx, Encoder *e, duk_idx_t idx, int depth);
+
+	/**
+	 * Encodes the own enumerable properties of the object
+	 */
+	inline void encode_plain_object(duk_context *ctx, Encoder *e, duk_idx_t idx, int depth)
+	{
+		e->out->data.push_back(TAG_OBJECT);
+		size_t countpos = e->out->data.size();
+		e->out->data.append(sizeof(duk_uint32_t), '\0');
+		duk_uint32_t count = 0;
+
+		duk_enum(ctx, idx, DUK_ENUM_OWN_PROPERTIES_ONLY);
+		while (duk_next(ctx, -1, 1))
+		{
+			write_string(e, ctx, -2);
+			encode_value(ctx, e, duk_get_top_index(ctx), depth + 1);
+			duk_pop_2(ctx);
+			count++;
+		}
+		duk_pop(ctx); // enum
+
+		std::memcpy(&e->out->data[countpos], &count, sizeof(count));
+	}
+
+	inline void encode_object(duk_context *ctx, Encoder *e, duk_idx_t idx, int depth)
+	{
+		if (encode_ref(ctx, e, idx))
+			return;
+
+		auto transfer = e->transfers.find(duk_get_heapptr(ctx, idx));
+		if (transfer != e->transfers.end())
+		{
+			e->out->data.push_back(TAG_TRANSFER);
+			write_varint(e, transfer->second);
+			return;
+		}
+
+		auto transferable = e->transferables.find(duk_get_heapptr(ctx, idx));
+		if (transferable != e->transferables.end())
+		{
+			e->out->data.push_back(TAG_TRANSFERABLE);
+			write_varint(e, transferable->second);
+			return;
+		}
+		if (duk_has_prop_string(ctx, idx, PROP_TRANSFERABLE))
+			duk_error(ctx, DUK_ERR_TYPE_ERROR, "DataCloneError: object must be in the transfer list");
+
+		if (is_shared_arraybuffer(ctx, idx))
+		{
+			e->out->data.push_back(TAG_SHARED);
+			write_varint(e, static_cast<duk_uint32_t>(e->out->shared.size()));
+			e->out->shared.push_back(get_external_block(ctx, idx));
+			return;
+		}
+
+		if (duk_is_function(ctx, idx))
+			duk_error(ctx, DUK_ERR_TYPE_ERROR, "DataCloneError: functions can't be cloned");
+
+		if (duk_is_array(ctx, idx))
+		{
+			duk_size_t len = duk_get_length(ctx, idx);
+			e->out->data.push_back(TAG_ARRAY);
+			write_varint(e, static_cast<duk_uint32_t>(len));
+			for (duk_size_t i = 0; i < len; i++)
+			{
+				duk_get_prop_index(ctx, idx, static_cast<duk_uarridx_t>(i));
+				encode_value(ctx, e, duk_get_top_index(ctx), depth + 1);
+				duk_pop(ctx);
+			}
+			return;
+		}
+
+		// objects inheriting directly from Object.prototype are plain objects
+		duk_get_prototype(ctx, idx);
+		bool plain = duk_get_heapptr(ctx, -1) == e->objectprototype;
+		duk_pop(ctx);
+		if (plain && !duk_is_buffer_data(ctx, idx))
+		{
+			encode_plain_object(ctx, e, idx, depth);
+			return;
+		}
+
+		// object class
+		duk_dup(ctx, e->tostring);
+		duk_dup(ctx, idx);
+		duk_call_method(ctx, 0);
+		const char *cls = duk_get_string(ctx, -1);
+		cls = cls ? cls + 8 : ""; // "[object "
+		size_t clslen = std::strlen(cls);
+		char clsname[32] = { 0 };
+		if (clslen > 0 && clslen < sizeof(clsname))
+			std::memcpy(clsname, cls, clslen - 1); // "]"
+		duk_pop(ctx);
+
+		if (duk_is_buffer_data(ctx, idx))
+		{
+			duk_size_t len;
+			if (std::strcmp(clsname, "ArrayBuffer") == 0)
+			{
+				void *data = duk_get_buffer_data(ctx, idx, &len);
+				e->out->data.push_back(TAG_ARRAYBUFFER);
+				write_bytes(e, data, len);
+				return;
+			}
+
+			int type = view_type(clsname);
+			if (type >= 0)
+			{
+				e->out->data.push_back(TAG_VIEW);
+				e->out->data.push_back(static_cast<char>(type));
+				duk_get_prop_string(ctx, idx, "buffer");
+				encode_value(ctx, e, duk_get_top_index(ctx), depth + 1);
+				duk_pop(ctx);
+				duk_get_prop_string(ctx, idx, "byteOffset");
+				write_varint(e, duk_to_uint32(ctx, -1));
+				duk_get_prop_string(ctx, idx, "byteLength");
+				write_varint(e, duk_to_uint32(ctx, -1));
+				duk_pop_2(ctx);
+				return;
+			}
+
+			// other buffer objects are cloned as plain buffers
+			void *data = duk_get_buffer_data(ctx, idx, &len);
+			e->out->data.push_back(TAG_PLAINBUFFER);
+			write_bytes(e, data, len);
+			return;
+		}
+
+		if (std::strcmp(clsname, "Date") == 0)
+		{
+			duk_push_string(ctx, "getTime");
+			duk_call_prop(ctx, idx, 0);
+			e->out->data.push_back(TAG_DATE);
+			write_double(e, duk_to_number(ctx, -1));
+			duk_pop(ctx);
+			return;
+		}
+
+		if (std::strcmp(clsname, "RegExp") == 0)
+		{
+			e->out->data.push_back(TAG_REGEXP);
+			write_prop_string(e, ctx, idx, "source");
+			char flags[4] = { 0 };
+			int f = 0;
+			duk_get_prop_string(ctx, idx, "global");
+			if (duk_to_boolean(ctx, -1)) flags[f++] = 'g';
+			duk_get_prop_string(ctx, idx, "ignoreCase");
+			if (duk_to_boolean(ctx, -1)) flags[f++] = 'i';
+			duk_get_prop_string(ctx, idx, "multiline");
+			if (duk_to_boolean(ctx, -1)) flags[f++] = 'm';
+			duk_pop_3(ctx);
+			write_bytes(e, flags, f);
+			return;
+		}
+
+		if (duk_is_error(ctx, idx))
+		{
+			e->out->data.push_back(TAG_ERROR);
+			write_prop_string(e, ctx, idx, "name");
+			write_prop_string(e, ctx, idx, "message");
+			return;
+		}
+
+		encode_plain_object(ctx, e, idx, depth);
+	}
+
+	inline void encode_value(duk_context *ctx, Encoder *e, duk_idx_t idx, int depth)
+	{
+		if (depth > MAX_DEPTH)
+			duk_error(ctx, DUK_ERR_RANGE_ERROR, "DataCloneError: maximum depth exceeded");
+
+		switch (duk_get_type(ctx, idx))
+		{
+		case DUK_TYPE_UNDEFINED:
+			e->out->data.push_back(TAG_UNDEFINED);
+			break;
+		case DUK_TYPE_NULL:
+			e->out->data.push_back(TAG_NULL);
+			break;
+		case DUK_TYPE_BOOLEAN:
+			e->out->data.push_back(duk_get_boolean(ctx, idx) ? TAG_TRUE : TAG_FALSE);
+			break;
+		case DUK_TYPE_NUMBER:
+		{
+			duk_double_t d = duk_get_number(ctx, idx);
+			duk_int32_t i = static_cast<duk_int32_t>(d);
+			if (d >= -2147483648.0 && d <= 2147483647.0 && static_cast<duk_double_t>(i) == d && !(i == 0 && std::signbit(d)))
+			{
+				// zigzag
+				e->out->data.push_back(TAG_INT);
+				write_varint(e, (static_cast<duk_uint32_t>(i) << 1) ^ static_cast<duk_uint32_t>(i >> 31));
+			}
+			else
+			{
+				e->out->data.push_back(TAG_DOUBLE);
+				write_double(e, d);
+			}
+			break;
+		}
+		case DUK_TYPE_STRING:
+			if (duk_is_symbol(ctx, idx))
+				duk_error(ctx, DUK_ERR_TYPE_ERROR, "DataCloneError: symbols can't be cloned");
+			e->out->data.push_back(TAG_STRING);
+			write_string(e, ctx, idx);
+			break;
+		case DUK_TYPE_BUFFER:
+		{
+			if (encode_ref(ctx, e, idx))
+				break;
+			duk_size_t len;
+			void *data = duk_get_buffer(ctx, idx, &len);
+			e->out->data.push_back(TAG_PLAINBUFFER);
+			write_bytes(e, data, len);
+			break;
+		}
+		case DUK_TYPE_OBJECT:
+			encode_object(ctx, e, idx, depth);
+			break;
+		default:
+			duk_error(ctx, DUK_ERR_TYPE_ERROR, "DataCloneError: value can't be cloned");
+		}
+	}
+
+	inline duk_ret_t encode_safe(duk_context *ctx, void *udata)
+	{
+		// value, transfer list
+		Encoder *e = static_cast<Encoder*>(udata);
+		duk_idx_t value = duk_get_top_index(ctx) - 1;
+
+		encode_transfers(ctx, e, value + 1);
+
+		duk_push_object(ctx);
+		duk_get_prototype(ctx, -1);
+		e->objectprototype = duk_get_heapptr(ctx, -1);
+		duk_pop(ctx);
+		duk_get_prop_string(ctx, -1, "toString");
+		duk_remove(ctx, -2);
+		e->tostring = duk_get_top_index(ctx);
+
+		encode_value(ctx, e, value, 0);
+
+		// the value was encoded, detach the transferred buffers
+		for (auto ptr : e->detach)
+		{
+			duk_push_heapptr(ctx, ptr);
+			detach_external_arraybuffer(ctx, -1);
+			duk_pop(ctx);
+		}
+		for (size_t i = 0; i < e->detachtransferables.size(); i++)
+		{
+			duk_push_heapptr(ctx, e->detachtransferables[i]);
+			e->out->transferables[i]->detach(ctx, -1);
+			duk_pop(ctx);
+		}
+		return 0;
+	}
+
+	/**
+	 * Serializes the value at index, transferring the objects of the array at index "transfer"
+	 * (which may be DUK_INVALID_INDEX). ArrayBuffers created in script are copied instead.
+	 * On failure returns false and leaves the error on the stack top.
+	 */
+	inline bool encode(duk_context *ctx, duk_idx_t index, duk_idx_t transfer, Message &out)
+	{
+		Encoder e;
+		e.out = &out;
+		duk_dup(ctx, index);
+		if (transfer != DUK_INVALID_INDEX)
+			duk_dup(ctx, transfer);
+		else
+			duk_push_undefined(ctx);
+		if (duk_safe_call(ctx, &encode_safe, &e, 2, 1) != DUK_EXEC_SUCCESS)
+		{
+			out.data.clear();
+			out.transfers.clear();
+			out.shared.clear();
+			out.transferables.clear();
+			return false;
+		}
+		duk_pop(ctx);
+		return true;
+	}
+
+	//
+	// Decoder
+	//
+
+	inline void read_check(duk_context *ctx, Decoder *d, duk_size_t len)
+	{
+		if (static_cast<duk_size_t>(d->end - d->p) < len)
+			duk_error(ctx, DUK_ERR_RANGE_ERROR, "DataCloneError: truncated data");
+	}
+
+	inline duk_uint32_t read_varint(duk_context *ctx, Decoder *d)
+	{
+		duk_uint32_t ret = 0;
+		for (int shift = 0; shift < 35; shift += 7)
+		{
+			read_check(ctx, d, 1);
+			unsigned char b = *d->p++;
+			ret |= static_cast<duk_uint32_t>(b & 0x7F) << shift;
+			if ((b & 0x80) == 0)
+				return ret;
+		}
+		duk_error(ctx, DUK_ERR_RANGE_ERROR, "DataCloneError: invalid data");
+		return 0;
+	}
+
+	inline duk_double_t read_double(duk_context *ctx, Decoder *d)
+	{
+		duk_double_t ret;
+		read_check(ctx, d, sizeof(ret));
+		std::memcpy(&ret, d->p, sizeof(ret));
+		d->p += sizeof(ret);
+		return ret;
+	}
+
+	/**
+	 * Reads length-prefixed bytes, returns a pointer into the data
+	 */
+	inline const unsigned char *read_bytes(duk_context *ctx, Decoder *d, duk_size_t &len)
+	{
+		len = read_varint(ctx, d);
+		read_check(ctx, d, len);
+		const unsigned char *ret = d->p;
+		d->p += len;
+		return ret;
+	}
+
+	inline void push_string(duk_context *ctx, Decoder *d)
+	{
+		duk_size_t len;
+		const unsigned char *str = read_bytes(ctx, d, len);
+		duk_push_lstring(ctx, reinterpret_cast<const char*>(str), len);
+	}
+
+	/**
+	 * Registers the object on the stack top with the next reference id
+	 */
+	inline void add_ref(duk_context *ctx, Decoder *d)
+	{
+		duk_dup_top(ctx);
+		duk_put_prop_index(ctx, d->refs, d->refcount++);
+	}
+
+	inline void push_global_new(duk_context *ctx, const char *constructor, duk_idx_t nargs)
+	{
+		duk_get_global_string(ctx, constructor);
+		duk_insert(ctx, -1 - nargs);
+		duk_new(ctx, nargs);
+	}
+
+	inline void push_arraybuffer(duk_context *ctx, const unsigned char *data, duk_size_t len)
+	{
+		void *buf = duk_push_fixed_buffer(ctx, len);
+		if (len > 0)
+			std::memcpy(buf, data, len);
+		duk_push_buffer_object(ctx, -1, 0, len, DUK_BUFOBJ_ARRAYBUFFER);
+		duk_remove(ctx, -2);
+	}
+
+	inline void decode_value(duk_context *ctx, Decoder *d, int depth)
+	{
+		if (depth > MAX_DEPTH)
+			duk_error(ctx, DUK_ERR_RANGE_ERROR, "DataCloneError: maximum depth exceeded");
+
+		read_check(ctx, d, 1);
+		unsigned char tag = *d->p++;
+		switch (tag)
+		{
+		case TAG_UNDEFINED:
+			duk_push_undefined(ctx);
+			break;
+		case TAG_NULL:
+			duk_push_null(ctx);
+			break;
+		case TAG_TRUE:
+			duk_push_true(ctx);
+			break;
+		case TAG_FALSE:
+			duk_push_false(ctx);
+			break;
+		case TAG_INT:
+		{
+			duk_uint32_t z = read_varint(ctx, d);
+			duk_push_int(ctx, static_cast<duk_int_t>(static_cast<duk_int32_t>((z >> 1) ^ (~(z & 1) + 1))));
+			break;
+		}
+		case TAG_DOUBLE:
+			duk_push_number(ctx, read_double(ctx, d));
+			break;
+		case TAG_STRING:
+			push_string(ctx, d);
+			break;
+		case TAG_ARRAY:
+		{
+			duk_uint32_t len = read_varint(ctx, d);
+			duk_push_array(ctx);
+			add_ref(ctx, d);
+			for (duk_uint32_t i = 0; i < len; i++)
+			{
+				decode_value(ctx, d, depth + 1);
+				duk_put_prop_index(ctx, -2, i);
+			}
+			break;
+		}
+		case TAG_OBJECT:
+		{
+			duk_uint32_t count;
+			read_check(ctx, d, sizeof(count));
+			std::memcpy(&count, d->p, sizeof(count));
+			d->p += sizeof(count);
+			duk_push_object(ctx);
+			add_ref(ctx, d);
+			for (duk_uint32_t i = 0; i < count; i++)
+			{
+				push_string(ctx, d);
+				decode_value(ctx, d, depth + 1);
+				// define the property, inherited setters must not be called
+				duk_def_prop(ctx, -3, DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_SET_WEC);
+			}
+			break;
+		}
+		case TAG_DATE:
+			duk_push_number(ctx, read_double(ctx, d));
+			push_global_new(ctx, "Date", 1);
+			add_ref(ctx, d);
+			break;
+		case TAG_REGEXP:
+			push_string(ctx, d);
+			push_string(ctx, d);
+			push_global_new(ctx, "RegExp", 2);
+			add_ref(ctx, d);
+			break;
+		case TAG_ERROR:
+			duk_push_error_object(ctx, DUK_ERR_ERROR, "");
+			add_ref(ctx, d);
+			push_string(ctx, d);
+			duk_put_prop_string(ctx, -2, "name");
+			push_string(ctx, d);
+			duk_put_prop_string(ctx, -2, "message");
+			break;
+		case TAG_ARRAYBUFFER:
+		{
+			duk_size_t len;
+			const unsigned char *data = read_bytes(ctx, d, len);
+			push_arraybuffer(ctx, data, len);
+			add_ref(ctx, d);
+			break;
+		}
+		case TAG_VIEW:
+		{
+			// the reference id is reserved before the buffer is decoded
+			duk_uarridx_t id = d->refcount++;
+			read_check(ctx, d, 1);
+			duk_uint_t type = *d->p++;
+			decode_value(ctx, d, depth + 1);
+			duk_uint32_t offset = read_varint(ctx, d);
+			duk_uint32_t len = read_varint(ctx, d);
+			if (type > DUK_BUFOBJ_FLOAT64ARRAY || !duk_is_buffer_data(ctx, -1))
+				duk_error(ctx, DUK_ERR_RANGE_ERROR, "DataCloneError: invalid data");
+			duk_push_buffer_object(ctx, -1, offset, len, type);
+			duk_remove(ctx, -2);
+			duk_dup_top(ctx);
+			duk_put_prop_index(ctx, d->refs, id);
+			break;
+		}
+		case TAG_PLAINBUFFER:
+		{
+			duk_size_t len;
+			const unsigned char *data = read_bytes(ctx, d, len);
+			void *buf = duk_push_fixed_buffer(ctx, len);
+			if (len > 0)
+				std::memcpy(buf, data, len);
+			add_ref(ctx, d);
+			break;
+		}
+		case TAG_TRANSFER:
+		{
+			duk_uint32_t index = read_varint(ctx, d);
+			if (index >= d->message->transfers.size())
+				duk_error(ctx, DUK_ERR_RANGE_ERROR, "DataCloneError: invalid transfer");
+			push_external_arraybuffer(ctx, d->message->transfers[index].get());
+			add_ref(ctx, d);
+			break;
+		}
+		case TAG_SHARED:
+		{
+			duk_uint32_t index = read_varint(ctx, d);
+			if (index >= d->message->shared.size())
+				duk_error(ctx, DUK_ERR_RANGE_ERROR, "DataCloneError: invalid shared buffer");
+			push_shared_arraybuffer(ctx, d->message->shared[index].get());
+			add_ref(ctx, d);
+			break;
+		}
+		case TAG_TRANSFERABLE:
+		{
+			duk_uint32_t index = read_varint(ctx, d);
+			if (index >= d->message->transferables.size())
+				duk_error(ctx, DUK_ERR_RANGE_ERROR, "DataCloneError: invalid transferable");
+			d->message->transferables[index]->push(ctx);
+			add_ref(ctx, d);
+			break;
+		}
+		case TAG_REF:
+		{
+			duk_uint32_t id = read_varint(ctx, d);
+			if (id >= d->refcount)
+				duk_error(ctx, DUK_ERR_RANGE_ERROR, "DataCloneError: invalid reference");
+			duk_get_prop_index(ctx, d->refs, id);
+			break;
+		}
+		default:
+			duk_error(ctx, DUK_ERR_RANGE_ERROR, "DataCloneError: invalid data");
+		}
+	}
+
+	inline duk_ret_t decode_safe(duk_context *ctx, void *udata)
+	{
+		Decoder *d = static_cast<Decoder*>(udata);
+		d->refs = duk_push_array(ctx);
+		decode_value(ctx, d, 0);
+		if (d->p != d->end)
+			duk_error(ctx, DUK_ERR_RANGE_ERROR, "DataCloneError: invalid data");
+		return 1;
+	}
+
+	/**
+	 * Deserializes and pushes the value.
+	 * On failure returns false and pushes the error instead.
+	 */
+	inline bool decode_push(duk_context *ctx, const Message &message)
+	{
+		const unsigned char *p = reinterpret_cast<const unsigned char*>(message.data.data());
+		Decoder d{ p, p + message.data.size(), 0, 0, &message };
+		return duk_safe_call(ctx, &decode_safe, &d, 0, 1) == DUK_EXEC_SUCCESS;
+	}
+
+}
+
+} }
@@ -0,0 +1,178 @@
+#pragma once
+
+#include "../IntrusiveRefCntPtr.h"
+
+#include <duktape.h>
+
+#include <cstdlib>
+#include <functional>
+#include <new>
+
+namespace dtel {
+namespace detail {
+
+static const char* PROP_EXTERNAL_BLOCK = "\xFF" "DTEL_EXTERNAL_BLOCK";
+static const char* PROP_EXTERNAL_BUFFER = "\xFF" "DTEL_EXTERNAL_BUFFER";
+static const char* PROP_EXTERNAL_SHARED = "\xFF" "DTEL_EXTERNAL_SHARED";
+
+/**
+ * Reference counted native memory, which can be mapped into any heap as an external buffer.
+ * The memory does not belong to any heap, so it can be moved between heaps without copying.
+ */
+class ExternalBlock : public ThreadSafeRefCountedBase<ExternalBlock>
+{
+public:
+	typedef IntrusiveRefCntPtr<ExternalBlock> Ptr;
+	typedef std::function<void(void *data, size_t size)> deleter_t;
+
+	/**
+	 * Allocates a zero-filled block
+	 */
+	explicit ExternalBlock(size_t size) :
+		_data(size > 0 ? std::calloc(size, 1) : NULL), _size(size), _deleter()
+	{
+		if (size > 0 && !_data)
+			throw std::bad_alloc();
+	}
+
+	/**
+	 * Takes ownership of memory, which is released with the deleter
+	 */
+	ExternalBlock(void *data, size_t size, deleter_t deleter) :
+		_data(data), _size(size), _deleter(deleter)
+	{
+	}
+
+	~ExternalBlock()
+	{
+		if (_deleter)
+			_deleter(_data, _size);
+		else
+			std::free(_data);
+	}
+
+	void *data() const
+	{
+		return _data;
+	}
+
+	size_t size() const
+	{
+		return _size;
+	}
+
+	ExternalBlock(const ExternalBlock &) = delete;
+	ExternalBlock &operator=(const ExternalBlock &) = delete;
+private:
+	void *_data;
+	size_t _size;
+	deleter_t _deleter;
+};
+
+inline void r_externalblock_release(duk_context *ctx, duk_idx_t idx)
+{
+	duk_get_prop_string(ctx, idx, PROP_EXTERNAL_BLOCK);
+	if (duk_is_pointer(ctx, -1) != 0)
+	{
+		static_cast<ExternalBlock*>(duk_get_pointer(ctx, -1))->Release();
+		duk_del_prop_string(ctx, idx, PROP_EXTERNAL_BLOCK);
+	}
+	duk_pop(ctx);
+}
+
+inline duk_ret_t r_externalblock_finalizer(duk_context *ctx)
+{
+	// 0 = ArrayBuffer
+	r_externalblock_release(ctx, 0);
+	return 0;
+}
+
+/**
+ * Pushes an ArrayBuffer over the block memory, without copying.
+ * The ArrayBuffer keeps a reference to the block until it is finalized. Views over it keep the
+ * ArrayBuffer alive, so the memory is never released while reachable.
+ */
+inline void push_external_arraybuffer(duk_context *ctx, ExternalBlock *block)
+{
+	duk_push_external_buffer(ctx);
+	duk_config_buffer(ctx, -1, block->data(), block->size());
+	duk_push_buffer_object(ctx, -1, 0, block->size(), DUK_BUFOBJ_ARRAYBUFFER);
+	// keep the plain buffer, to allow detaching
+	duk_swap_top(ctx, -2);
+	duk_put_prop_string(ctx, -2, PROP_EXTERNAL_BUFFER);
+
+	block->Retain();
+	duk_push_pointer(ctx, block);
+	duk_put_prop_string(ctx, -2, PROP_EXTERNAL_BLOCK);
+	duk_push_c_function(ctx, &r_externalblock_finalizer, 1);
+	duk_set_finalizer(ctx, -2);
+}
+
+/**
+ * Returns the block of an ArrayBuffer pushed by push_external_arraybuffer, or null
+ */
+inline ExternalBlock *get_external_block(duk_context *ctx, duk_idx_t idx)
+{
+	ExternalBlock *ret = NULL;
+	if (!duk_is_object(ctx, idx))
+		return ret;
+	duk_get_prop_string(ctx, idx, PROP_EXTERNAL_BLOCK);
+	if (duk_is_pointer(ctx, -1) != 0)
+		ret = static_cast<ExternalBlock*>(duk_get_pointer(ctx, -1));
+	duk_pop(ctx);
+	return ret;
+}
+
+/**
+ * Pushes a SharedArrayBuffer over the block memory. Every heap the block is pushed into sees the same memory.
+ * Uses the SharedArrayBuffer prototype of the heap if it was registered.
+ */
+inline void push_shared_arraybuffer(duk_context *ctx, ExternalBlock *block)
+{
+	push_external_arraybuffer(ctx, block);
+	duk_push_true(ctx);
+	duk_put_prop_string(ctx, -2, PROP_EXTERNAL_SHARED);
+
+	if (duk_get_global_string(ctx, "SharedArrayBuffer") != 0 && duk_is_function(ctx, -1))
+	{
+		duk_get_prop_string(ctx, -1, "prototype");
+		duk_set_prototype(ctx, -3);
+	}
+	duk_pop(ctx);
+}
+
+/**
+ * Returns whether the value is a SharedArrayBuffer pushed by push_shared_arraybuffer
+ */
+inline bool is_shared_arraybuffer(duk_context *ctx, duk_idx_t idx)
+{
+	if (!duk_is_object(ctx, idx))
+		return false;
+	return duk_has_prop_string(ctx, idx, PROP_EXTERNAL_SHARED) != 0;
+}
+
+/**
+ * Returns whether the value is an ArrayBuffer detached by detach_external_arraybuffer
+ */
+inline bool is_detached_arraybuffer(duk_context *ctx, duk_idx_t idx)
+{
+	if (!duk_is_object(ctx, idx))
+		return false;
+	return duk_has_prop_string(ctx, idx, PROP_EXTERNAL_BUFFER) != 0 &&
+		duk_has_prop_string(ctx, idx, PROP_EXTERNAL_BLOCK) == 0;
+}
+
+/**
+ * Detaches an ArrayBuffer pushed by push_external_arraybuffer: it and all its views see no data anymore,
+ * and its reference to the block is released.
+ */
+inline void detach_external_arraybuffer(duk_context *ctx, duk_idx_t idx)
+{
+	idx = duk_normalize_index(ctx, idx);
+	if (duk_get_prop_string(ctx, idx, PROP_EXTERNAL_BUFFER) != 0)
+		duk_config_buffer(ctx, -1, NULL, 0);
+	duk_pop(ctx);
+	r_externalblock_release(ctx, idx);
+}
+
+} }
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+
+namespace dtel {
+namespace detail {
+
+/**
+ * Interrupt flag of the heap running on the current thread, NULL if it can't be interrupted
+ */
+inline std::atomic_bool *&exec_interrupt_flag()
+{
+	static thread_local std::atomic_bool *flag = NULL;
+	return flag;
+}
+
+/**
+ * Returns whether the script running on the current thread must be aborted
+ */
+inline bool exec_interrupted()
+{
+	std::atomic_bool *flag = exec_interrupt_flag();
+	return flag && flag->load(std::memory_order_relaxed);
+}
+
+/**
+ * Sets the interrupt flag of the current thread while a heap runs on it
+ */
+class ExecInterruptScope
+{
+public:
+	explicit ExecInterruptScope(std::atomic_bool *flag) :
+		_previous(exec_interrupt_flag())
+	{
+		exec_interrupt_flag() = flag;
+	}
+
+	~ExecInterruptScope()
+	{
+		exec_interrupt_flag() = _previous;
+	}
+
+	ExecInterruptScope(const ExecInterruptScope &) = delete;
+	ExecInterruptScope &operator=(const ExecInterruptScope &) = delete;
+private:
+	std::atomic_bool *_previous;
+};
+
+} }
+
+/**
+ * Hook for DUK_USE_EXEC_TIMEOUT_CHECK, so a running script can be aborted (Worker.terminate).
+ * duktape must be compiled as C++ with:
+ *   #define DUK_USE_INTERRUPT_COUNTER
+ *   #define DUK_USE_EXEC_TIMEOUT_CHECK(udata) dtel_exec_timeout_check((udata))
+ */
+inline int dtel_exec_timeout_check(void *udata)
+{
+	return dtel::detail::exec_interrupted() ? 1 : 0;
+}
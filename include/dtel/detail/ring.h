@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace dtel {
+namespace detail {
+
+/**
+ * Fixed capacity single producer, single consumer queue.
+ * push must only be called from one thread and pop from one (possibly other) thread.
+ */
+template <typename T, size_t N>
+class SPSCRing
+{
+public:
+	static_assert(N > 0 && (N & (N - 1)) == 0, "capacity must be a power of two");
+
+	SPSCRing() :
+		_items(), _pad0(), _head(0), _pad1(), _tail(0)
+	{
+	}
+
+	/**
+	 * Moves the value into the queue, returns false if it is full
+	 */
+	bool push(T &&value)
+	{
+		size_t tail = _tail.load(std::memory_order_relaxed);
+		if (tail - _head.load(std::memory_order_acquire) == N)
+			return false;
+		_items[tail & (N - 1)] = std::move(value);
+		_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * Moves the oldest value out of the queue, returns false if it is empty
+	 */
+	bool pop(T &value)
+	{
+		size_t head = _head.load(std::memory_order_relaxed);
+		if (head == _tail.load(std::memory_order_acquire))
+			return false;
+		value = std::move(_items[head & (N - 1)]);
+		_items[head & (N - 1)] = T();
+		_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool empty() const
+	{
+		return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+	}
+
+	SPSCRing(const SPSCRing &) = delete;
+	SPSCRing &operator=(const SPSCRing &) = delete;
+private:
+	std::array<T, N> _items;
+	// keep the consumer and producer indexes on separate cache lines
+	char _pad0[64];
+	std::atomic<size_t> _head;
+	char _pad1[64];
+	std::atomic<size_t> _tail;
+};
+
+} }
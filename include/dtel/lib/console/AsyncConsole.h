@@ -0,0 +1,361 @@
+#pragma once
+
+#include "Handler.h"
+
+#include <dtel/detail/ring.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace dtel {
+namespace console {
+
+/**
+ * What AsyncConsole does with a message when its ring is full
+ */
+enum overflow_policy_t {
+	// discard it
+	OVERFLOW_DROP,
+	// discard it, and tell the sink how many were discarded once there is room
+	OVERFLOW_COUNT,
+	// wait until the background thread makes room
+	OVERFLOW_BLOCK,
+};
+
+/**
+ * Console worker that never waits on the sink: messages are appended to rings, and a background thread
+ * writes them to the sink. A single instance can be shared by all the loops, the sink is then only called
+ * from one thread.
+ *
+ * Each heap should log through its own writer(), which appends to its own ring without locking. The messages
+ * of a writer keep their order, even when its heap moves between threads. The rings are merged by the time
+ * of the messages as they become visible, so messages of different writers logged at nearly the same time
+ * can come out swapped. Calling output() or clear() directly appends to a single ring under a lock.
+ */
+class AsyncConsole : public ConsoleWorker
+{
+private:
+	struct Producer;
+public:
+	typedef IntrusiveRefCntPtr<AsyncConsole> Ptr;
+
+	/**
+	 * Appends to one ring of the console. Must only be used by one thread at a time, like a heap.
+	 */
+	class Writer : public ConsoleWorker
+	{
+	public:
+		Writer(AsyncConsole::Ptr console, Producer *producer) :
+			_console(console), _producer(producer)
+		{
+		}
+
+		~Writer()
+		{
+			// the ring can be reused once the background thread drains it
+			_producer->closed.store(true, std::memory_order_release);
+		}
+
+		void clear() override
+		{
+			_console->append(_producer, Record(true, std::string(), std::string()));
+		}
+
+		void output(const std::string &outputtype, const std::string &message) override
+		{
+			_console->append(_producer, Record(false, outputtype, message));
+		}
+	private:
+		AsyncConsole::Ptr _console;
+		Producer *_producer;
+	};
+
+	explicit AsyncConsole(ConsoleWorker::Ptr sink, overflow_policy_t overflow = OVERFLOW_COUNT) :
+		_sink(sink), _overflow(overflow), _producersLock(), _producers(), _producerCount(0), _sharedLock(),
+		_shared(NULL), _lock(), _cv(), _idle(), _sleeping(false), _stop(false), _thread()
+	{
+		_shared = producer();
+		_thread = std::thread(&AsyncConsole::drain, this);
+	}
+
+	/**
+	 * Writes the remaining messages and stops the background thread
+	 */
+	~AsyncConsole()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_stop = true;
+		}
+		_cv.notify_one();
+		_thread.join();
+	}
+
+	/**
+	 * Creates a writer with its own ring, set it as the worker of the console handler of one heap
+	 */
+	ConsoleWorker::Ptr writer()
+	{
+		return new Writer(this, producer());
+	}
+
+	void clear() override
+	{
+		std::lock_guard<std::mutex> lock(_sharedLock);
+		append(_shared, Record(true, std::string(), std::string()));
+	}
+
+	void output(const std::string &outputtype, const std::string &message) override
+	{
+		std::lock_guard<std::mutex> lock(_sharedLock);
+		append(_shared, Record(false, outputtype, message));
+	}
+
+	/**
+	 * Waits until the messages appended before the call were written to the sink
+	 */
+	void flush()
+	{
+		std::vector<std::pair<Producer*, uint64_t>> pending;
+		{
+			std::lock_guard<std::mutex> lock(_producersLock);
+			for (auto &p : _producers)
+				pending.emplace_back(p.get(), p->pushed.load(std::memory_order_acquire));
+		}
+		std::unique_lock<std::mutex> lock(_lock);
+		_cv.notify_one();
+		_idle.wait(lock, [&pending] {
+			for (auto &p : pending)
+				if (p.first->written.load(std::memory_order_acquire) < p.second)
+					return false;
+			return true;
+		});
+	}
+
+	/**
+	 * Amount of messages discarded because a ring was full
+	 */
+	uint64_t dropped() const
+	{
+		uint64_t ret = 0;
+		std::lock_guard<std::mutex> lock(_producersLock);
+		for (auto &p : _producers)
+			ret += p->dropped.load(std::memory_order_relaxed);
+		return ret;
+	}
+
+	overflow_policy_t overflow() const
+	{
+		return _overflow;
+	}
+
+	AsyncConsole(const AsyncConsole &) = delete;
+	AsyncConsole &operator=(const AsyncConsole &) = delete;
+private:
+	struct Record
+	{
+		Record() : timestamp(0), clear(false), outputtype(), message() {}
+
+		Record(bool clear, const std::string &outputtype, const std::string &message) :
+			timestamp(std::chrono::steady_clock::now().time_since_epoch().count()), clear(clear),
+			outputtype(outputtype), message(message) {}
+
+		int64_t timestamp;
+		bool clear;
+		std::string outputtype;
+		std::string message;
+	};
+
+	// messages each writer can have waiting
+	static const size_t RING_SIZE = 1024;
+
+	/**
+	 * The ring of a writer. Only the writer writes pushed, dropped and closed, only the background thread
+	 * writes the rest.
+	 */
+	struct Producer
+	{
+		Producer() : ring(), pushed(0), dropped(0), written(0), closed(false), reported(0), next(), hasNext(false) {}
+
+		dtel::detail::SPSCRing<Record, RING_SIZE> ring;
+		std::atomic<uint64_t> pushed;
+		std::atomic<uint64_t> dropped;
+		std::atomic<uint64_t> written;
+		// the writer was destroyed
+		std::atomic<bool> closed;
+		uint64_t reported;
+		// the oldest message, taken from the ring for the merge
+		Record next;
+		bool hasNext;
+	};
+
+	/**
+	 * Returns a ring for a new writer, reusing the one of a destroyed writer if it was drained
+	 */
+	Producer *producer()
+	{
+		std::lock_guard<std::mutex> lock(_producersLock);
+		for (auto &p : _producers)
+		{
+			if (p->closed.load(std::memory_order_acquire) &&
+				p->written.load(std::memory_order_acquire) == p->pushed.load(std::memory_order_relaxed))
+			{
+				p->closed.store(false, std::memory_order_relaxed);
+				return p.get();
+			}
+		}
+		_producers.emplace_back(new Producer());
+		_producerCount.store(_producers.size(), std::memory_order_release);
+		return _producers.back().get();
+	}
+
+	void append(Producer *p, Record &&record)
+	{
+		if (!p->ring.push(std::move(record)))
+		{
+			if (_overflow != OVERFLOW_BLOCK)
+			{
+				p->dropped.store(p->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				wake();
+				return;
+			}
+			while (!p->ring.push(std::move(record)))
+			{
+				wake();
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+			}
+		}
+		p->pushed.store(p->pushed.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		wake();
+	}
+
+	void wake()
+	{
+		// only takes the lock if the background thread is sleeping
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (_sleeping.load(std::memory_order_relaxed))
+		{
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+			}
+			_cv.notify_one();
+		}
+	}
+
+	/**
+	 * Writes the available messages, the oldest first. Returns whether anything was written.
+	 */
+	bool write(const std::vector<Producer*> &producers)
+	{
+		bool ret = false;
+		for (;;)
+		{
+			Producer *oldest = NULL;
+			for (Producer *p : producers)
+			{
+				if (!p->hasNext)
+					p->hasNext = p->ring.pop(p->next);
+				if (p->hasNext && (!oldest || p->next.timestamp < oldest->next.timestamp))
+					oldest = p;
+			}
+			if (!oldest)
+				break;
+
+			ret = true;
+			if (_overflow == OVERFLOW_COUNT)
+				report(oldest);
+			// a failing sink loses the message, but must not stop the console
+			try
+			{
+				if (oldest->next.clear)
+					_sink->clear();
+				else
+					_sink->output(oldest->next.outputtype, oldest->next.message);
+			}
+			catch (...)
+			{
+			}
+			oldest->next = Record();
+			oldest->hasNext = false;
+			oldest->written.store(oldest->written.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+		if (_overflow == OVERFLOW_COUNT)
+			for (Producer *p : producers)
+				report(p);
+		return ret;
+	}
+
+	void report(Producer *p)
+	{
+		uint64_t dropped = p->dropped.load(std::memory_order_relaxed);
+		if (dropped != p->reported)
+		{
+			uint64_t count = dropped - p->reported;
+			p->reported = dropped;
+			try
+			{
+				_sink->output("warn", "console: " + std::to_string(count) + " messages dropped");
+			}
+			catch (...)
+			{
+			}
+		}
+	}
+
+	void drain()
+	{
+		std::vector<Producer*> producers;
+		for (;;)
+		{
+			// the producers are only added
+			if (producers.size() != _producerCount.load(std::memory_order_acquire))
+			{
+				std::lock_guard<std::mutex> lock(_producersLock);
+				producers.clear();
+				for (auto &p : _producers)
+					producers.push_back(p.get());
+			}
+
+			if (write(producers))
+				continue;
+
+			std::unique_lock<std::mutex> lock(_lock);
+			_idle.notify_all();
+			if (_stop)
+				break;
+			_sleeping.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			bool empty = producers.size() == _producerCount.load(std::memory_order_acquire);
+			for (Producer *p : producers)
+				if (!p->ring.empty())
+					empty = false;
+			if (empty)
+				_cv.wait_for(lock, std::chrono::milliseconds(100));
+			_sleeping.store(false, std::memory_order_relaxed);
+		}
+	}
+
+	ConsoleWorker::Ptr _sink;
+	overflow_policy_t _overflow;
+	mutable std::mutex _producersLock;
+	std::vector<std::unique_ptr<Producer>> _producers;
+	std::atomic<size_t> _producerCount;
+	// ring of the direct output() and clear() calls
+	std::mutex _sharedLock;
+	Producer *_shared;
+	std::mutex _lock;
+	std::condition_variable _cv;
+	std::condition_variable _idle;
+	std::atomic<bool> _sleeping;
+	bool _stop;
+	std::thread _thread;
+};
+
+} }
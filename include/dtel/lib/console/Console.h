@@ -19,26 +19,6 @@ inline ConsoleHandler::Ptr RegisterConsole(EventLoop *eventloop)
 	duk_context *ctx = eventloop->ctx();
 	ResetStackOnScopeExit r(ctx);
 
-	//
-	// Event
-	//
-	if (duk_peval_string(eventloop->ctx(), R"(
-
-var console = {};
-
-console.clear = function() { this.__clear(); };
-console.log = function() { this.__output("log", arguments); };
-console.debug = function() { this.__output("debug", arguments); };
-console.error = function() { this.__output("error", arguments); };
-console.info = function() { this.__output("info", arguments); };
-console.warn = function() { this.__output("warn", arguments); };
-
-	)") != 0)
-	{
-		ThrowError(eventloop->ctx(), -1);
-	};
-	duk_pop(ctx);
-
 	ConsoleHandler::Ptr handler(new ConsoleHandler(eventloop));
 
 	// register the functions
@@ -2,9 +2,23 @@
 
 #include <dtel.h>
 
+#include <atomic>
+
 namespace dtel {
 namespace console {
 
+/**
+ * Console output levels, console.log is CONSOLE_LEVEL_INFO
+ */
+enum console_level_t {
+	CONSOLE_LEVEL_DEBUG,
+	CONSOLE_LEVEL_INFO,
+	CONSOLE_LEVEL_WARN,
+	CONSOLE_LEVEL_ERROR,
+	// nothing is output
+	CONSOLE_LEVEL_NONE,
+};
+
 class ConsoleWorker : public ThreadSafeRefCountedBase<ConsoleWorker>
 {
 public:
@@ -32,7 +46,7 @@ public:
 	typedef IntrusiveRefCntPtr<ConsoleHandler> Ptr;
 
 	ConsoleHandler(EventLoop *eventloop) :
-		_eventloop(eventloop)
+		_eventloop(eventloop), _minimumLevel(CONSOLE_LEVEL_DEBUG)
 	{
 
 	}
@@ -51,9 +65,23 @@ public:
 	{
 		_worker = worker;
 	}
+
+	console_level_t minimumLevel() const
+	{
+		return _minimumLevel.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Calls below the level return before converting their arguments. Can be changed from any thread.
+	 */
+	void setMinimumLevel(console_level_t level)
+	{
+		_minimumLevel.store(level, std::memory_order_relaxed);
+	}
 private:
 	EventLoop *_eventloop;
 	ConsoleWorker::Ptr _worker;
+	std::atomic<console_level_t> _minimumLevel;
 };
 
 } }
\ No newline at end of file
@@ -4,7 +4,8 @@
 
 #include <duktape.h>
 
-#include <sstream>
+#include <cmath>
+#include <string>
 
 namespace dtel {
 namespace console {
@@ -12,65 +13,248 @@ namespace detail {
 
 	static const char* PROP_ELHANDLER = "\xFF" "DTEL_CONSOLE_HANDLER";
 
+	enum output_type_t {
+		OUTPUT_LOG,
+		OUTPUT_DEBUG,
+		OUTPUT_INFO,
+		OUTPUT_WARN,
+		OUTPUT_ERROR,
+	};
+
+	static const char* OUTPUT_TYPES[] = { "log", "debug", "info", "warn", "error" };
+	static const console_level_t OUTPUT_LEVELS[] = { CONSOLE_LEVEL_INFO, CONSOLE_LEVEL_DEBUG, CONSOLE_LEVEL_INFO,
+		CONSOLE_LEVEL_WARN, CONSOLE_LEVEL_ERROR };
+
 	/**
 	* Storage of the handler inside duktape
 	*/
 	struct ConsoleHandlerStorage
 	{
 		ConsoleHandler::Ptr handler;
+		// message buffer, reused by every call
+		std::string buffer;
+		// a toString called while formatting can log too
+		bool formatting;
 	};
 
-	inline ConsoleHandlerStorage *consolehandler_from_this(duk_context *ctx)
+	/**
+	 * Gets the handler from the context
+	 */
+	inline ConsoleHandlerStorage *consolehandler_from_ctx(duk_context *ctx)
 	{
-		duk_push_this(ctx);
-		duk_require_object_coercible(ctx, -1);
+		duk_push_heap_stash(ctx);
+		// object on stash
+		duk_get_prop_string(ctx, -1, PROP_ELHANDLER);
+		// property on object
+		duk_get_prop_string(ctx, -1, PROP_ELHANDLER);
+		ConsoleHandlerStorage *ret = static_cast<ConsoleHandlerStorage*>(duk_get_pointer(ctx, -1));
+		duk_pop_3(ctx);
+		return ret;
+	}
 
+	/**
+	 * Gets the handler from the called function, faster than from the stash
+	 */
+	inline ConsoleHandlerStorage *consolehandler_from_function(duk_context *ctx)
+	{
+		duk_push_current_function(ctx);
 		duk_get_prop_string(ctx, -1, PROP_ELHANDLER);
 		ConsoleHandlerStorage *ret = static_cast<ConsoleHandlerStorage*>(duk_get_pointer(ctx, -1));
-		duk_pop_2(ctx); // "this", prop
+		duk_pop_2(ctx);
 		return ret;
 	}
 
-	duk_ret_t r_console_Clear(duk_context *ctx)
+	inline void append_value(duk_context *ctx, duk_idx_t idx, std::string &buffer)
+	{
+		duk_size_t size;
+		const char *str = duk_safe_to_lstring(ctx, idx, &size);
+		buffer.append(str, size);
+		duk_pop(ctx);
+	}
+
+	// safe call, converts the value on the top of the stack to a number, truncated if udata is set
+	inline duk_ret_t r_console_number(duk_context *ctx, void *udata)
+	{
+		duk_double_t value = duk_to_number(ctx, -1);
+		if (udata != NULL && std::isfinite(value))
+			value = std::trunc(value);
+		duk_push_number(ctx, value);
+		return 1;
+	}
+
+	// appends the value as a number, "NaN" if the conversion throws
+	inline void append_number(duk_context *ctx, duk_idx_t idx, bool integer, std::string &buffer)
+	{
+		duk_dup(ctx, idx);
+		if (duk_safe_call(ctx, &r_console_number, integer ? ctx : NULL, 1, 1) != DUK_EXEC_SUCCESS)
+		{
+			buffer.append("NaN");
+			duk_pop(ctx);
+		}
+		else
+		{
+			append_value(ctx, -1, buffer);
+		}
+	}
+
+	// safe call, encodes the value on the top of the stack
+	inline duk_ret_t r_console_json(duk_context *ctx, void *udata)
+	{
+		bool readable = udata != NULL;
+		if (readable)
+		{
+			if (duk_get_global_string(ctx, "Duktape") != 0 && duk_is_object(ctx, -1))
+			{
+				// JX shows functions and undefined
+				duk_get_prop_string(ctx, -1, "enc");
+				duk_push_string(ctx, "jx");
+				duk_dup(ctx, -4);
+				duk_call(ctx, 2);
+				return 1;
+			}
+			duk_pop(ctx);
+		}
+		duk_json_encode(ctx, -1);
+		return 1;
+	}
+
+	// appends the value as JSON, "[Circular]" if it can't be encoded
+	inline void append_json(duk_context *ctx, duk_idx_t idx, bool readable, std::string &buffer)
+	{
+		duk_dup(ctx, idx);
+		if (duk_safe_call(ctx, &r_console_json, readable ? ctx : NULL, 1, 1) != DUK_EXEC_SUCCESS)
+		{
+			buffer.append("[Circular]");
+		}
+		else if (duk_is_string(ctx, -1))
+		{
+			duk_size_t size;
+			const char *str = duk_get_lstring(ctx, -1, &size);
+			buffer.append(str, size);
+		}
+		else
+		{
+			buffer.append("undefined");
+		}
+		duk_pop(ctx);
+	}
+
+	/**
+	 * Formats the arguments from "first" to the top of the stack into the buffer, like util.format.
+	 * If the first is a string, its %s %d %i %f %o %O %j %c and %% specifiers consume the next arguments.
+	 * The arguments left are appended separated by spaces.
+	 */
+	inline void format_arguments(duk_context *ctx, duk_idx_t first, std::string &buffer)
+	{
+		duk_idx_t top = duk_get_top(ctx);
+		duk_idx_t arg = first;
+
+		if (arg < top && duk_is_string(ctx, arg))
+		{
+			duk_size_t size;
+			const char *format = duk_get_lstring(ctx, arg, &size);
+			arg++;
+
+			duk_size_t start = 0;
+			for (duk_size_t i = 0; i + 1 < size; i++)
+			{
+				if (format[i] != '%')
+					continue;
+				char spec = format[i + 1];
+				if (spec != '%' && (arg >= top || (spec != 's' && spec != 'd' && spec != 'i' && spec != 'f' &&
+					spec != 'o' && spec != 'O' && spec != 'j' && spec != 'c')))
+					continue;
+
+				buffer.append(format + start, i - start);
+				switch (spec)
+				{
+				case '%':
+					buffer.push_back('%');
+					break;
+				case 's':
+					duk_dup(ctx, arg);
+					append_value(ctx, -1, buffer);
+					break;
+				case 'd':
+				case 'f':
+					append_number(ctx, arg, false, buffer);
+					break;
+				case 'i':
+					append_number(ctx, arg, true, buffer);
+					break;
+				case 'o':
+				case 'O':
+					append_json(ctx, arg, true, buffer);
+					break;
+				case 'j':
+					append_json(ctx, arg, false, buffer);
+					break;
+				case 'c':
+					// CSS, ignored
+					break;
+				}
+				if (spec != '%')
+					arg++;
+				i++;
+				start = i + 1;
+			}
+			buffer.append(format + start, size - start);
+		}
+
+		for (; arg < top; arg++)
+		{
+			if (arg > first)
+				buffer.push_back(' ');
+			duk_dup(ctx, arg);
+			append_value(ctx, -1, buffer);
+		}
+	}
+
+	inline duk_ret_t r_console_Clear(duk_context *ctx)
 	{
-		ConsoleHandlerStorage *storage = consolehandler_from_this(ctx);
+		ConsoleHandlerStorage *storage = consolehandler_from_ctx(ctx);
 		if (storage->handler->worker()) {
 			storage->handler->worker()->clear();
 		}
 		return 0;
 	}
 
-	duk_ret_t r_console_Output(duk_context *ctx)
+	// console.log / debug / info / warn / error, the magic is the output type
+	inline duk_ret_t r_console_Output(duk_context *ctx)
 	{
-		ConsoleHandlerStorage *storage = consolehandler_from_this(ctx);
-		if (storage->handler->worker()) {
-			// 0: outputtype
-			// 1: message (array)
-			std::string outputype(duk_require_string(ctx, 0));
-			duk_require_object_coercible(ctx, 1);
-
-			// build message
-			std::stringstream ss;
-			duk_enum(ctx, 1, DUK_ENUM_ARRAY_INDICES_ONLY | DUK_ENUM_SORT_ARRAY_INDICES);
-			while (duk_next(ctx, -1, 1)) {
-				if (!ss.str().empty())
-					ss << " ";
-				ss << duk_to_string(ctx, -1);
-				duk_pop_2(ctx); // pop key and value
+		ConsoleHandlerStorage *storage = consolehandler_from_function(ctx);
+		duk_int_t type = duk_get_current_magic(ctx);
+		// disabled levels return before touching the arguments
+		if (OUTPUT_LEVELS[type] < storage->handler->minimumLevel())
+			return 0;
+
+		ConsoleWorker::Ptr worker(storage->handler->worker());
+		if (worker) {
+			if (storage->formatting)
+			{
+				std::string buffer;
+				format_arguments(ctx, 0, buffer);
+				worker->output(OUTPUT_TYPES[type], buffer);
+				return 0;
 			}
 
-			storage->handler->worker()->output(outputype, ss.str());
+			// the conversions that can throw run in safe calls, formatting is always reset
+			storage->formatting = true;
+			storage->buffer.clear();
+			format_arguments(ctx, 0, storage->buffer);
+			storage->formatting = false;
+			worker->output(OUTPUT_TYPES[type], storage->buffer);
 		}
 		return 0;
 	}
 
-	duk_ret_t r_console_Finalize(duk_context *ctx)
+	inline duk_ret_t r_console_Finalize(duk_context *ctx)
 	{
-		// 0 = console object
+		// 0 = object to finalize
 		duk_get_prop_string(ctx, 0, PROP_ELHANDLER);
 		if (duk_is_pointer(ctx, -1))
 		{
-			ConsoleHandlerStorage *storage = static_cast<ConsoleHandlerStorage*>(duk_get_pointer(ctx, -2));
+			ConsoleHandlerStorage *storage = static_cast<ConsoleHandlerStorage*>(duk_get_pointer(ctx, -1));
 			delete storage;
 			duk_del_prop_string(ctx, 0, PROP_ELHANDLER);
 		}
@@ -79,31 +263,45 @@ namespace detail {
 		return 0;
 	}
 
-	void r_console_Setup(ConsoleHandler::Ptr handler)
+	inline void r_console_Setup(ConsoleHandler::Ptr handler)
 	{
 		duk_context *ctx = handler->eventLoop()->ctx();
 
-		duk_push_global_object(ctx);
-		duk_get_prop_string(ctx, -1, "console");
-
-		// register the handler inside the console object
-		ConsoleHandlerStorage *storage = new ConsoleHandlerStorage{ handler };
+		// register the handler to the stash
+		ConsoleHandlerStorage *storage = new ConsoleHandlerStorage{ handler, std::string(), false };
+		duk_push_heap_stash(ctx);
+		// object container to allow finalizer
+		duk_push_object(ctx);
+		// pointer into object
 		duk_push_pointer(ctx, storage);
 		duk_put_prop_string(ctx, -2, PROP_ELHANDLER);
-
 		// finalizer for the storage
 		duk_push_c_function(ctx, &r_console_Finalize, 1);
 		duk_set_finalizer(ctx, -2);
+		// put object into stash using the same property name
+		duk_put_prop_string(ctx, -2, PROP_ELHANDLER);
+		duk_pop(ctx);
+
+		duk_push_global_object(ctx);
+		duk_push_object(ctx);
 
-		// register __clear
+		// console.clear
 		duk_push_c_function(ctx, &r_console_Clear, 0);
-		duk_put_prop_string(ctx, -2, "__clear");
+		duk_put_prop_string(ctx, -2, "clear");
 
-		// register __output
-		duk_push_c_function(ctx, &r_console_Output, 2);
-		duk_put_prop_string(ctx, -2, "__output");
+		// console.log, debug, info, warn, error
+		for (int type = OUTPUT_LOG; type <= OUTPUT_ERROR; type++)
+		{
+			duk_push_c_function(ctx, &r_console_Output, DUK_VARARGS);
+			duk_set_magic(ctx, -1, type);
+			// the stash object owns it
+			duk_push_pointer(ctx, storage);
+			duk_put_prop_string(ctx, -2, PROP_ELHANDLER);
+			duk_put_prop_string(ctx, -2, OUTPUT_TYPES[type]);
+		}
 
-		duk_pop_2(ctx);
+		duk_put_prop_string(ctx, -2, "console");
+		duk_pop(ctx);
 	}
 
 } } }
@@ -3,9 +3,71 @@
 #include <dtel.h>
 #include <dtel/detail/any.hpp>
 
+#include "detail/functions.h"
+
+#include <functional>
+#include <vector>
+
 namespace dtel {
 namespace eventtarget {
 
+namespace detail {
+
+	static const char* PROP_EVENTPROTOTYPES = "\xFF" "DTEL_EVENTTARGET_EVENTPROTOTYPES";
+
+	/**
+	 * Push the prototype of an event class.
+	 * The prototype is looked up on the global object only once per heap, and cached on the heap stash.
+	 */
+	inline void push_event_prototype(duk_context *ctx, const std::string &eventClass)
+	{
+		duk_push_heap_stash(ctx);
+		// prototype cache on stash
+		if (duk_get_prop_string(ctx, -1, PROP_EVENTPROTOTYPES) == 0)
+		{
+			duk_pop(ctx);
+			duk_push_bare_object(ctx);
+			duk_dup_top(ctx);
+			duk_put_prop_string(ctx, -3, PROP_EVENTPROTOTYPES);
+		}
+		// remove stash
+		duk_remove(ctx, -2);
+
+		if (duk_get_prop_lstring(ctx, -1, eventClass.c_str(), eventClass.length()) == 0)
+		{
+			duk_pop(ctx);
+
+			// not cached yet, get the prototype from the constructor on the global object
+			duk_push_global_object(ctx);
+			duk_get_prop_lstring(ctx, -1, eventClass.c_str(), eventClass.length());
+			if (!duk_is_object(ctx, -1))
+			{
+				duk_pop_3(ctx);
+				throw Exception("Event class '" + eventClass + "' is not registered");
+			}
+			duk_get_prop_string(ctx, -1, "prototype");
+			duk_remove(ctx, -2); // constructor
+			duk_remove(ctx, -2); // global
+
+			duk_dup_top(ctx);
+			duk_put_prop_lstring(ctx, -3, eventClass.c_str(), eventClass.length());
+		}
+		// remove prototype cache
+		duk_remove(ctx, -2);
+	}
+
+	/**
+	 * Clears the event prototype cache, must be called when the event classes are redefined
+	 */
+	inline void clear_event_prototypes(duk_context *ctx)
+	{
+		duk_push_heap_stash(ctx);
+		duk_del_prop_string(ctx, -1, PROP_EVENTPROTOTYPES);
+		duk_pop(ctx);
+	}
+
+}
+
 /**
  * Value helper for an Event JS object
  */
@@ -25,20 +87,23 @@ public:
 
 	}
 
+	/**
+	 * Builds the event object natively, without calling the JS constructor
+	 */
 	int push(duk_context *ctx) override
 	{
-		duk_push_global_object(ctx);
-		// get constructor
-		duk_get_prop_string(ctx, -1, eventClass.c_str());
-		// remmove global object
-		duk_remove(ctx, -2);
-		// arg0: event type
-		duk_push_string(ctx, eventType.c_str());
-		// arg1: eventInit object
-		int oc = eventInit.push(ctx);
-		// creates the object with 'new'
-		if (duk_pnew(ctx, 1 + oc) != 0) {
-			ThrowError(ctx, -1);
+		duk_push_bare_object(ctx);
+		// set the cached prototype of the event class
+		detail::push_event_prototype(ctx, eventClass);
+		duk_set_prototype(ctx, -2);
+		// "type"
+		duk_push_lstring(ctx, eventType.c_str(), eventType.length());
+		duk_put_prop_string(ctx, -2, "type");
+		// eventInit properties are set directly on the event
+		for (auto &kv : eventInit.properties)
+		{
+			PushAnyValue(ctx, kv.second);
+			duk_put_prop_lstring(ctx, -2, kv.first.c_str(), kv.first.length());
 		}
 		// set "target"
 		if (target) {
@@ -57,23 +122,122 @@ inline bool IsEventTarget(duk_context *ctx)
 	return isEventTarget;
 }
 
+/**
+ * Returns whether the target has any listener for the event type.
+ * Event producers should check this before building the event and its payload.
+ */
+inline bool EventTarget_hasEventListener(duk_context *ctx, Value::Ptr target, const std::string &eventType)
+{
+	target->push(ctx);
+	bool ret = detail::listener_count(ctx, -1, eventType) > 0;
+	duk_pop(ctx);
+	return ret;
+}
+
+/**
+ * Defines "on<eventType>" handler accessors on the prototype at index "prototype".
+ * Handlers are stored on a hidden property of the instance, and registered as listeners of the event type.
+ */
+inline void DefineEventHandlers(duk_context *ctx, duk_idx_t prototype, std::initializer_list<std::string> eventTypes)
+{
+	for (auto &eventType : eventTypes)
+		detail::define_eventhandler(ctx, prototype, eventType);
+}
+
 inline void EventTarget_dispatchEvent(duk_context *ctx, Value::Ptr target, Event::Ptr event)
 {
 	target->push(ctx);
 
-	// call 'dispatchEvent' on the event
-	duk_push_string(ctx, "dispatchEvent");
+	// nobody is listening
+	if (detail::listener_count(ctx, -1, event->eventType) == 0) {
+		duk_pop(ctx);
+		return;
+	}
+
+	// call the listeners directly, without going through 'dispatchEvent'
 	if (!event->target)
 		event->target = target;
 	event->push(ctx);
-	duk_int_t status = duk_pcall_prop(ctx, -3, 1);
-	if (status != 0) {
+	if (!detail::dispatch_listeners(ctx, -2, -1)) {
 		ThrowError(ctx, -1);
 	}
-	// pop call result, ref
+	// pop event, ref
 	duk_pop_2(ctx); 
 }
 
+/**
+ * Dispatches a batch of events of the same type to the target in a single native call.
+ * Each event is isolated: a failing listener is reported to "error" and the next events are still delivered.
+ * Listeners registered with the "array" option receive all the events of the batch in a single call.
+ * If "cancelled" returns true before an event, it and the next ones are not delivered.
+ */
+inline void EventTarget_dispatchEvents(duk_context *ctx, Value::Ptr target, const std::vector<Event::Ptr> &events,
+	const dtel::Event::error_func_t &error, const std::function<bool()> &cancelled = std::function<bool()>())
+{
+	if (events.empty())
+		return;
+
+	ResetStackOnScopeExit r(ctx);
+
+	target->push(ctx);
+	duk_idx_t tidx = duk_get_top_index(ctx);
+
+	const std::string &eventType(events.front()->eventType);
+
+	// nobody is listening
+	if (detail::listener_count(ctx, tidx, eventType) == 0)
+		return;
+
+	// events delivered to the array listeners
+	duk_idx_t eventarray = DUK_INVALID_INDEX;
+	duk_uarridx_t eventcount = 0;
+	if (detail::has_array_listeners(ctx, tidx, eventType))
+		eventarray = duk_push_array(ctx);
+
+	for (auto &event : events)
+	{
+		if (cancelled && cancelled())
+			break;
+
+		try
+		{
+			ResetStackOnScopeExit re(ctx);
+
+			if (!event->target)
+				event->target = target;
+			event->push(ctx);
+			if (eventarray != DUK_INVALID_INDEX)
+			{
+				duk_dup_top(ctx);
+				duk_put_prop_index(ctx, eventarray, eventcount++);
+			}
+			if (!detail::dispatch_listeners(ctx, tidx, -1, detail::DISPATCH_EVENT)) {
+				ThrowError(ctx, -1);
+			}
+		}
+		catch (std::exception &e)
+		{
+			if (!error(e))
+				throw;
+		}
+	}
+
+	if (eventcount > 0)
+	{
+		try
+		{
+			if (!detail::dispatch_listeners(ctx, tidx, eventarray, detail::DISPATCH_ARRAY)) {
+				ThrowError(ctx, -1);
+			}
+		}
+		catch (std::exception &e)
+		{
+			if (!error(e))
+				throw;
+		}
+	}
+}
+
 inline void RegisterEventTarget(EventLoop *eventloop)
 {
 	duk_context *ctx = eventloop->ctx();
@@ -152,50 +316,10 @@ ErrorEvent.prototype.constructor = ErrorEvent;
 	//
 	// EventTarget
 	//
+	detail::r_EventTarget_Setup(ctx);
 
-	if (duk_peval_string(eventloop->ctx(), R"(
-
-var EventTarget = function() {
-  this.listeners = {};
-};
-
-EventTarget.prototype.listeners = null;
-EventTarget.prototype.addEventListener = function(type, callback) {
-  if(!(type in this.listeners)) {
-    this.listeners[type] = [];
-  }
-  this.listeners[type].push(callback);
-};
-
-EventTarget.prototype.removeEventListener = function(type, callback) {
-  if(!(type in this.listeners)) {
-    return;
-  }
-  var stack = this.listeners[type];
-  for(var i = 0, l = stack.length; i < l; i++) {
-    if(stack[i] === callback){
-      stack.splice(i, 1);
-      return this.removeEventListener(type, callback);
-    }
-  }
-};
-
-EventTarget.prototype.dispatchEvent = function(event) {
-  if(!(event.type in this.listeners)) {
-    return;
-  }
-  var stack = this.listeners[event.type];
-  event.target = this;
-  for(var i = 0, l = stack.length; i < l; i++) {
-      stack[i].call(this, event);
-  }
-};
-
-	)") != 0)
-	{
-		ThrowError(ctx, -1);
-	};
-	duk_pop(ctx);
+	// event classes were (re)defined
+	detail::clear_event_prototypes(ctx);
 }
 
 } }
\ No newline at end of file
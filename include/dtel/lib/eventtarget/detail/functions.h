@@ -0,0 +1,636 @@
+#pragma once
+
+#include <duktape.h>
+
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace dtel {
+namespace eventtarget {
+namespace detail {
+
+	static const char* PROP_STORAGE = "\xFF" "DTEL_EVENTTARGET_STORAGE";
+	static const char* PROP_STORAGEPTR = "\xFF" "DTEL_EVENTTARGET_STORAGEPTR";
+	static const char* PROP_EVENT_PASSIVE = "\xFF" "DTEL_EVENT_PASSIVE";
+	static const char* PROP_EVENT_STOPIMMEDIATE = "\xFF" "DTEL_EVENT_STOPIMMEDIATE";
+	static const char* PROP_HANDLER_TYPE = "\xFF" "DTEL_EVENTTARGET_HANDLER_TYPE";
+	static const char* PROP_HANDLER_PREFIX = "\xFF" "DTEL_EVENTTARGET_ON_";
+
+	/**
+	 * Options of addEventListener
+	 */
+	struct ListenerOptions
+	{
+		bool capture;
+		bool once;
+		bool passive;
+		// receive arrays of events instead of single events
+		bool array;
+	};
+
+	/**
+	 * A registered event listener.
+	 * The callback is kept reachable by the slot on the storage holder object while the listener is registered.
+	 */
+	struct Listener
+	{
+		void *callback;
+		duk_uarridx_t slot;
+		bool capture;
+		bool once;
+		bool passive;
+		bool array;
+		bool removed;
+	};
+
+	typedef std::vector<std::shared_ptr<Listener>> listeners_t;
+
+	/**
+	 * Listener storage of an EventTarget.
+	 * The listener lists are copy-on-write, a dispatch keeps a reference to the list it started with,
+	 * so listeners can be added and removed while dispatching.
+	 */
+	struct EventTargetStorage
+	{
+		typedef std::map<std::string, std::shared_ptr<const listeners_t>> typelisteners_t;
+
+		typelisteners_t listeners;
+		std::vector<duk_uarridx_t> freeslots;
+		duk_uarridx_t nextslot = 0;
+	};
+
+	inline duk_ret_t r_eventtarget_storage_finalizer(duk_context *ctx)
+	{
+		// 0 = storage holder object
+		duk_get_prop_string(ctx, 0, PROP_STORAGEPTR);
+		if (duk_is_pointer(ctx, -1) != 0)
+		{
+			EventTargetStorage *storage = static_cast<EventTargetStorage*>(duk_get_pointer(ctx, -1));
+			delete storage;
+			duk_del_prop_string(ctx, 0, PROP_STORAGEPTR);
+		}
+		duk_pop(ctx);
+		return 0;
+	}
+
+	/**
+	 * Gets the listener storage of the target, optionally creating it.
+	 * The storage is kept on a hidden holder object, which also keeps the callbacks reachable.
+	 */
+	inline EventTargetStorage *storage_from_target(duk_context *ctx, duk_idx_t target, bool create)
+	{
+		target = duk_normalize_index(ctx, target);
+
+		if (duk_get_prop_string(ctx, target, PROP_STORAGE) != 0)
+		{
+			duk_get_prop_string(ctx, -1, PROP_STORAGEPTR);
+			EventTargetStorage *ret = static_cast<EventTargetStorage*>(duk_get_pointer(ctx, -1));
+			duk_pop_2(ctx); // holder, pointer
+			return ret;
+		}
+		duk_pop(ctx);
+
+		if (!create)
+			return NULL;
+
+		EventTargetStorage *storage = new EventTargetStorage;
+		duk_push_bare_object(ctx);
+		duk_push_pointer(ctx, storage);
+		duk_put_prop_string(ctx, -2, PROP_STORAGEPTR);
+		// finalizer for the storage
+		duk_push_c_function(ctx, &r_eventtarget_storage_finalizer, 1);
+		duk_set_finalizer(ctx, -2);
+		duk_put_prop_string(ctx, target, PROP_STORAGE);
+		return storage;
+	}
+
+	/**
+	 * Adds the callback at index "callback" as a listener of the target
+	 */
+	inline void add_listener(duk_context *ctx, duk_idx_t target, const std::string &type, duk_idx_t callback,
+		const ListenerOptions &options)
+	{
+		target = duk_normalize_index(ctx, target);
+		callback = duk_normalize_index(ctx, callback);
+		void *cb = duk_get_heapptr(ctx, callback);
+		if (!cb)
+			return;
+
+		EventTargetStorage *storage = storage_from_target(ctx, target, true);
+
+		std::shared_ptr<const listeners_t> current;
+		auto i = storage->listeners.find(type);
+		if (i != storage->listeners.end())
+		{
+			current = i->second;
+			// the same callback is only registered once
+			for (auto &l : *current)
+				if (l->callback == cb && l->capture == options.capture)
+					return;
+		}
+
+		std::shared_ptr<Listener> listener(new Listener{ cb, 0, options.capture, options.once, options.passive, options.array, false });
+		if (!storage->freeslots.empty())
+		{
+			listener->slot = storage->freeslots.back();
+			storage->freeslots.pop_back();
+		}
+		else
+			listener->slot = storage->nextslot++;
+
+		// keep the callback reachable
+		duk_get_prop_string(ctx, target, PROP_STORAGE);
+		duk_dup(ctx, callback);
+		duk_put_prop_index(ctx, -2, listener->slot);
+		duk_pop(ctx);
+
+		// copy on write
+		std::shared_ptr<listeners_t> newlisteners(current ? new listeners_t(*current) : new listeners_t);
+		newlisteners->push_back(listener);
+		storage->listeners[type] = newlisteners;
+	}
+
+	/**
+	 * Removes a listener from the target
+	 */
+	inline void remove_listener(duk_context *ctx, duk_idx_t target, EventTargetStorage *storage, const std::string &type,
+		const std::shared_ptr<Listener> &listener)
+	{
+		if (listener->removed)
+			return;
+
+		auto i = storage->listeners.find(type);
+		if (i == storage->listeners.end())
+			return;
+
+		// copy on write
+		std::shared_ptr<listeners_t> newlisteners(new listeners_t);
+		newlisteners->reserve(i->second->size());
+		for (auto &l : *i->second)
+			if (l != listener)
+				newlisteners->push_back(l);
+		if (newlisteners->empty())
+			storage->listeners.erase(i);
+		else
+			i->second = newlisteners;
+
+		// running dispatches must skip the listener, as the callback may not be reachable anymore
+		listener->removed = true;
+
+		duk_get_prop_string(ctx, target, PROP_STORAGE);
+		duk_del_prop_index(ctx, -1, listener->slot);
+		duk_pop(ctx);
+		storage->freeslots.push_back(listener->slot);
+	}
+
+	/**
+	 * Removes the callback at index "callback" from the listeners of the target
+	 */
+	inline void remove_listener(duk_context *ctx, duk_idx_t target, const std::string &type, duk_idx_t callback, bool capture)
+	{
+		target = duk_normalize_index(ctx, target);
+		void *cb = duk_get_heapptr(ctx, callback);
+		if (!cb)
+			return;
+
+		EventTargetStorage *storage = storage_from_target(ctx, target, false);
+		if (!storage)
+			return;
+
+		auto i = storage->listeners.find(type);
+		if (i == storage->listeners.end())
+			return;
+
+		std::shared_ptr<const listeners_t> current(i->second);
+		for (auto &l : *current)
+		{
+			if (l->callback == cb && l->capture == capture)
+			{
+				remove_listener(ctx, target, storage, type, l);
+				return;
+			}
+		}
+	}
+
+	/**
+	 * Returns the number of listeners registered on the target for the event type
+	 */
+	inline size_t listener_count(duk_context *ctx, duk_idx_t target, const std::string &type)
+	{
+		EventTargetStorage *storage = storage_from_target(ctx, target, false);
+		if (!storage)
+			return 0;
+		auto i = storage->listeners.find(type);
+		if (i == storage->listeners.end())
+			return 0;
+		return i->second->size();
+	}
+
+	enum dispatch_mode_t
+	{
+		// all listeners, array listeners receive an array with the event
+		DISPATCH_ALL,
+		// only the listeners which receive single events
+		DISPATCH_EVENT,
+		// only array listeners, the event is an array of events of the same type
+		DISPATCH_ARRAY
+	};
+
+	/**
+	 * Calls the listeners of the target for the event.
+	 * All listeners are called even if one fails. If any failed, returns false and leaves the first
+	 * error on the stack top.
+	 */
+	inline bool dispatch_listeners(duk_context *ctx, duk_idx_t target, duk_idx_t event, dispatch_mode_t mode = DISPATCH_ALL)
+	{
+		target = duk_normalize_index(ctx, target);
+		event = duk_normalize_index(ctx, event);
+		bool isarray = mode == DISPATCH_ARRAY;
+
+		if (!isarray)
+		{
+			duk_dup(ctx, target);
+			duk_put_prop_string(ctx, event, "target");
+		}
+
+		EventTargetStorage *storage = storage_from_target(ctx, target, false);
+		if (!storage)
+			return true;
+
+		if (isarray)
+		{
+			duk_get_prop_index(ctx, event, 0);
+			duk_get_prop_string(ctx, -1, "type");
+			duk_remove(ctx, -2);
+		}
+		else
+			duk_get_prop_string(ctx, event, "type");
+		duk_size_t typelen;
+		const char *typestr = duk_safe_to_lstring(ctx, -1, &typelen);
+		std::string type(typestr, typelen);
+		duk_pop(ctx);
+
+		auto i = storage->listeners.find(type);
+		if (i == storage->listeners.end())
+			return true;
+
+		// the list in use when the dispatch started
+		std::shared_ptr<const listeners_t> listeners(i->second);
+
+		if (!isarray)
+		{
+			duk_dup(ctx, target);
+			duk_put_prop_string(ctx, event, "currentTarget");
+		}
+
+		// first error
+		duk_push_undefined(ctx);
+		duk_idx_t error = duk_get_top_index(ctx);
+		bool ok = true;
+
+		// array with the single event, created on demand for array listeners
+		duk_idx_t eventarray = DUK_INVALID_INDEX;
+
+		for (auto &l : *listeners)
+		{
+			if (l->removed)
+				continue;
+			if ((mode == DISPATCH_EVENT && l->array) || (isarray && !l->array))
+				continue;
+
+			duk_idx_t arg = event;
+			if (mode == DISPATCH_ALL && l->array)
+			{
+				if (eventarray == DUK_INVALID_INDEX)
+				{
+					eventarray = duk_push_array(ctx);
+					duk_dup(ctx, event);
+					duk_put_prop_index(ctx, -2, 0);
+				}
+				arg = eventarray;
+			}
+
+			duk_push_heapptr(ctx, l->callback);
+			if (l->once)
+				remove_listener(ctx, target, storage, type, l);
+
+			bool passive = l->passive && !isarray;
+			if (passive)
+			{
+				duk_push_true(ctx);
+				duk_put_prop_string(ctx, event, PROP_EVENT_PASSIVE);
+			}
+
+			duk_int_t status;
+			if (duk_is_callable(ctx, -1))
+			{
+				duk_dup(ctx, target);
+				duk_dup(ctx, arg);
+				status = duk_pcall_method(ctx, 1);
+			}
+			else
+			{
+				// object implementing the EventListener interface
+				duk_push_string(ctx, "handleEvent");
+				duk_dup(ctx, arg);
+				status = duk_pcall_prop(ctx, -3, 1);
+				duk_remove(ctx, -2); // callback object
+			}
+
+			if (status != DUK_EXEC_SUCCESS && ok)
+			{
+				ok = false;
+				duk_replace(ctx, error);
+			}
+			else
+				duk_pop(ctx);
+
+			if (passive)
+				duk_del_prop_string(ctx, event, PROP_EVENT_PASSIVE);
+
+			if (!isarray)
+			{
+				if (duk_get_prop_string(ctx, event, PROP_EVENT_STOPIMMEDIATE) != 0 && duk_to_boolean(ctx, -1))
+				{
+					duk_pop(ctx);
+					break;
+				}
+				duk_pop(ctx);
+			}
+		}
+
+		if (eventarray != DUK_INVALID_INDEX)
+			duk_remove(ctx, eventarray);
+
+		if (!isarray)
+		{
+			duk_push_null(ctx);
+			duk_put_prop_string(ctx, event, "currentTarget");
+		}
+
+		if (ok)
+			duk_pop(ctx); // error
+		return ok;
+	}
+
+	/**
+	 * Returns whether the target has array listeners for the event type
+	 */
+	inline bool has_array_listeners(duk_context *ctx, duk_idx_t target, const std::string &type)
+	{
+		EventTargetStorage *storage = storage_from_target(ctx, target, false);
+		if (!storage)
+			return false;
+		auto i = storage->listeners.find(type);
+		if (i == storage->listeners.end())
+			return false;
+		for (auto &l : *i->second)
+			if (l->array)
+				return true;
+		return false;
+	}
+
+	/**
+	 * Pushes "this" of EventTarget functions.
+	 * Functions called without "this" (like "addEventListener" on a worker global scope) use the global object.
+	 */
+	inline void push_target_this(duk_context *ctx)
+	{
+		duk_push_this(ctx);
+		if (duk_is_undefined(ctx, -1))
+		{
+			duk_pop(ctx);
+			duk_push_global_object(ctx);
+		}
+		duk_require_object_coercible(ctx, -1);
+	}
+
+	//
+	// Event functions
+	//
+
+	inline duk_ret_t r_Event_preventDefault(duk_context *ctx)
+	{
+		duk_push_this(ctx);
+		duk_require_object_coercible(ctx, -1);
+		// preventDefault is ignored inside passive listeners
+		duk_get_prop_string(ctx, -1, PROP_EVENT_PASSIVE);
+		if (!duk_to_boolean(ctx, -1))
+		{
+			duk_push_true(ctx);
+			duk_put_prop_string(ctx, -3, "defaultPrevented");
+		}
+		return 0;
+	}
+
+	inline duk_ret_t r_Event_stopImmediatePropagation(duk_context *ctx)
+	{
+		duk_push_this(ctx);
+		duk_require_object_coercible(ctx, -1);
+		duk_push_true(ctx);
+		duk_put_prop_string(ctx, -2, PROP_EVENT_STOPIMMEDIATE);
+		return 0;
+	}
+
+	//
+	// EventTarget functions
+	//
+
+	inline duk_ret_t r_EventTarget_construct(duk_context *ctx)
+	{
+		// the listener storage is created on the first addEventListener
+		return 0;
+	}
+
+	/**
+	 * Parses the options argument of add/removeEventListener, which can be a boolean (capture) or an object
+	 */
+	inline ListenerOptions eventlistener_options(duk_context *ctx, duk_idx_t index)
+	{
+		ListenerOptions ret{ false, false, false, false };
+		if (duk_is_object(ctx, index))
+		{
+			duk_get_prop_string(ctx, index, "capture");
+			ret.capture = duk_to_boolean(ctx, -1) != 0;
+			duk_get_prop_string(ctx, index, "once");
+			ret.once = duk_to_boolean(ctx, -1) != 0;
+			duk_get_prop_string(ctx, index, "passive");
+			ret.passive = duk_to_boolean(ctx, -1) != 0;
+			// non-standard: receive batched events as an array
+			duk_get_prop_string(ctx, index, "array");
+			ret.array = duk_to_boolean(ctx, -1) != 0;
+			duk_pop_n(ctx, 4);
+		}
+		else
+			ret.capture = duk_to_boolean(ctx, index) != 0;
+		return ret;
+	}
+
+	inline duk_ret_t r_EventTarget_addEventListener(duk_context *ctx)
+	{
+		// 0: type
+		// 1: callback
+		// 2: options
+		push_target_this(ctx);
+		duk_to_string(ctx, 0);
+		if (!duk_is_object(ctx, 1))
+			return 0;
+
+		ListenerOptions options(eventlistener_options(ctx, 2));
+
+		duk_size_t typelen;
+		const char *type = duk_get_lstring(ctx, 0, &typelen);
+		add_listener(ctx, -1, std::string(type, typelen), 1, options);
+		return 0;
+	}
+
+	inline duk_ret_t r_EventTarget_removeEventListener(duk_context *ctx)
+	{
+		// 0: type
+		// 1: callback
+		// 2: options
+		push_target_this(ctx);
+		duk_to_string(ctx, 0);
+		if (!duk_is_object(ctx, 1))
+			return 0;
+
+		ListenerOptions options(eventlistener_options(ctx, 2));
+
+		duk_size_t typelen;
+		const char *type = duk_get_lstring(ctx, 0, &typelen);
+		remove_listener(ctx, -1, std::string(type, typelen), 1, options.capture);
+		return 0;
+	}
+
+	inline duk_ret_t r_EventTarget_dispatchEvent(duk_context *ctx)
+	{
+		// 0: event
+		duk_require_object(ctx, 0);
+		push_target_this(ctx);
+
+		if (!dispatch_listeners(ctx, -1, 0))
+			return duk_throw(ctx);
+
+		duk_get_prop_string(ctx, 0, "defaultPrevented");
+		duk_push_boolean(ctx, !duk_to_boolean(ctx, -1));
+		return 1;
+	}
+
+	//
+	// on<event> handler accessors
+	//
+
+	/**
+	 * Gets the event type of the accessor being called, and the name of the hidden handler property
+	 */
+	inline void eventhandler_type(duk_context *ctx, std::string &type, std::string &prop)
+	{
+		duk_push_current_function(ctx);
+		duk_get_prop_string(ctx, -1, PROP_HANDLER_TYPE);
+		duk_size_t typelen;
+		const char *typestr = duk_get_lstring(ctx, -1, &typelen);
+		type.assign(typestr, typelen);
+		duk_pop_2(ctx);
+		prop = std::string(PROP_HANDLER_PREFIX) + type;
+	}
+
+	inline duk_ret_t r_EventTarget_handlerGet(duk_context *ctx)
+	{
+		push_target_this(ctx);
+
+		std::string type, prop;
+		eventhandler_type(ctx, type, prop);
+
+		if (duk_get_prop_string(ctx, -1, prop.c_str()) == 0)
+		{
+			duk_pop(ctx);
+			duk_push_null(ctx);
+		}
+		return 1;
+	}
+
+	inline duk_ret_t r_EventTarget_handlerSet(duk_context *ctx)
+	{
+		// 0: handler
+		push_target_this(ctx);
+		duk_idx_t target = duk_get_top_index(ctx);
+
+		std::string type, prop;
+		eventhandler_type(ctx, type, prop);
+
+		// remove the current handler
+		if (duk_get_prop_string(ctx, target, prop.c_str()) != 0 && duk_is_object(ctx, -1))
+			remove_listener(ctx, target, type, -1, false);
+		duk_pop(ctx);
+
+		if (duk_is_object(ctx, 0))
+		{
+			duk_dup(ctx, 0);
+			duk_put_prop_string(ctx, target, prop.c_str());
+			add_listener(ctx, target, type, 0, ListenerOptions{ false, false, false, false });
+		}
+		else
+			duk_del_prop_string(ctx, target, prop.c_str());
+		return 0;
+	}
+
+	/**
+	 * Defines the "on<type>" handler accessor on the object at index "obj".
+	 * A custom setter must call r_EventTarget_handlerSet.
+	 */
+	inline void define_eventhandler(duk_context *ctx, duk_idx_t obj, const std::string &type,
+		duk_c_function setter = &r_EventTarget_handlerSet)
+	{
+		obj = duk_normalize_index(ctx, obj);
+
+		std::string name("on" + type);
+		duk_push_lstring(ctx, name.c_str(), name.length());
+
+		duk_push_c_function(ctx, &r_EventTarget_handlerGet, 0);
+		duk_push_lstring(ctx, type.c_str(), type.length());
+		duk_put_prop_string(ctx, -2, PROP_HANDLER_TYPE);
+
+		duk_push_c_function(ctx, setter, 1);
+		duk_push_lstring(ctx, type.c_str(), type.length());
+		duk_put_prop_string(ctx, -2, PROP_HANDLER_TYPE);
+
+		duk_def_prop(ctx, obj, DUK_DEFPROP_HAVE_GETTER | DUK_DEFPROP_HAVE_SETTER |
+			DUK_DEFPROP_SET_CONFIGURABLE | DUK_DEFPROP_SET_ENUMERABLE);
+	}
+
+	inline void r_EventTarget_Setup(duk_context *ctx)
+	{
+		duk_push_global_object(ctx);
+
+		// Event prototype native methods
+		duk_get_prop_string(ctx, -1, "Event");
+		duk_get_prop_string(ctx, -1, "prototype");
+		duk_push_c_function(ctx, &r_Event_preventDefault, 0);
+		duk_put_prop_string(ctx, -2, "preventDefault");
+		duk_push_c_function(ctx, &r_Event_stopImmediatePropagation, 0);
+		duk_put_prop_string(ctx, -2, "stopImmediatePropagation");
+		duk_pop_2(ctx); // Event, prototype
+
+		// EventTarget
+		duk_push_c_function(ctx, &r_EventTarget_construct, 0);
+
+		duk_push_object(ctx);
+		duk_push_c_function(ctx, &r_EventTarget_addEventListener, 3);
+		duk_put_prop_string(ctx, -2, "addEventListener");
+		duk_push_c_function(ctx, &r_EventTarget_removeEventListener, 3);
+		duk_put_prop_string(ctx, -2, "removeEventListener");
+		duk_push_c_function(ctx, &r_EventTarget_dispatchEvent, 1);
+		duk_put_prop_string(ctx, -2, "dispatchEvent");
+		duk_dup(ctx, -2);
+		duk_put_prop_string(ctx, -2, "constructor");
+		duk_put_prop_string(ctx, -2, "prototype");
+
+		duk_put_prop_string(ctx, -2, "EventTarget");
+
+		duk_pop(ctx); // global
+	}
+
+} } }
@@ -0,0 +1,763 @@
+#pragma once
+
+#include <dtel.h>
+#include <dtel/Async.h>
+#include <dtel/ResetStackOnScopeExit.h>
+#include <dtel/detail/external.h>
+
+#include <duktape.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace dtel {
+namespace fs {
+
+namespace detail {
+	static const char* PROP_FSHANDLER = "\xFF" "DTEL_FS_HANDLER";
+	static const char* PROP_FSSTREAM = "\xFF" "DTEL_FS_STREAM";
+	static const char* PROP_FSSTREAM_PROTO = "\xFF" "DTEL_FS_STREAM_PROTO";
+}
+
+/**
+ * FS handler
+ */
+class FSHandler : public ThreadSafeRefCountedBase<FSHandler>
+{
+public:
+	typedef IntrusiveRefCntPtr<FSHandler> Ptr;
+
+	FSHandler(EventLoop *eventloop) :
+		_eventloop(eventloop), _mmapThreshold(0), _chunkSize(64 * 1024)
+	{
+
+	}
+
+	EventLoop *eventLoop() const
+	{
+		return _eventloop;
+	}
+
+	size_t mmapThreshold() const
+	{
+		return _mmapThreshold;
+	}
+
+	/**
+	 * Files read by readFile with at least this size are mapped instead of read, 0 = never map (the default).
+	 * Only enable it for files no other process truncates: touching a page of the buffer past the new end
+	 * of the file raises SIGBUS and kills the process.
+	 */
+	void setMmapThreshold(size_t size)
+	{
+		_mmapThreshold = size;
+	}
+
+	size_t chunkSize() const
+	{
+		return _chunkSize;
+	}
+
+	/**
+	 * Default size of the chunks of a read stream
+	 */
+	void setChunkSize(size_t size)
+	{
+		_chunkSize = size > 0 ? size : 1;
+	}
+private:
+	EventLoop *_eventloop;
+	std::atomic<size_t> _mmapThreshold;
+	std::atomic<size_t> _chunkSize;
+};
+
+/**
+ * Contents of a file, pushed as an ArrayBuffer over the block, or as a string
+ */
+struct FileContents
+{
+	dtel::detail::ExternalBlock::Ptr block;
+	bool text;
+};
+
+inline void PushAsyncValue(duk_context *ctx, const FileContents &value)
+{
+	if (value.text)
+		duk_push_lstring(ctx, static_cast<const char*>(value.block->data()), value.block->size());
+	else
+		dtel::detail::push_external_arraybuffer(ctx, value.block.get());
+}
+
+/**
+ * Result of stat
+ */
+struct FileStats
+{
+	double size;
+	uint32_t mode;
+	double atimeMs;
+	double mtimeMs;
+	double ctimeMs;
+};
+
+namespace detail {
+
+	enum stats_type_t {
+		STATS_FILE,
+		STATS_DIRECTORY,
+	};
+
+	// stats.isFile() / stats.isDirectory()
+	inline duk_ret_t r_stats_is(duk_context *ctx)
+	{
+		duk_push_this(ctx);
+		duk_get_prop_string(ctx, -1, "mode");
+		mode_t mode = static_cast<mode_t>(duk_to_uint32(ctx, -1));
+		duk_push_boolean(ctx, duk_get_current_magic(ctx) == STATS_FILE ? S_ISREG(mode) : S_ISDIR(mode));
+		return 1;
+	}
+
+}
+
+inline void PushAsyncValue(duk_context *ctx, const FileStats &value)
+{
+	duk_push_object(ctx);
+	duk_push_number(ctx, value.size);
+	duk_put_prop_string(ctx, -2, "size");
+	duk_push_uint(ctx, value.mode);
+	duk_put_prop_string(ctx, -2, "mode");
+	duk_push_number(ctx, value.atimeMs);
+	duk_put_prop_string(ctx, -2, "atimeMs");
+	duk_push_number(ctx, value.mtimeMs);
+	duk_put_prop_string(ctx, -2, "mtimeMs");
+	duk_push_number(ctx, value.ctimeMs);
+	duk_put_prop_string(ctx, -2, "ctimeMs");
+	duk_push_c_function(ctx, &detail::r_stats_is, 0);
+	duk_set_magic(ctx, -1, detail::STATS_FILE);
+	duk_put_prop_string(ctx, -2, "isFile");
+	duk_push_c_function(ctx, &detail::r_stats_is, 0);
+	duk_set_magic(ctx, -1, detail::STATS_DIRECTORY);
+	duk_put_prop_string(ctx, -2, "isDirectory");
+}
+
+namespace detail {
+
+	//
+	// file operations, run on the task threads
+	//
+
+	inline std::runtime_error fs_error(const char *operation, const std::string &path)
+	{
+		int err = errno;
+		return std::runtime_error(std::string(operation) + " '" + path + "': " + std::strerror(err));
+	}
+
+	/**
+	 * Closes the file descriptor on scope exit
+	 */
+	class FileDescriptor
+	{
+	public:
+		explicit FileDescriptor(int fd) : _fd(fd) {}
+
+		~FileDescriptor()
+		{
+			if (_fd >= 0)
+				::close(_fd);
+		}
+
+		int fd() const
+		{
+			return _fd;
+		}
+
+		FileDescriptor(const FileDescriptor &) = delete;
+		FileDescriptor &operator=(const FileDescriptor &) = delete;
+	private:
+		int _fd;
+	};
+
+	inline int open_file(const std::string &path, int flags)
+	{
+		int fd;
+		do
+		{
+			fd = ::open(path.c_str(), flags | O_CLOEXEC, 0666);
+		} while (fd < 0 && errno == EINTR);
+		if (fd < 0)
+			throw fs_error("open", path);
+		return fd;
+	}
+
+	/**
+	 * Reads from the offset (or the current position if negative) into the memory, until it is full
+	 * or the end of the file. Returns the amount read.
+	 */
+	inline size_t read_fd(int fd, const std::string &path, void *data, size_t size, off_t offset)
+	{
+		size_t done = 0;
+		while (done < size)
+		{
+			ssize_t ret = offset >= 0 ?
+				::pread(fd, static_cast<char*>(data) + done, size - done, offset + static_cast<off_t>(done)) :
+				::read(fd, static_cast<char*>(data) + done, size - done);
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				throw fs_error("read", path);
+			}
+			if (ret == 0)
+				break;
+			done += static_cast<size_t>(ret);
+		}
+		return done;
+	}
+
+	/**
+	 * Reads up to size bytes in a block allocated for them. The returned block is null at the end of the file.
+	 */
+	inline dtel::detail::ExternalBlock::Ptr read_block(int fd, const std::string &path, size_t size, off_t offset)
+	{
+		void *data = std::malloc(size > 0 ? size : 1);
+		if (!data)
+			throw std::bad_alloc();
+		size_t count;
+		try
+		{
+			count = read_fd(fd, path, data, size, offset);
+		}
+		catch (...)
+		{
+			std::free(data);
+			throw;
+		}
+		if (count == 0 && size > 0)
+		{
+			std::free(data);
+			return dtel::detail::ExternalBlock::Ptr();
+		}
+		// the file is shorter than expected, give the rest back. On failure the larger block is still valid.
+		if (count < size)
+		{
+			void *shrunk = std::realloc(data, count > 0 ? count : 1);
+			if (shrunk)
+				data = shrunk;
+		}
+		return new dtel::detail::ExternalBlock(data, count, dtel::detail::ExternalBlock::deleter_t());
+	}
+
+	/**
+	 * Reads the whole file into a block. Regular files of at least mmapThreshold bytes (0 = never) are mapped
+	 * copy-on-write: the script can change the buffer, but the changes never reach the file. A mapped file
+	 * truncated by another process raises SIGBUS when a page not yet changed is touched.
+	 */
+	inline dtel::detail::ExternalBlock::Ptr read_file(const std::string &path, size_t mmapThreshold)
+	{
+		FileDescriptor file(open_file(path, O_RDONLY));
+
+		struct stat st;
+		if (::fstat(file.fd(), &st) != 0)
+			throw fs_error("stat", path);
+		if (S_ISDIR(st.st_mode))
+		{
+			errno = EISDIR;
+			throw fs_error("read", path);
+		}
+
+		if (!S_ISREG(st.st_mode) || st.st_size == 0)
+		{
+			// unknown size (some files report 0), read until the end growing the memory
+			size_t capacity = 64 * 1024, count = 0;
+			void *data = std::malloc(capacity);
+			while (data)
+			{
+				try
+				{
+					count += read_fd(file.fd(), path, static_cast<char*>(data) + count, capacity - count, -1);
+				}
+				catch (...)
+				{
+					std::free(data);
+					throw;
+				}
+				if (count < capacity)
+					break;
+				void *grown = std::realloc(data, capacity * 2);
+				if (!grown)
+					std::free(data);
+				data = grown;
+				capacity *= 2;
+			}
+			if (!data)
+				throw std::bad_alloc();
+			void *shrunk = std::realloc(data, count > 0 ? count : 1);
+			if (shrunk)
+				data = shrunk;
+			return new dtel::detail::ExternalBlock(data, count, dtel::detail::ExternalBlock::deleter_t());
+		}
+
+		size_t size = static_cast<size_t>(st.st_size);
+		if (mmapThreshold > 0 && size >= mmapThreshold)
+		{
+#ifdef MAP_POPULATE
+			// the pages are read by this thread, so the loop never waits for the disk on access
+			int flags = MAP_PRIVATE | MAP_POPULATE;
+#else
+			int flags = MAP_PRIVATE;
+#endif
+			// mapped read-only first, populating a writable private mapping would copy every page
+			void *data = ::mmap(NULL, size, PROT_READ, flags, file.fd(), 0);
+			if (data != MAP_FAILED)
+			{
+				if (::mprotect(data, size, PROT_READ | PROT_WRITE) == 0)
+					return new dtel::detail::ExternalBlock(data, size, [](void *data, size_t size) {
+						::munmap(data, size);
+					});
+				::munmap(data, size);
+			}
+			// fall back to reading
+		}
+
+		return read_block(file.fd(), path, size, 0);
+	}
+
+	inline void write_file(const std::string &path, const void *data, size_t size, bool append)
+	{
+		FileDescriptor file(open_file(path, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC)));
+
+		size_t done = 0;
+		while (done < size)
+		{
+			ssize_t ret = ::write(file.fd(), static_cast<const char*>(data) + done, size - done);
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				throw fs_error("write", path);
+			}
+			done += static_cast<size_t>(ret);
+		}
+	}
+
+	inline FileStats stat_file(const std::string &path)
+	{
+		struct stat st;
+		if (::stat(path.c_str(), &st) != 0)
+			throw fs_error("stat", path);
+		return FileStats{
+			static_cast<double>(st.st_size),
+			static_cast<uint32_t>(st.st_mode),
+			static_cast<double>(st.st_atim.tv_sec) * 1000 + st.st_atim.tv_nsec / 1000000,
+			static_cast<double>(st.st_mtim.tv_sec) * 1000 + st.st_mtim.tv_nsec / 1000000,
+			static_cast<double>(st.st_ctim.tv_sec) * 1000 + st.st_ctim.tv_nsec / 1000000,
+		};
+	}
+
+	/**
+	 * State of a read stream. The file is opened by the first read, and closed when the last reference
+	 * is released. Only one read runs at a time.
+	 */
+	class ReadStream : public ThreadSafeRefCountedBase<ReadStream>
+	{
+	public:
+		typedef IntrusiveRefCntPtr<ReadStream> Ptr;
+
+		ReadStream(const std::string &path, off_t start, size_t chunkSize) :
+			_path(path), _fd(-1), _position(start), _chunkSize(chunkSize), _reading(false)
+		{
+
+		}
+
+		~ReadStream()
+		{
+			if (_fd >= 0)
+				::close(_fd);
+		}
+
+		/**
+		 * Reads the next chunk, null at the end of the file. Runs on the task threads.
+		 */
+		dtel::detail::ExternalBlock::Ptr read()
+		{
+			if (_fd < 0)
+				_fd = open_file(_path, O_RDONLY);
+			dtel::detail::ExternalBlock::Ptr block(read_block(_fd, _path, _chunkSize, _position));
+			if (block)
+				_position += static_cast<off_t>(block->size());
+			return block;
+		}
+
+		// only used on the loop thread
+		bool reading() const
+		{
+			return _reading;
+		}
+
+		void setReading(bool value)
+		{
+			_reading = value;
+		}
+	private:
+		std::string _path;
+		int _fd;
+		off_t _position;
+		size_t _chunkSize;
+		bool _reading;
+	};
+
+	/**
+	 * Storage of the handler inside duktape
+	 */
+	struct FSHandlerStorage
+	{
+		FSHandler::Ptr handler;
+	};
+
+	/**
+	 * Storage of a read stream inside its object
+	 */
+	struct ReadStreamStorage
+	{
+		ReadStream::Ptr stream;
+	};
+
+	/**
+	 * Gets the handler from the context
+	 */
+	inline FSHandlerStorage *handler_from_ctx(duk_context *ctx)
+	{
+		duk_push_heap_stash(ctx);
+		// object on stash
+		duk_get_prop_string(ctx, -1, PROP_FSHANDLER);
+		// property on object
+		duk_get_prop_string(ctx, -1, PROP_FSHANDLER);
+		FSHandlerStorage *ret = static_cast<FSHandlerStorage*>(duk_get_pointer(ctx, -1));
+		duk_pop_3(ctx);
+		return ret;
+	}
+
+	/**
+	 * Index of the callback, which must be the last argument
+	 */
+	inline duk_idx_t callback_index(duk_context *ctx, duk_idx_t minArgs)
+	{
+		duk_idx_t top = duk_get_top(ctx);
+		if (top < minArgs + 1 || !duk_is_function(ctx, top - 1))
+		{
+			duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "callback must be a function");
+			duk_throw(ctx);
+		}
+		return top - 1;
+	}
+
+	//
+	// fs function definitions
+	//
+
+	// fs.readFile(path, [encoding | {encoding}], callback)
+	inline duk_ret_t r_fs_readFile(duk_context *ctx)
+	{
+		duk_idx_t callback = callback_index(ctx, 1);
+		std::string path(duk_require_string(ctx, 0));
+
+		bool text = false;
+		if (callback > 1)
+		{
+			if (duk_is_object(ctx, 1))
+				duk_get_prop_string(ctx, 1, "encoding");
+			else
+				duk_dup(ctx, 1);
+			if (!duk_is_null_or_undefined(ctx, -1))
+			{
+				std::string encoding(duk_safe_to_string(ctx, -1));
+				if (encoding != "utf8" && encoding != "utf-8")
+				{
+					duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "unsupported encoding '%s'", encoding.c_str());
+					duk_throw(ctx);
+				}
+				text = true;
+			}
+			duk_pop(ctx);
+		}
+
+		FSHandlerStorage *h = handler_from_ctx(ctx);
+		size_t mmapThreshold = h->handler->mmapThreshold();
+		RunAsyncCallback(h->handler->eventLoop(), callback, [path, text, mmapThreshold] {
+			// text is copied into the heap anyway, mapping doesn't help
+			return FileContents{ read_file(path, text ? 0 : mmapThreshold), text };
+		});
+		return 0;
+	}
+
+	// fs.writeFile(path, data, callback), fs.appendFile(path, data, callback)
+	inline duk_ret_t r_fs_writeFile(duk_context *ctx)
+	{
+		duk_idx_t callback = callback_index(ctx, 2);
+		std::string path(duk_require_string(ctx, 0));
+		bool append = duk_get_current_magic(ctx) != 0;
+
+		// the data is written from the heap memory, the value is kept referenced until the write ends
+		const void *data = NULL;
+		duk_size_t size = 0;
+		dtel::detail::ExternalBlock::Ptr block;
+		if (duk_is_string(ctx, 1))
+		{
+			data = duk_get_lstring(ctx, 1, &size);
+		}
+		else if (duk_is_buffer_data(ctx, 1))
+		{
+			data = duk_get_buffer_data(ctx, 1, &size);
+			// external memory can be detached while writing, keep the block too
+			block = dtel::detail::get_external_block(ctx, 1);
+			if (!block && duk_is_object(ctx, 1))
+			{
+				duk_get_prop_string(ctx, 1, "buffer");
+				block = dtel::detail::get_external_block(ctx, -1);
+				duk_pop(ctx);
+			}
+		}
+		else
+		{
+			duk_push_error_object(ctx, DUK_ERR_TYPE_ERROR, "data must be a string or a buffer");
+			duk_throw(ctx);
+		}
+
+		FSHandlerStorage *h = handler_from_ctx(ctx);
+		duk_dup(ctx, 1);
+		Ref::Ptr value(new Ref(ctx));
+		duk_dup(ctx, callback);
+		Ref::Ptr func(new Ref(ctx));
+
+		RunAsync(h->handler->eventLoop(), [path, data, size, block, append] {
+			write_file(path, data, size, append);
+		}, [value, func](duk_context *ctx, AsyncResult<void> &result) {
+			func->push(ctx);
+			dtel::detail::async_call(ctx, result, true);
+		});
+		return 0;
+	}
+
+	// fs.stat(path, callback)
+	inline duk_ret_t r_fs_stat(duk_context *ctx)
+	{
+		duk_idx_t callback = callback_index(ctx, 1);
+		std::string path(duk_require_string(ctx, 0));
+
+		FSHandlerStorage *h = handler_from_ctx(ctx);
+		RunAsyncCallback(h->handler->eventLoop(), callback, [path] {
+			return stat_file(path);
+		});
+		return 0;
+	}
+
+	// fs.createReadStream(path, [{start, chunkSize}])
+	inline duk_ret_t r_fs_createReadStream(duk_context *ctx)
+	{
+		std::string path(duk_require_string(ctx, 0));
+		FSHandlerStorage *h = handler_from_ctx(ctx);
+
+		duk_double_t start = 0;
+		size_t chunkSize = h->handler->chunkSize();
+		if (duk_is_object(ctx, 1))
+		{
+			if (duk_get_prop_string(ctx, 1, "start"))
+				start = duk_to_number(ctx, -1);
+			duk_pop(ctx);
+			if (duk_get_prop_string(ctx, 1, "chunkSize"))
+			{
+				duk_double_t value = duk_to_number(ctx, -1);
+				if (!(value >= 1) || value > static_cast<duk_double_t>(DUK_UINT32_MAX))
+				{
+					duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "invalid chunkSize");
+					duk_throw(ctx);
+				}
+				chunkSize = static_cast<size_t>(value);
+			}
+			duk_pop(ctx);
+		}
+		if (!(start >= 0))
+		{
+			duk_push_error_object(ctx, DUK_ERR_RANGE_ERROR, "invalid start");
+			duk_throw(ctx);
+		}
+
+		ReadStreamStorage *s = new ReadStreamStorage{ new ReadStream(path, static_cast<off_t>(start), chunkSize) };
+
+		duk_push_object(ctx);
+		duk_push_pointer(ctx, s);
+		duk_put_prop_string(ctx, -2, PROP_FSSTREAM);
+		duk_push_heap_stash(ctx);
+		duk_get_prop_string(ctx, -1, PROP_FSSTREAM_PROTO);
+		duk_set_prototype(ctx, -3);
+		duk_pop(ctx);
+		return 1;
+	}
+
+	inline ReadStreamStorage *stream_from_this(duk_context *ctx)
+	{
+		duk_push_this(ctx);
+		duk_get_prop_string(ctx, -1, PROP_FSSTREAM);
+		ReadStreamStorage *ret = static_cast<ReadStreamStorage*>(duk_get_pointer(ctx, -1));
+		duk_pop_2(ctx);
+		return ret;
+	}
+
+	// stream.read(callback), callback(error, chunk) with a null chunk at the end of the file
+	inline duk_ret_t r_ReadStream_read(duk_context *ctx)
+	{
+		duk_require_function(ctx, 0);
+		ReadStreamStorage *s = stream_from_this(ctx);
+		if (!s)
+		{
+			duk_push_error_object(ctx, DUK_ERR_ERROR, "stream is closed");
+			duk_throw(ctx);
+		}
+		if (s->stream->reading())
+		{
+			duk_push_error_object(ctx, DUK_ERR_ERROR, "a read is already pending");
+			duk_throw(ctx);
+		}
+
+		duk_dup(ctx, 0);
+		Ref::Ptr func(new Ref(ctx));
+		ReadStream::Ptr stream(s->stream);
+		stream->setReading(true);
+
+		RunAsync(handler_from_ctx(ctx)->handler->eventLoop(), [stream] {
+			return stream->read();
+		}, [stream, func](duk_context *ctx, AsyncResult<dtel::detail::ExternalBlock::Ptr> &result) {
+			stream->setReading(false);
+			func->push(ctx);
+			dtel::detail::async_call(ctx, result, true);
+		});
+		return 0;
+	}
+
+	inline void stream_release(duk_context *ctx, duk_idx_t idx)
+	{
+		idx = duk_normalize_index(ctx, idx);
+		duk_get_prop_string(ctx, idx, PROP_FSSTREAM);
+		if (duk_is_pointer(ctx, -1) != 0)
+		{
+			// a pending read keeps the file open until it ends
+			delete static_cast<ReadStreamStorage*>(duk_get_pointer(ctx, -1));
+			duk_del_prop_string(ctx, idx, PROP_FSSTREAM);
+		}
+		duk_pop(ctx);
+	}
+
+	// stream.close()
+	inline duk_ret_t r_ReadStream_close(duk_context *ctx)
+	{
+		duk_push_this(ctx);
+		stream_release(ctx, -1);
+		return 0;
+	}
+
+	inline duk_ret_t r_ReadStream_finalizer(duk_context *ctx)
+	{
+		// 0 = object to finalize
+		stream_release(ctx, 0);
+		return 0;
+	}
+
+	inline duk_ret_t r_fs_Finalizer(duk_context *ctx)
+	{
+		// 0 = object to finalize
+		duk_get_prop_string(ctx, 0, PROP_FSHANDLER);
+		if (duk_is_pointer(ctx, -1) != 0)
+		{
+			FSHandlerStorage* p = static_cast<FSHandlerStorage*>(duk_get_pointer(ctx, -1));
+			delete p;
+		}
+		duk_pop(ctx);
+		duk_del_prop_string(ctx, 0, PROP_FSHANDLER);
+		return 0;
+	}
+
+	inline void r_fs_Setup(FSHandler::Ptr handler)
+	{
+		duk_context *ctx = handler->eventLoop()->ctx();
+
+		// register the handler to the stash
+		FSHandlerStorage *h = new FSHandlerStorage{ handler };
+		duk_push_heap_stash(ctx);
+		// object container to allow finalizer
+		duk_push_object(ctx);
+		// pointer into object
+		duk_push_pointer(ctx, h);
+		duk_put_prop_string(ctx, -2, PROP_FSHANDLER);
+		// set object finalizer
+		duk_push_c_function(ctx, &r_fs_Finalizer, 1);
+		duk_set_finalizer(ctx, -2);
+		// put object into stash using the same property name
+		duk_put_prop_string(ctx, -2, PROP_FSHANDLER);
+
+		// read stream prototype
+		duk_push_object(ctx);
+		duk_push_c_function(ctx, &r_ReadStream_read, 1);
+		duk_put_prop_string(ctx, -2, "read");
+		duk_push_c_function(ctx, &r_ReadStream_close, 0);
+		duk_put_prop_string(ctx, -2, "close");
+		duk_push_c_function(ctx, &r_ReadStream_finalizer, 1);
+		duk_set_finalizer(ctx, -2);
+		duk_put_prop_string(ctx, -2, PROP_FSSTREAM_PROTO);
+		duk_pop(ctx);
+
+		duk_push_global_object(ctx);
+		duk_push_object(ctx);
+
+		duk_push_c_function(ctx, &r_fs_readFile, DUK_VARARGS);
+		duk_put_prop_string(ctx, -2, "readFile");
+
+		duk_push_c_function(ctx, &r_fs_writeFile, DUK_VARARGS);
+		duk_put_prop_string(ctx, -2, "writeFile");
+
+		duk_push_c_function(ctx, &r_fs_writeFile, DUK_VARARGS);
+		duk_set_magic(ctx, -1, 1);
+		duk_put_prop_string(ctx, -2, "appendFile");
+
+		duk_push_c_function(ctx, &r_fs_stat, DUK_VARARGS);
+		duk_put_prop_string(ctx, -2, "stat");
+
+		duk_push_c_function(ctx, &r_fs_createReadStream, 2);
+		duk_put_prop_string(ctx, -2, "createReadStream");
+
+		duk_put_prop_string(ctx, -2, "fs");
+		// pop global object
+		duk_pop(ctx);
+	}
+}
+
+/**
+ * Register the fs object on the event loop.
+ * The file operations run on the task threads of the loop, and the results are delivered to the callbacks
+ * on the loop thread. Files are read into native memory and exposed as ArrayBuffers without copying,
+ * large ones are mapped.
+ */
+inline FSHandler::Ptr RegisterFS(EventLoop *eventloop)
+{
+	duk_context *ctx = eventloop->ctx();
+	ResetStackOnScopeExit r(ctx);
+
+	FSHandler::Ptr handler(new FSHandler(eventloop));
+
+	// register the functions
+	detail::r_fs_Setup(handler);
+
+	// return the handler
+	return handler;
+}
+
+} }
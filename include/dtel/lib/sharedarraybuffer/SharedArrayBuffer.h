@@ -0,0 +1,431 @@
+#pragma once
+
+#include <dtel.h>
+#include <dtel/ResetStackOnScopeExit.h>
+#include <dtel/detail/external.h>
+#include <dtel/detail/interrupt.h>
+
+#include <duktape.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+
+namespace dtel {
+namespace sharedarraybuffer {
+
+namespace detail {
+	static const char* PROP_ATOMICS_TYPE = "\xFF" "DTEL_ATOMICS_TYPE";
+
+	enum atomics_type_t {
+		ATOMICS_INT8 = 1,
+		ATOMICS_UINT8,
+		ATOMICS_INT16,
+		ATOMICS_UINT16,
+		ATOMICS_INT32,
+		ATOMICS_UINT32,
+	};
+
+	enum atomics_op_t {
+		ATOMICS_LOAD,
+		ATOMICS_STORE,
+		ATOMICS_ADD,
+		ATOMICS_SUB,
+		ATOMICS_AND,
+		ATOMICS_OR,
+		ATOMICS_XOR,
+		ATOMICS_EXCHANGE,
+		ATOMICS_COMPAREEXCHANGE,
+	};
+
+	/**
+	 * Threads waiting on shared memory addresses, process wide, as the memory is shared between heaps
+	 */
+	class ParkingLot
+	{
+	public:
+		struct Waiter
+		{
+			std::condition_variable cv;
+			bool notified = false;
+		};
+
+		static ParkingLot &instance()
+		{
+			static ParkingLot lot;
+			return lot;
+		}
+
+		std::mutex &lock()
+		{
+			return _lock;
+		}
+
+		/**
+		 * Waits until notified or the timeout expires, the lock must be held. Returns whether it was notified.
+		 */
+		bool wait(std::unique_lock<std::mutex> &lock, void *address, double timeout)
+		{
+			auto &waiters = _waiters[address];
+			waiters.emplace_back();
+			auto waiter = std::prev(waiters.end());
+
+			auto until = std::chrono::steady_clock::time_point::max();
+			if (timeout != INFINITY)
+				until = std::chrono::steady_clock::now() +
+					std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(timeout));
+
+			// a heap that can be interrupted (Worker.terminate) checks its flag periodically
+			bool interruptible = dtel::detail::exec_interrupt_flag() != NULL;
+			auto poll = std::chrono::milliseconds(INTERRUPT_POLL_MS);
+			while (!waiter->notified && !dtel::detail::exec_interrupted())
+			{
+				auto now = std::chrono::steady_clock::now();
+				if (now >= until)
+					break;
+				if (interruptible && until - now > poll)
+					waiter->cv.wait_for(lock, poll);
+				else if (until == std::chrono::steady_clock::time_point::max())
+					waiter->cv.wait(lock);
+				else
+					waiter->cv.wait_until(lock, until);
+			}
+
+			bool notified = waiter->notified;
+			waiters.erase(waiter);
+			if (waiters.empty())
+				_waiters.erase(address);
+			return notified;
+		}
+
+		/**
+		 * Wakes up to count waiters of the address, in wait order. Returns the number of woken waiters.
+		 */
+		duk_uint32_t notify(void *address, duk_uint32_t count)
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			auto waiters = _waiters.find(address);
+			if (waiters == _waiters.end())
+				return 0;
+
+			duk_uint32_t woken = 0;
+			for (auto &waiter : waiters->second)
+			{
+				if (woken >= count)
+					break;
+				if (waiter.notified)
+					continue;
+				waiter.notified = true;
+				waiter.cv.notify_one();
+				woken++;
+			}
+			return woken;
+		}
+	private:
+		// interval to check the interrupt flag while waiting
+		static const int INTERRUPT_POLL_MS = 50;
+
+		ParkingLot() {}
+
+		std::mutex _lock;
+		std::unordered_map<void*, std::list<Waiter>> _waiters;
+	};
+
+	inline duk_ret_t r_SharedArrayBuffer_construct(duk_context *ctx)
+	{
+		if (!duk_is_constructor_call(ctx))
+			return duk_error(ctx, DUK_ERR_TYPE_ERROR, "SharedArrayBuffer must be called with new");
+
+		duk_double_t length = duk_to_number(ctx, 0);
+		if (!(length >= 0) || length > static_cast<duk_double_t>(DUK_UINT32_MAX))
+			return duk_error(ctx, DUK_ERR_RANGE_ERROR, "invalid SharedArrayBuffer length");
+
+		dtel::detail::ExternalBlock *block = NULL;
+		{
+			try
+			{
+				block = new dtel::detail::ExternalBlock(static_cast<size_t>(length));
+			}
+			catch (std::bad_alloc &)
+			{
+			}
+		}
+		if (!block)
+			return duk_error(ctx, DUK_ERR_RANGE_ERROR, "SharedArrayBuffer allocation failed");
+
+		dtel::detail::push_shared_arraybuffer(ctx, block);
+		return 1;
+	}
+
+	// SharedArrayBuffer.prototype.slice(begin, end)
+	inline duk_ret_t r_SharedArrayBuffer_slice(duk_context *ctx)
+	{
+		duk_push_this(ctx);
+		if (!dtel::detail::is_shared_arraybuffer(ctx, -1))
+			return duk_error(ctx, DUK_ERR_TYPE_ERROR, "not a SharedArrayBuffer");
+
+		duk_size_t size;
+		unsigned char *data = static_cast<unsigned char*>(duk_get_buffer_data(ctx, -1, &size));
+		duk_double_t len = static_cast<duk_double_t>(size);
+
+		duk_double_t begin = duk_is_undefined(ctx, 0) ? 0 : duk_to_number(ctx, 0);
+		duk_double_t end = duk_is_undefined(ctx, 1) ? len : duk_to_number(ctx, 1);
+		if (begin != begin) begin = 0;
+		if (end != end) end = 0;
+		begin = begin < 0 ? (len + begin > 0 ? len + begin : 0) : (begin < len ? begin : len);
+		end = end < 0 ? (len + end > 0 ? len + end : 0) : (end < len ? end : len);
+		size_t count = end > begin ? static_cast<size_t>(end - begin) : 0;
+
+		dtel::detail::ExternalBlock *block = NULL;
+		{
+			try
+			{
+				block = new dtel::detail::ExternalBlock(count);
+			}
+			catch (std::bad_alloc &)
+			{
+			}
+		}
+		if (!block)
+			return duk_error(ctx, DUK_ERR_RANGE_ERROR, "SharedArrayBuffer allocation failed");
+		if (count > 0)
+			std::memcpy(block->data(), data + static_cast<size_t>(begin), count);
+
+		dtel::detail::push_shared_arraybuffer(ctx, block);
+		return 1;
+	}
+
+	/**
+	 * Checks the integer typed array at index 0 and the index at 1, and returns the element address
+	 */
+	inline void *atomics_address(duk_context *ctx, atomics_type_t &type, bool &shared)
+	{
+		int t = 0;
+		if (duk_is_buffer_data(ctx, 0) && !duk_is_buffer(ctx, 0))
+		{
+			duk_get_prop_string(ctx, 0, PROP_ATOMICS_TYPE);
+			t = duk_get_int_default(ctx, -1, 0);
+			duk_pop(ctx);
+		}
+		if (t == 0)
+			duk_error(ctx, DUK_ERR_TYPE_ERROR, "Atomics requires an integer typed array");
+		type = static_cast<atomics_type_t>(t);
+
+		duk_get_prop_string(ctx, 0, "buffer");
+		shared = dtel::detail::is_shared_arraybuffer(ctx, -1);
+		duk_pop(ctx);
+
+		static const size_t sizes[] = { 0, 1, 1, 2, 2, 4, 4 };
+		duk_size_t size;
+		unsigned char *data = static_cast<unsigned char*>(duk_get_buffer_data(ctx, 0, &size));
+		duk_double_t index = duk_to_number(ctx, 1);
+		if (!(index >= 0) || index != static_cast<duk_double_t>(static_cast<duk_uint32_t>(index)) ||
+			static_cast<duk_size_t>(index) >= size / sizes[t])
+			duk_error(ctx, DUK_ERR_RANGE_ERROR, "Atomics index out of range");
+
+		return data + static_cast<size_t>(index) * sizes[t];
+	}
+
+	template <typename T>
+	inline T atomics_apply(void *address, atomics_op_t op, T value, T replacement)
+	{
+		static_assert(sizeof(std::atomic<T>) == sizeof(T), "atomic type must have the size of the value");
+		std::atomic<T> *a = reinterpret_cast<std::atomic<T>*>(address);
+		switch (op)
+		{
+		case ATOMICS_LOAD: return a->load();
+		case ATOMICS_STORE: a->store(value); return value;
+		case ATOMICS_ADD: return a->fetch_add(value);
+		case ATOMICS_SUB: return a->fetch_sub(value);
+		case ATOMICS_AND: return a->fetch_and(value);
+		case ATOMICS_OR: return a->fetch_or(value);
+		case ATOMICS_XOR: return a->fetch_xor(value);
+		case ATOMICS_EXCHANGE: return a->exchange(value);
+		case ATOMICS_COMPAREEXCHANGE: a->compare_exchange_strong(value, replacement); return value;
+		}
+		return 0;
+	}
+
+	template <typename T>
+	inline void atomics_push(duk_context *ctx, void *address, atomics_op_t op)
+	{
+		// store returns the value converted to an integer, not to the element type
+		duk_double_t stored = op == ATOMICS_STORE ? duk_to_number(ctx, 2) : 0;
+		T value = op == ATOMICS_LOAD ? 0 : static_cast<T>(duk_to_uint32(ctx, 2));
+		T replacement = op == ATOMICS_COMPAREEXCHANGE ? static_cast<T>(duk_to_uint32(ctx, 3)) : 0;
+		if (op == ATOMICS_STORE)
+		{
+			duk_double_t ret = stored;
+			atomics_apply<T>(address, op, value, replacement);
+			duk_push_number(ctx, ret != ret ? 0 : (ret < 0 ? std::ceil(ret) : std::floor(ret)));
+			return;
+		}
+		duk_push_number(ctx, static_cast<duk_double_t>(atomics_apply<T>(address, op, value, replacement)));
+	}
+
+	// Atomics.load/store/add/sub/and/or/xor/exchange/compareExchange(typedArray, index, ...)
+	// magic = atomics_op_t
+	inline duk_ret_t r_Atomics_op(duk_context *ctx)
+	{
+		atomics_op_t op = static_cast<atomics_op_t>(duk_get_current_magic(ctx));
+		atomics_type_t type;
+		bool shared;
+		void *address = atomics_address(ctx, type, shared);
+
+		switch (type)
+		{
+		case ATOMICS_INT8: atomics_push<std::int8_t>(ctx, address, op); break;
+		case ATOMICS_UINT8: atomics_push<std::uint8_t>(ctx, address, op); break;
+		case ATOMICS_INT16: atomics_push<std::int16_t>(ctx, address, op); break;
+		case ATOMICS_UINT16: atomics_push<std::uint16_t>(ctx, address, op); break;
+		case ATOMICS_INT32: atomics_push<std::int32_t>(ctx, address, op); break;
+		case ATOMICS_UINT32: atomics_push<std::uint32_t>(ctx, address, op); break;
+		}
+		return 1;
+	}
+
+	// Atomics.wait(int32Array, index, value, timeout)
+	inline duk_ret_t r_Atomics_wait(duk_context *ctx)
+	{
+		atomics_type_t type;
+		bool shared;
+		void *address = atomics_address(ctx, type, shared);
+		if (type != ATOMICS_INT32 || !shared)
+			return duk_error(ctx, DUK_ERR_TYPE_ERROR, "Atomics.wait requires an Int32Array over a SharedArrayBuffer");
+
+		std::int32_t value = duk_to_int32(ctx, 2);
+		duk_double_t timeout = duk_is_undefined(ctx, 3) ? INFINITY : duk_to_number(ctx, 3);
+		if (timeout != timeout || timeout < 0)
+			timeout = timeout < 0 ? 0 : INFINITY;
+
+		const char *ret;
+		{
+			auto &lot = ParkingLot::instance();
+			std::unique_lock<std::mutex> lock(lot.lock());
+			if (reinterpret_cast<std::atomic<std::int32_t>*>(address)->load() != value)
+				ret = "not-equal";
+			else
+				ret = lot.wait(lock, address, timeout) ? "ok" : "timed-out";
+		}
+		duk_push_string(ctx, ret);
+		return 1;
+	}
+
+	// Atomics.notify(int32Array, index, count)
+	inline duk_ret_t r_Atomics_notify(duk_context *ctx)
+	{
+		atomics_type_t type;
+		bool shared;
+		void *address = atomics_address(ctx, type, shared);
+		if (type != ATOMICS_INT32)
+			return duk_error(ctx, DUK_ERR_TYPE_ERROR, "Atomics.notify requires an Int32Array");
+
+		duk_uint32_t count = DUK_UINT32_MAX;
+		if (!duk_is_undefined(ctx, 2))
+		{
+			duk_double_t c = duk_to_number(ctx, 2);
+			count = !(c > 0) ? 0 : (c >= static_cast<duk_double_t>(DUK_UINT32_MAX) ? DUK_UINT32_MAX : static_cast<duk_uint32_t>(c));
+		}
+
+		duk_uint32_t woken = 0;
+		if (shared)
+			woken = ParkingLot::instance().notify(address, count);
+		duk_push_uint(ctx, woken);
+		return 1;
+	}
+
+	inline void r_SharedArrayBuffer_Setup(duk_context *ctx)
+	{
+		duk_push_global_object(ctx);
+
+		//
+		// SharedArrayBuffer
+		//
+		duk_push_c_function(ctx, &r_SharedArrayBuffer_construct, 1);
+		duk_push_object(ctx);
+
+		// inherit byteLength from ArrayBuffer, the buffer is a native ArrayBuffer
+		duk_get_global_string(ctx, "ArrayBuffer");
+		duk_get_prop_string(ctx, -1, "prototype");
+		duk_set_prototype(ctx, -3);
+		duk_pop(ctx);
+
+		duk_push_c_function(ctx, &r_SharedArrayBuffer_slice, 2);
+		duk_put_prop_string(ctx, -2, "slice");
+
+		duk_dup(ctx, -2);
+		duk_put_prop_string(ctx, -2, "constructor");
+		duk_put_prop_string(ctx, -2, "prototype");
+		duk_put_prop_string(ctx, -2, "SharedArrayBuffer");
+
+		//
+		// mark the integer typed arrays
+		//
+		static const struct { const char *name; atomics_type_t type; } types[] = {
+			{ "Int8Array", ATOMICS_INT8 },
+			{ "Uint8Array", ATOMICS_UINT8 },
+			{ "Int16Array", ATOMICS_INT16 },
+			{ "Uint16Array", ATOMICS_UINT16 },
+			{ "Int32Array", ATOMICS_INT32 },
+			{ "Uint32Array", ATOMICS_UINT32 },
+		};
+		for (auto &t : types)
+		{
+			duk_get_prop_string(ctx, -1, t.name);
+			duk_get_prop_string(ctx, -1, "prototype");
+			duk_push_int(ctx, t.type);
+			duk_put_prop_string(ctx, -2, PROP_ATOMICS_TYPE);
+			duk_pop_2(ctx);
+		}
+
+		//
+		// Atomics
+		//
+		static const struct { const char *name; atomics_op_t op; duk_idx_t nargs; } ops[] = {
+			{ "load", ATOMICS_LOAD, 2 },
+			{ "store", ATOMICS_STORE, 3 },
+			{ "add", ATOMICS_ADD, 3 },
+			{ "sub", ATOMICS_SUB, 3 },
+			{ "and", ATOMICS_AND, 3 },
+			{ "or", ATOMICS_OR, 3 },
+			{ "xor", ATOMICS_XOR, 3 },
+			{ "exchange", ATOMICS_EXCHANGE, 3 },
+			{ "compareExchange", ATOMICS_COMPAREEXCHANGE, 4 },
+		};
+		duk_push_object(ctx);
+		for (auto &o : ops)
+		{
+			duk_push_c_function(ctx, &r_Atomics_op, o.nargs);
+			duk_set_magic(ctx, -1, o.op);
+			duk_put_prop_string(ctx, -2, o.name);
+		}
+		duk_push_c_function(ctx, &r_Atomics_wait, 4);
+		duk_put_prop_string(ctx, -2, "wait");
+		duk_push_c_function(ctx, &r_Atomics_notify, 3);
+		duk_put_prop_string(ctx, -2, "notify");
+		duk_put_prop_string(ctx, -2, "Atomics");
+
+		duk_pop(ctx);
+	}
+}
+
+/**
+ * Register SharedArrayBuffer and Atomics on the event loop.
+ * The memory of a SharedArrayBuffer is shared with every worker it is posted to.
+ */
+inline void RegisterSharedArrayBuffer(EventLoop *eventloop)
+{
+	duk_context *ctx = eventloop->ctx();
+	ResetStackOnScopeExit r(ctx);
+
+	detail::r_SharedArrayBuffer_Setup(ctx);
+}
+
+} }
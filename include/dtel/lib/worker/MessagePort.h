@@ -0,0 +1,659 @@
+#pragma once
+
+#include <dtel.h>
+#include <dtel/ResetStackOnScopeExit.h>
+#include <dtel/lib/eventtarget/EventTarget.h>
+#include <dtel/detail/clone.h>
+#include <dtel/detail/ring.h>
+
+#include <duktape.h>
+
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace dtel {
+namespace worker {
+
+namespace detail {
+
+	static const char* PROP_MESSAGEPORT_STORAGE = "\xFF" "DTEL_MESSAGEPORT_STORAGE";
+	static const char* PROP_MESSAGEPORT_PROTOTYPE = "\xFF" "DTEL_MESSAGEPORT_PROTOTYPE";
+
+	/**
+	 * Message data, parsed only when the event is built
+	 */
+	class MessageValue : public Value
+	{
+	public:
+		MessageValue(dtel::detail::clone::Message message) :
+			Value(), _message(std::move(message))
+		{}
+
+		int push(duk_context *ctx) override
+		{
+			if (!dtel::detail::clone::decode_push(ctx, _message)) {
+				ThrowError(ctx, -1);
+			}
+			return 1;
+		}
+	private:
+		dtel::detail::clone::Message _message;
+	};
+
+	/**
+	 * Messages to one side of a worker or message port. The sending thread fills a ring buffer that the
+	 * receiving loop drains: only the first message of a burst posts an event to wake the loop, and each
+	 * wake dispatches all the messages that arrived, in a batch.
+	 * send must only be called from one thread at a time, the messages are received on the attached loop.
+	 * A queue that is not started keeps its messages until start() is called.
+	 * The loop must be detached (attach NULL) before it is destroyed, senders never post to it after that.
+	 */
+	class MessageQueue : public ThreadSafeRefCountedBase<MessageQueue>
+	{
+	public:
+		typedef IntrusiveRefCntPtr<MessageQueue> Ptr;
+
+		MessageQueue() :
+			_target(), _attachlock(), _eventloop(NULL), _scheduled(false), _started(true), _closed(false),
+			_finished(false), _ring(), _overflowing(false), _overflowlock(), _overflow()
+		{
+		}
+
+		/**
+		 * Sets the loop and the target that receive the messages, messages sent before are delivered to it
+		 * once the queue is started.
+		 * Must be called on the thread of the loop, or of the previous loop when detaching (NULL).
+		 */
+		void attach(EventLoop *eventloop, Value::Ptr target, bool started = true)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_attachlock);
+				_target.swap(target);
+				_started.store(started);
+				_eventloop.store(eventloop);
+				wakePending(eventloop);
+			}
+			// the previous target is released unlocked, it can run finalizers that detach queues
+		}
+
+		/**
+		 * Starts delivering the messages to the target, the ones received until now first.
+		 * Must be called on the thread of the attached loop.
+		 */
+		void start(Value::Ptr target)
+		{
+			_target = target;
+			if (!_started.exchange(true))
+				wakePending(_eventloop.load());
+		}
+
+		bool started() const
+		{
+			return _started.load();
+		}
+
+		/**
+		 * Sends a message, never blocks. If the ring buffer is full the message is queued in a list.
+		 */
+		void send(dtel::detail::clone::Message message)
+		{
+			if (_closed.load())
+				return;
+
+			if (_overflowing.load() || !_ring.push(std::move(message)))
+			{
+				std::lock_guard<std::mutex> lock(_overflowlock);
+				_overflow.push_back(std::move(message));
+				_overflowing.store(true);
+			}
+
+			// only the first message wakes the receiver
+			if (!_scheduled.exchange(true))
+				wakeAttached();
+		}
+
+		/**
+		 * Stops delivering messages, the ones not yet received are discarded. The receiver releases its target.
+		 */
+		void close()
+		{
+			_closed.store(true);
+			if (!_scheduled.exchange(true))
+				wakeAttached();
+		}
+
+		/**
+		 * The sender is gone, the receiver releases its target once the messages sent were delivered
+		 */
+		void finish()
+		{
+			_finished.store(true);
+			if (!_scheduled.exchange(true))
+				wakeAttached();
+		}
+
+		/**
+		 * Dispatches the received messages, called on the receiving loop
+		 */
+		void receive(EventLoop *eventloop, duk_context *ctx)
+		{
+			// the queue was moved to another loop after this wake was posted
+			if (_eventloop.load() != eventloop)
+				return;
+			if (_closed.load())
+			{
+				releaseTarget();
+				return;
+			}
+			// kept until started, which wakes the loop again
+			if (!_started.load())
+				return;
+			// checked before the ring, the messages sent before finish() are in it
+			bool finished = _finished.load();
+
+			// messages sent from now on must wake the loop again
+			_scheduled.store(false);
+
+			std::vector<eventtarget::Event::Ptr> events;
+			dtel::detail::clone::Message message;
+			while (events.size() < MAX_RECEIVE && _ring.pop(message))
+				events.push_back(messageEvent(std::move(message)));
+
+			// while overflowing, all messages go to the list, so it is newer than the ring
+			if (events.size() < MAX_RECEIVE && _overflowing.load() && _ring.empty())
+			{
+				std::lock_guard<std::mutex> lock(_overflowlock);
+				for (auto &m : _overflow)
+					events.push_back(messageEvent(std::move(m)));
+				_overflow.clear();
+				_overflowing.store(false);
+			}
+
+			// too many messages, let other events run before the rest
+			bool more = !_ring.empty() || _overflowing.load();
+			if (more && !_scheduled.exchange(true))
+				wake(eventloop);
+
+			// keep the target, a listener may detach the queue
+			Value::Ptr target(_target);
+			// nothing can arrive anymore, the target can be collected
+			if (finished && !more)
+				releaseTarget();
+			if (events.empty() || !target)
+				return;
+			// a listener may close the queue, the rest of the batch is discarded
+			eventtarget::EventTarget_dispatchEvents(ctx, target, events, [eventloop](const std::exception &e) {
+				return eventloop->processException(e);
+			}, [this] {
+				return _closed.load();
+			});
+		}
+
+		MessageQueue(const MessageQueue &) = delete;
+		MessageQueue &operator=(const MessageQueue &) = delete;
+	private:
+		class ReceiveEvent : public Event
+		{
+		public:
+			ReceiveEvent(MessageQueue::Ptr queue, EventLoop *eventloop) :
+				Event(), _queue(queue), _eventloop(eventloop)
+			{}
+
+			void apply(duk_context *ctx) override
+			{
+				_queue->receive(_eventloop, ctx);
+			}
+
+			void release(duk_context *ctx) override
+			{
+
+			}
+		private:
+			MessageQueue::Ptr _queue;
+			EventLoop *_eventloop;
+		};
+
+		void wake(EventLoop *eventloop)
+		{
+			eventloop->postEvent(make_intrusive<ReceiveEvent>(this, eventloop));
+		}
+
+		// wakes the attached loop from any thread, it can't be detached and destroyed meanwhile
+		void wakeAttached()
+		{
+			std::lock_guard<std::mutex> lock(_attachlock);
+			EventLoop *eventloop = _eventloop.load();
+			if (eventloop)
+				wake(eventloop);
+		}
+
+		// the target is cleared before it is released, it can run finalizers that detach the queue
+		void releaseTarget()
+		{
+			Value::Ptr target;
+			target.swap(_target);
+		}
+
+		// wakes the loop if there are messages to deliver
+		void wakePending(EventLoop *eventloop)
+		{
+			if (eventloop && _started.load() && (_scheduled.load() || !_ring.empty() || _overflowing.load()))
+			{
+				_scheduled.store(true);
+				wake(eventloop);
+			}
+		}
+
+		static eventtarget::Event::Ptr messageEvent(dtel::detail::clone::Message message)
+		{
+			// the message is only parsed if someone is listening
+			auto evt = make_intrusive<eventtarget::Event>("message", "Event");
+			evt->eventInit.properties["data"] = Value::Ptr(new MessageValue(std::move(message)));
+			return evt;
+		}
+
+		// maximum amount of messages dispatched on each wake
+		static const size_t MAX_RECEIVE = 256;
+
+		Value::Ptr _target;
+		std::mutex _attachlock;
+		std::atomic<EventLoop*> _eventloop;
+		std::atomic_bool _scheduled;
+		std::atomic_bool _started;
+		std::atomic_bool _closed;
+		std::atomic_bool _finished;
+		dtel::detail::SPSCRing<dtel::detail::clone::Message, 256> _ring;
+		std::atomic_bool _overflowing;
+		std::mutex _overflowlock;
+		std::vector<dtel::detail::clone::Message> _overflow;
+	};
+
+	class MessagePortData;
+
+	/**
+	 * Storage of the message ports inside duktape, the queues attached to the heap loop
+	 */
+	struct MessagePortStorage
+	{
+		EventLoop *eventloop;
+		std::unordered_set<MessageQueue*> queues;
+	};
+
+	inline void push_messageport(duk_context *ctx, MessagePortData *port);
+	inline void messageport_detach(duk_context *ctx, duk_idx_t idx);
+
+	/**
+	 * One end of a MessageChannel. Receives on its own queue and sends on the queue of the other end.
+	 * Transferring the port moves its queue to the loop of the receiving heap.
+	 * Like in the browsers, each port object keeps its messages until start() is called or onmessage is set.
+	 * A started port object can't be collected until it is closed or the other end is gone.
+	 */
+	class MessagePortData : public dtel::detail::clone::Transferable
+	{
+	public:
+		typedef IntrusiveRefCntPtr<MessagePortData> Ptr;
+
+		MessagePortData(MessageQueue::Ptr in, MessageQueue::Ptr out) :
+			_in(in), _out(out)
+		{
+		}
+
+		~MessagePortData()
+		{
+			_out->finish();
+		}
+
+		/**
+		 * The queue receiving the messages of the port
+		 */
+		MessageQueue *queue() const
+		{
+			return _in.get();
+		}
+
+		void postMessage(dtel::detail::clone::Message message)
+		{
+			_out->send(std::move(message));
+		}
+
+		/**
+		 * Disentangles both ends
+		 */
+		void close()
+		{
+			_in->close();
+			_out->close();
+		}
+
+		void detach(duk_context *ctx, duk_idx_t idx) override
+		{
+			messageport_detach(ctx, idx);
+		}
+
+		void push(duk_context *ctx) override
+		{
+			push_messageport(ctx, this);
+		}
+	private:
+		MessageQueue::Ptr _in;
+		MessageQueue::Ptr _out;
+	};
+
+	inline MessagePortStorage *messageport_storage(duk_context *ctx)
+	{
+		duk_push_heap_stash(ctx);
+		// object on stash
+		MessagePortStorage *ret = NULL;
+		if (duk_get_prop_string(ctx, -1, PROP_MESSAGEPORT_STORAGE) != 0)
+		{
+			// property on object, removed by the finalizer
+			duk_get_prop_string(ctx, -1, PROP_MESSAGEPORT_STORAGE);
+			ret = static_cast<MessagePortStorage*>(duk_get_pointer(ctx, -1));
+			duk_pop(ctx);
+		}
+		duk_pop_2(ctx); // stash, object
+		return ret;
+	}
+
+	inline MessagePortData *messageport_get(duk_context *ctx, duk_idx_t idx)
+	{
+		MessagePortData *ret = NULL;
+		if (!duk_is_object(ctx, idx))
+			return ret;
+		duk_get_prop_string(ctx, idx, dtel::detail::clone::PROP_TRANSFERABLE);
+		if (duk_is_pointer(ctx, -1) != 0)
+			ret = static_cast<MessagePortData*>(static_cast<dtel::detail::clone::Transferable*>(duk_get_pointer(ctx, -1)));
+		duk_pop(ctx);
+		return ret;
+	}
+
+	inline duk_ret_t r_MessagePort_finalizer(duk_context *ctx)
+	{
+		// 0 = object
+		messageport_detach(ctx, 0);
+		return 0;
+	}
+
+	/**
+	 * Attaches the queue to the heap loop, it is detached when the loop is destroyed
+	 */
+	inline void messagequeue_attach(duk_context *ctx, MessageQueue *queue, Value::Ptr target, bool started = true)
+	{
+		MessagePortStorage *storage = messageport_storage(ctx);
+		if (!storage || !storage->eventloop)
+			return;
+		storage->queues.insert(queue);
+		queue->attach(storage->eventloop, target, started);
+	}
+
+	/**
+	 * Detaches the queue from the heap loop, the messages sent after that are kept until it is attached again
+	 */
+	inline void messagequeue_detach(duk_context *ctx, MessageQueue *queue)
+	{
+		MessagePortStorage *storage = messageport_storage(ctx);
+		if (storage)
+			storage->queues.erase(queue);
+		queue->attach(NULL, Value::Ptr());
+	}
+
+	/**
+	 * Pushes a MessagePort object for the port, which receives the messages on the heap loop
+	 */
+	inline void push_messageport(duk_context *ctx, MessagePortData *port)
+	{
+		MessagePortStorage *storage = messageport_storage(ctx);
+		if (!storage)
+			duk_error(ctx, DUK_ERR_TYPE_ERROR, "DataCloneError: MessagePort is not registered");
+
+		duk_push_object(ctx);
+		duk_push_heap_stash(ctx);
+		duk_get_prop_string(ctx, -1, PROP_MESSAGEPORT_PROTOTYPE);
+		duk_remove(ctx, -2); // stash
+		duk_set_prototype(ctx, -2);
+
+		port->Retain();
+		duk_push_pointer(ctx, static_cast<dtel::detail::clone::Transferable*>(port));
+		duk_put_prop_string(ctx, -2, dtel::detail::clone::PROP_TRANSFERABLE);
+		duk_push_c_function(ctx, &r_MessagePort_finalizer, 1);
+		duk_set_finalizer(ctx, -2);
+
+		// the object is only referenced once the port is started
+		messagequeue_attach(ctx, port->queue(), Value::Ptr(), false);
+	}
+
+	/**
+	 * Starts the port of the object at index, the object is kept while the port can receive messages
+	 */
+	inline void messageport_start(duk_context *ctx, duk_idx_t idx)
+	{
+		MessagePortData *port = messageport_get(ctx, idx);
+		if (!port || port->queue()->started())
+			return;
+		duk_dup(ctx, idx);
+		port->queue()->start(new Ref(ctx));
+	}
+
+	/**
+	 * Detaches the port from the object at index and from the heap loop, the object can't be used anymore
+	 */
+	inline void messageport_detach(duk_context *ctx, duk_idx_t idx)
+	{
+		idx = duk_normalize_index(ctx, idx);
+		MessagePortData *port = messageport_get(ctx, idx);
+		if (!port)
+			return;
+
+		messagequeue_detach(ctx, port->queue());
+
+		// keep the property, so a detached port is never cloned as a plain object
+		duk_push_pointer(ctx, NULL);
+		duk_put_prop_string(ctx, idx, dtel::detail::clone::PROP_TRANSFERABLE);
+		port->Release();
+	}
+
+	/**
+	 * Detaches all the queues from the heap loop, called when the loop is destroyed
+	 */
+	inline void messageport_shutdown(duk_context *ctx, EventLoop *eventloop)
+	{
+		MessagePortStorage *storage = messageport_storage(ctx);
+		if (!storage || storage->eventloop != eventloop)
+			return;
+		storage->eventloop = NULL;
+		// releasing a target can run finalizers that detach other queues
+		while (!storage->queues.empty())
+		{
+			MessageQueue::Ptr queue(*storage->queues.begin());
+			storage->queues.erase(storage->queues.begin());
+			queue->attach(NULL, Value::Ptr());
+		}
+	}
+
+	inline duk_ret_t r_MessagePortStorage_finalizer(duk_context *ctx)
+	{
+		// 0 = object to finalize
+		duk_get_prop_string(ctx, 0, PROP_MESSAGEPORT_STORAGE);
+		if (duk_is_pointer(ctx, -1))
+		{
+			MessagePortStorage *storage = static_cast<MessagePortStorage*>(duk_get_pointer(ctx, -1));
+			delete storage;
+			duk_del_prop_string(ctx, 0, PROP_MESSAGEPORT_STORAGE);
+		}
+		duk_pop(ctx);
+
+		return 0;
+	}
+
+	inline duk_ret_t r_MessagePort_construct(duk_context *ctx)
+	{
+		return duk_error(ctx, DUK_ERR_TYPE_ERROR, "Illegal constructor");
+	}
+
+	inline duk_ret_t r_MessagePort_postMessage(duk_context *ctx)
+	{
+		// 0: message
+		// 1: transfer list
+
+		duk_push_this(ctx);
+		MessagePortData *port = messageport_get(ctx, -1);
+		// closed or transferred ports discard the messages
+		if (!port)
+			return 0;
+
+		if (duk_is_array(ctx, 1))
+		{
+			duk_size_t len = duk_get_length(ctx, 1);
+			for (duk_size_t i = 0; i < len; i++)
+			{
+				duk_get_prop_index(ctx, 1, static_cast<duk_uarridx_t>(i));
+				bool self = duk_get_heapptr(ctx, -1) == duk_get_heapptr(ctx, 2);
+				duk_pop(ctx);
+				if (self)
+					return duk_error(ctx, DUK_ERR_TYPE_ERROR, "DataCloneError: the port can't be transferred to itself");
+			}
+		}
+
+		// serialize 0, transferring 1
+		bool ok;
+		{
+			dtel::detail::clone::Message message;
+			ok = dtel::detail::clone::encode(ctx, 0, 1, message);
+			if (ok)
+				port->postMessage(std::move(message));
+		}
+		if (!ok)
+			return duk_throw(ctx);
+
+		return 0;
+	}
+
+	inline duk_ret_t r_MessagePort_start(duk_context *ctx)
+	{
+		duk_push_this(ctx);
+		messageport_start(ctx, -1);
+		return 0;
+	}
+
+	inline duk_ret_t r_MessagePort_onmessageSet(duk_context *ctx)
+	{
+		// 0: handler
+		eventtarget::detail::r_EventTarget_handlerSet(ctx);
+
+		// setting onmessage starts the port, addEventListener doesn't
+		if (duk_is_object(ctx, 0))
+		{
+			duk_push_this(ctx);
+			messageport_start(ctx, -1);
+		}
+		return 0;
+	}
+
+	inline duk_ret_t r_MessagePort_close(duk_context *ctx)
+	{
+		duk_push_this(ctx);
+		MessagePortData *port = messageport_get(ctx, -1);
+		if (port)
+		{
+			port->close();
+			messageport_detach(ctx, -1);
+		}
+		return 0;
+	}
+
+	inline duk_ret_t r_MessageChannel_construct(duk_context *ctx)
+	{
+		if (!duk_is_constructor_call(ctx))
+			return duk_error(ctx, DUK_ERR_TYPE_ERROR, "Constructor requires 'new'");
+
+		duk_push_this(ctx);
+
+		MessageQueue::Ptr a(new MessageQueue()), b(new MessageQueue());
+		// the ports keep the references
+		MessagePortData *port1 = new MessagePortData(a, b);
+		MessagePortData *port2 = new MessagePortData(b, a);
+		a.reset();
+		b.reset();
+
+		push_messageport(ctx, port1);
+		duk_put_prop_string(ctx, -2, "port1");
+		push_messageport(ctx, port2);
+		duk_put_prop_string(ctx, -2, "port2");
+
+		return 0;
+	}
+
+	/**
+	 * Defines MessageChannel and MessagePort on the heap, ports received on it are attached to the loop
+	 */
+	inline void r_MessagePort_Setup(duk_context *ctx, EventLoop *eventloop)
+	{
+		ResetStackOnScopeExit r(ctx);
+
+		MessagePortStorage *storage = messageport_storage(ctx);
+		if (!storage)
+		{
+			storage = new MessagePortStorage();
+			duk_push_heap_stash(ctx);
+			// object container to allow finalizer
+			duk_push_object(ctx);
+			duk_push_pointer(ctx, storage);
+			duk_put_prop_string(ctx, -2, PROP_MESSAGEPORT_STORAGE);
+			duk_push_c_function(ctx, &r_MessagePortStorage_finalizer, 1);
+			duk_set_finalizer(ctx, -2);
+			duk_put_prop_string(ctx, -2, PROP_MESSAGEPORT_STORAGE);
+			duk_pop(ctx);
+		}
+		storage->eventloop = eventloop;
+		// the queues must not post to the loop once it is destroyed
+		eventloop->addShutdownHandler([ctx, eventloop] {
+			messageport_shutdown(ctx, eventloop);
+		});
+
+		// MessagePort
+		duk_push_global_object(ctx);
+		duk_push_c_function(ctx, &r_MessagePort_construct, 0);
+		duk_put_prop_string(ctx, -2, "MessagePort");
+		duk_pop(ctx);
+
+		if (duk_peval_string(ctx, R"(
+
+MessagePort.prototype = Object.create(EventTarget.prototype);
+MessagePort.prototype.constructor = MessagePort;
+
+		)") != 0)
+		{
+			ThrowError(ctx, -1);
+		};
+		duk_pop(ctx);
+
+		duk_get_global_string(ctx, "MessagePort");
+		duk_get_prop_string(ctx, -1, "prototype");
+		eventtarget::DefineEventHandlers(ctx, -1, { "messageerror" });
+		eventtarget::detail::define_eventhandler(ctx, -1, "message", &r_MessagePort_onmessageSet);
+		duk_push_c_function(ctx, &r_MessagePort_postMessage, 2);
+		duk_put_prop_string(ctx, -2, "postMessage");
+		duk_push_c_function(ctx, &r_MessagePort_start, 0);
+		duk_put_prop_string(ctx, -2, "start");
+		duk_push_c_function(ctx, &r_MessagePort_close, 0);
+		duk_put_prop_string(ctx, -2, "close");
+
+		// ports received by the heap use it
+		duk_push_heap_stash(ctx);
+		duk_dup(ctx, -2);
+		duk_put_prop_string(ctx, -2, PROP_MESSAGEPORT_PROTOTYPE);
+		duk_pop_3(ctx); // stash, prototype, MessagePort
+
+		// MessageChannel
+		duk_push_global_object(ctx);
+		duk_push_c_function(ctx, &r_MessageChannel_construct, 0);
+		duk_put_prop_string(ctx, -2, "MessageChannel");
+		duk_pop(ctx);
+	}
+
+}
+
+} }
@@ -1,16 +1,28 @@
 #pragma once
 
 #include <dtel.h>
+#include <dtel/AccountingAllocator.h>
 #include <dtel/ResetStackOnScopeExit.h>
 #include <dtel/lib/eventtarget/EventTarget.h>
-#include <dtel/detail/util.h>
+#include <dtel/detail/clone.h>
+#include <dtel/detail/interrupt.h>
+#include "MessagePort.h"
 
 #include <duktape.h>
 
+#include <atomic>
 #include <memory>
 #include <thread>
 #include <functional>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <set>
+#include <algorithm>
+#include <utility>
+#include <vector>
 
 namespace dtel {
 namespace worker {
@@ -29,6 +41,9 @@ namespace detail {
 
 		void apply(duk_context *ctx)
 		{
+			if (!eventtarget::EventTarget_hasEventListener(ctx, _ref, "error"))
+				return;
+
 			// call 'dispatchEvent' on the "error" event
 			auto evt = make_intrusive<eventtarget::Event>("error", "ErrorEvent", _ref);
 			evt->eventInit.properties["message"] = _message;
@@ -45,66 +60,6 @@ namespace detail {
 		std::string _message;
 	};
 
-	// This is run in the caller worker
-	class PostMessageEvent : public Event
-	{
-	public:
-		PostMessageEvent(Ref::Ptr ref, const std::string &message) :
-			Event(), _ref(ref), _message(message)
-		{}
-
-		void apply(duk_context *ctx)
-		{
-			// parse message
-			dtel::detail::util::json_custom_decode_push(ctx, _message);
-			Value::Ptr mref(new Ref(ctx));
-
-			// call 'dispatchEvent' on the "message" event
-			auto evt = make_intrusive<eventtarget::Event>("message", "Event");
-			evt->eventInit.properties["data"] = mref;
-			eventtarget::EventTarget_dispatchEvent(ctx, _ref, evt);
-		}
-
-		void release(duk_context *ctx)
-		{
-
-		}
-
-	private:
-		Ref::Ptr _ref;
-		std::string _message;
-	};
-
-	// This is run INSIDE the worker
-	class WorkerPostMessageEvent : public Event
-	{
-	public:
-		WorkerPostMessageEvent(const std::string &message) :
-			Event(), _message(message)
-		{}
-
-		void apply(duk_context *ctx)
-		{
-			// parse message
-			dtel::detail::util::json_custom_decode_push(ctx, _message);
-			Value::Ptr mref(new Ref(ctx));
-
-			// call 'dispatchEvent' on the "message" event
-			Value::Ptr global(make_intrusive<ValueGlobal>());
-			auto evt = make_intrusive<eventtarget::Event>("message", "Event");
-			evt->eventInit.properties["data"] = mref;
-			eventtarget::EventTarget_dispatchEvent(ctx, global, evt);
-		}
-
-		void release(duk_context *ctx)
-		{
-
-		}
-
-	private:
-		std::string _message;
-	};
-
 }
 
 class WorkerWorker : public ThreadSafeRefCountedBase<WorkerWorker>
@@ -112,68 +67,55 @@ class WorkerWorker : public ThreadSafeRefCountedBase<WorkerWorker>
 public:
 	typedef IntrusiveRefCntPtr<WorkerWorker> Ptr;
 
+	WorkerWorker() : _memoryLimit(0) {}
 	virtual ~WorkerWorker() {}
 
+	/**
+	 * Creates the heap of a worker, by default with an AccountingAllocator limited to memoryLimit()
+	 */
 	virtual duk_context *createContext()
 	{
-		return duk_create_heap_default();
+		return AccountingAllocator::createHeap(memoryLimit());
 	}
 
 	virtual void destroyContext(duk_context *ctx)
 	{
-		return duk_destroy_heap(ctx);
-	}
-
-	virtual void loadUrl(duk_context *ctx, EventLoop *eventloop, const std::string &url)
-	{
-		duk_push_error_object(ctx, DUK_ERR_ERROR, "Worker url loading not implemented");
-		duk_throw(ctx);
+		AccountingAllocator::destroyHeap(ctx);
 	}
-};
 
-
-/**
- * WorkerHandler
- */
-class WorkerHandler : public ThreadSafeRefCountedBase<WorkerHandler>
-{
-public:
-	typedef IntrusiveRefCntPtr<WorkerHandler> Ptr;
-
-	WorkerHandler(EventLoop *eventloop) :
-		_eventloop(eventloop), _worker(new WorkerWorker)
+	/**
+	 * Maximum amount of bytes each worker heap can allocate, 0 = no limit.
+	 * Only affects the heaps created after it is set.
+	 */
+	void setMemoryLimit(size_t limit)
 	{
-
+		_memoryLimit = limit;
 	}
 
-	EventLoop *eventLoop() const 
+	size_t memoryLimit() const
 	{
-		return _eventloop;
+		return _memoryLimit;
 	}
 
-	WorkerWorker::Ptr worker()
+	/**
+	 * Registers the libraries on a new worker context, before any script is loaded.
+	 * Pooled contexts are initialized ahead of time on the pool threads.
+	 */
+	virtual void initContext(duk_context *ctx, EventLoop *eventloop)
 	{
-		return _worker;
 	}
 
-	void setWorker(WorkerWorker::Ptr worker)
+	virtual void loadUrl(duk_context *ctx, EventLoop *eventloop, const std::string &url)
 	{
-		_worker = worker;
+		duk_push_error_object(ctx, DUK_ERR_ERROR, "Worker url loading not implemented");
+		duk_throw(ctx);
 	}
 private:
-	EventLoop *_eventloop;
-	WorkerWorker::Ptr _worker;
+	std::atomic<size_t> _memoryLimit;
 };
 
-namespace detail {
 
-	/**
-	* Storage of the handler inside duktape
-	*/
-	struct WorkerHandlerStorage
-	{
-		WorkerHandler::Ptr handler;
-	};
+namespace detail {
 
 	class WorkerEventLoop : public EventLoop
 	{
@@ -189,8 +131,29 @@ namespace detail {
 				return _func(e);
 			return false;
 		}
+
+		void setFunc(func_t func)
+		{
+			_func = func;
+		}
+
+		void onChanged() override
+		{
+			if (_wakeup)
+				_wakeup();
+		}
+
+		/**
+		 * Sets the function that schedules the loop again when it changes.
+		 * Must not be changed while other threads can post to the loop.
+		 */
+		void setWakeup(std::function<void()> wakeup)
+		{
+			_wakeup = wakeup;
+		}
 	private:
 		func_t _func;
+		std::function<void()> _wakeup;
 	};
 
 	class WorkerCallerPostMessage
@@ -198,60 +161,71 @@ namespace detail {
 	public:
 		virtual ~WorkerCallerPostMessage() {}
 
-		virtual void callerPostMessage(const std::string &message) = 0;
+		virtual void callerPostMessage(dtel::detail::clone::Message message) = 0;
+
+		/**
+		 * The worker closed itself, called on the worker thread
+		 */
+		virtual void callerClose() = 0;
 	};
 
 	// This runs INSIDE the worker
 	inline duk_ret_t r_dedicatedWorkerGlobal_postMessage(duk_context *ctx)
 	{
-		// 0: "this"
-		// 1: message
+		// 0: message
+		// 1: transfer list
 
 		duk_push_global_object(ctx);
 		duk_get_prop_string(ctx, -1, PROP_DATA);
 		WorkerCallerPostMessage *wd = static_cast<WorkerCallerPostMessage*>(duk_get_pointer(ctx, -1));
 		duk_pop_2(ctx);
+		if (!wd)
+			return duk_error(ctx, DUK_ERR_ERROR, "worker is not started");
 
-		// convert 1 to json
-		std::string message = dtel::detail::util::json_custom_encode(ctx, 1);
-		wd->callerPostMessage(message);
+		// serialize 0, transferring 1
+		bool ok;
+		{
+			dtel::detail::clone::Message message;
+			ok = dtel::detail::clone::encode(ctx, 0, 1, message);
+			if (ok)
+				wd->callerPostMessage(std::move(message));
+		}
+		if (!ok)
+			return duk_throw(ctx);
 
 		return 0;
 	}
 
-	class WorkerData : public WorkerCallerPostMessage
+	// This runs INSIDE the worker
+	inline duk_ret_t r_workerGlobal_close(duk_context *ctx)
 	{
-	public:
-		WorkerData(WorkerHandler::Ptr handler, Ref::Ptr workerref) :
-			_handler(handler), _workerref(workerref), _lock(), _ctx(NULL), _eventloop(NULL)
-		{
-		}
-
-		void onProcessException(const std::exception &e)
-		{
-			std::lock_guard<std::recursive_mutex> lock(_lock);
-			_handler->eventLoop()->postEvent(make_intrusive<ErrorEvent>(_workerref, e.what()));
-		}
-
-		void callerPostMessage(const std::string &message) override
-		{
-			std::lock_guard<std::recursive_mutex> lock(_lock);
-			_handler->eventLoop()->postEvent(make_intrusive<PostMessageEvent>(_workerref, message));
-		}
+		duk_push_global_object(ctx);
+		duk_get_prop_string(ctx, -1, PROP_DATA);
+		WorkerCallerPostMessage *wd = static_cast<WorkerCallerPostMessage*>(duk_get_pointer(ctx, -1));
+		duk_pop_2(ctx);
+		if (wd)
+			wd->callerClose();
+		return 0;
+	}
 
-		void init()
+	/**
+	 * A worker heap with its event loop, with the worker global scope already set up
+	 */
+	class WorkerContext
+	{
+	public:
+		WorkerContext(WorkerWorker::Ptr worker) :
+			_worker(worker), _ctx(worker->createContext()), _eventloop(NULL)
 		{
-			_ctx = _handler->worker()->createContext();
-			ResetStackOnScopeExit r(_ctx);
-			_eventloop = new WorkerEventLoop(_ctx, [this](const std::exception &e) -> bool {
-				this->onProcessException(e);
-				return true;
-			});
-
-			eventtarget::RegisterEventTarget(_eventloop);
+			_eventloop = new WorkerEventLoop(_ctx, WorkerEventLoop::func_t());
 
 			try
 			{
+				ResetStackOnScopeExit r(_ctx);
+
+				eventtarget::RegisterEventTarget(_eventloop);
+				r_MessagePort_Setup(_ctx, _eventloop);
+
 				// WorkerGlobalScope
 				if (duk_peval_string(_ctx, R"(
 
@@ -260,31 +234,11 @@ var WorkerGlobalScope = function() {
 
 	this.self = this;
 	this.testglobalscope = "YES I AM GLOBAL SCOPE";
-
-	var defevt = function(obj, name) {
-		Object.defineProperty(obj, "on"+name, {
-			get: function() { return this["_on"+name]; },
-			set: function(val) { 
-				if (this["_on"+name] != undefined)
-					this.removeEventListener(name, this["_on"+name]);
-				this["_on"+name] = val; 
-				this.addEventListener(name, val); 
-			}
-		});
-	}
-
-	defevt(this, "error");
-	defevt(this, "offline");
-	defevt(this, "online");
-	defevt(this, "languagechange");
 };
 
 WorkerGlobalScope.prototype = Object.create(EventTarget.prototype);
 WorkerGlobalScope.prototype.constructor = WorkerGlobalScope;
 
-WorkerGlobalScope.prototype.close = function() {
-};
-
 WorkerGlobalScope.prototype.importScripts = function() {
 };
 
@@ -294,140 +248,901 @@ WorkerGlobalScope.prototype.importScripts = function() {
 				};
 				duk_pop(_ctx);
 
+				duk_get_global_string(_ctx, "WorkerGlobalScope");
+				duk_get_prop_string(_ctx, -1, "prototype");
+				eventtarget::DefineEventHandlers(_ctx, -1, { "error", "offline", "online", "languagechange" });
+				duk_push_c_function(_ctx, &r_workerGlobal_close, 0);
+				duk_put_prop_string(_ctx, -2, "close");
+				duk_pop_2(_ctx);
+
 				// DedicatedWorkerGlobalScope
 				if (duk_peval_string(_ctx, R"(
 
 var DedicatedWorkerGlobalScope = function() {
 	WorkerGlobalScope.call(this);
-
-	var defevt = function(obj, name) {
-		Object.defineProperty(obj, "on"+name, {
-			get: function() { return this["_on"+name]; },
-			set: function(val) { 
-				if (this["_on"+name] != undefined)
-					this.removeEventListener(name, this["_on"+name]);
-				this["_on"+name] = val; 
-				this.addEventListener(name, val); 
-			}
-		});
-	}
-
-	defevt(this, "message");
 };
 
 DedicatedWorkerGlobalScope.prototype = Object.create(WorkerGlobalScope.prototype);
 DedicatedWorkerGlobalScope.prototype.constructor = DedicatedWorkerGlobalScope;
 
-DedicatedWorkerGlobalScope.prototype.postMessage = function(message) {
-	___WORKER_POSTMessage___(this, message);
-};
-
 	)") != 0)
 				{
 					ThrowError(_ctx, -1);
 				};
 				duk_pop(_ctx);
 
+				duk_get_global_string(_ctx, "DedicatedWorkerGlobalScope");
+				duk_get_prop_string(_ctx, -1, "prototype");
+				eventtarget::DefineEventHandlers(_ctx, -1, { "message" });
+				duk_push_c_function(_ctx, &r_dedicatedWorkerGlobal_postMessage, 2);
+				duk_put_prop_string(_ctx, -2, "postMessage");
+				duk_pop_2(_ctx);
+
 				//
 				// REPLACE GLOBAL OBJECT WITH INSTANCE OF DedicatedWorkerGlobalScope
 				//
 				duk_push_global_object(_ctx);
 
-				// set postmessage function
-				duk_push_c_function(_ctx, &r_dedicatedWorkerGlobal_postMessage, 2);
-				duk_put_prop_string(_ctx, -2, "___WORKER_POSTMessage___");
-
 				// create DedicatedWorkerGlobalScope
 				duk_get_prop_string(_ctx, -1, "DedicatedWorkerGlobalScope");
 				if (duk_pnew(_ctx, 0) != 0) {
 					ThrowError(_ctx, -1);
 				}
 
-				// set WorkerData
-				duk_push_pointer(_ctx, static_cast<WorkerCallerPostMessage*>(this));
-				duk_put_prop_string(_ctx, -2, PROP_DATA);
-
-				//** COPY USEFUL DATA FROM PREVIOUS GLOBAL
-				//** ALL CURRENT PROPERTIES WILL NOT EXIST ON THE NEW GLOBAL
-				duk_get_prop_string(_ctx, -2, "Object");
-				duk_put_prop_string(_ctx, -2, "Object");
-
-				duk_get_prop_string(_ctx, -2, "print");
-				duk_put_prop_string(_ctx, -2, "print");
-
-				duk_get_prop_string(_ctx, -2, "Error");
-				duk_put_prop_string(_ctx, -2, "Error");
-
-				duk_get_prop_string(_ctx, -2, "Duktape");
-				duk_put_prop_string(_ctx, -2, "Duktape");
+				//** COPY THE PREVIOUS GLOBAL PROPERTIES (BUILT-INS LIKE Object, Date, ArrayBuffer, Duktape)
+				//** THAT ARE NOT DEFINED ON THE NEW GLOBAL
+				duk_enum(_ctx, -2, DUK_ENUM_OWN_PROPERTIES_ONLY | DUK_ENUM_INCLUDE_NONENUMERABLE);
+				while (duk_next(_ctx, -1, 1))
+				{
+					// global, scope, enum, key, value
+					duk_dup(_ctx, -2);
+					if (duk_has_prop(_ctx, -5) == 0)
+					{
+						duk_def_prop(_ctx, -4, DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_SET_WRITABLE | DUK_DEFPROP_SET_CONFIGURABLE);
+					}
+					else
+						duk_pop_2(_ctx);
+				}
+				duk_pop(_ctx); // enum
 
 				// pop global
 				duk_remove(_ctx, -2);
 				// set global object
 				duk_set_global_object(_ctx);
 
+				_worker->initContext(_ctx, _eventloop);
 			}
-			catch (std::exception &e)
+			catch (...)
 			{
-				onProcessException(e);
+				destroy();
+				throw;
 			}
 		}
 
-		void loadUrl(const std::string &url)
+		~WorkerContext()
 		{
-			_handler->worker()->loadUrl(_eventloop->ctx(), _eventloop, url);
+			destroy();
 		}
 
 		/**
-		 * Posts the message inside the worker
+		 * Binds the context to a Worker, before its script is loaded
 		 */
-		void postMessage(const std::string &message)
+		void bind(WorkerCallerPostMessage *caller, WorkerEventLoop::func_t func)
+		{
+			ResetStackOnScopeExit r(_ctx);
+
+			_eventloop->setFunc(func);
+
+			duk_push_global_object(_ctx);
+			duk_push_pointer(_ctx, caller);
+			duk_put_prop_string(_ctx, -2, PROP_DATA);
+		}
+
+		WorkerWorker::Ptr worker() const
+		{
+			return _worker;
+		}
+
+		duk_context *ctx() const
+		{
+			return _ctx;
+		}
+
+		EventLoop *eventLoop() const
+		{
+			return _eventloop;
+		}
+
+		/**
+		 * Sets the function that schedules the loop again when events are posted to it
+		 */
+		void setWakeup(std::function<void()> wakeup)
+		{
+			_eventloop->setWakeup(wakeup);
+		}
+
+		WorkerContext(const WorkerContext &) = delete;
+		WorkerContext &operator=(const WorkerContext &) = delete;
+	private:
+		void destroy()
+		{
+			// detaches the message queues from the loop
+			delete _eventloop;
+			_eventloop = NULL;
+			_worker->destroyContext(_ctx);
+			_ctx = NULL;
+		}
+
+		WorkerWorker::Ptr _worker;
+		duk_context *_ctx;
+		WorkerEventLoop *_eventloop;
+	};
+
+	/**
+	 * Starts a Worker on its context, called on a pool thread
+	 */
+	class WorkerStartup
+	{
+	public:
+		virtual ~WorkerStartup() {}
+
+		/**
+		 * The context is ready, bind it and load the script
+		 */
+		virtual void startup(WorkerContext *context) = 0;
+
+		/**
+		 * The context could not be created
+		 */
+		virtual void startupFailed(const std::exception &e) = 0;
+	};
+
+	/**
+	 * A worker context and its scheduling state in the pool
+	 */
+	struct WorkerSlot
+	{
+		enum state_t {
+			WARMING,     // the context is being created for the pool
+			IDLE,        // warmed up, waiting in the pool
+			STARTING,    // acquired by a Worker, a pool thread creates the context if needed and loads the script
+			RUNNING,     // the event loop is scheduled when it has events or due timers
+			FAILED,      // the context could not be created
+			RELEASED,    // the Worker was released, the context must be destroyed
+			DESTROYING,  // a pool thread is destroying the context
+			FINISHED,    // the pool doesn't use the slot anymore
+		};
+
+		WorkerSlot(std::unique_ptr<WorkerContext> ctx, state_t st) :
+			context(std::move(ctx)), state(st), idleSince(std::chrono::steady_clock::now()), owner(NULL),
+			affinity(0), queued(false), running(false), pending(false), timed(false), wakeAt(), interrupted(false)
+		{}
+
+		std::unique_ptr<WorkerContext> context;
+		state_t state;
+		std::chrono::steady_clock::time_point idleSince;
+		WorkerStartup *owner;
+		// thread that ran the slot last, it is queued on it again to keep its caches warm
+		size_t affinity;
+		// in a run queue
+		bool queued;
+		// being run by a thread
+		bool running;
+		// changed while running, must run again
+		bool pending;
+		// waiting for the next timer of the loop
+		bool timed;
+		std::chrono::steady_clock::time_point wakeAt;
+		// the running script must be aborted
+		std::atomic_bool interrupted;
+	};
+
+	/**
+	 * Runs the worker event loops on a fixed set of threads (M:N).
+	 * A loop only takes a thread while it has events or due timers: posting to it schedules it on the
+	 * run queue of the thread that ran it last, idle threads steal from the busier ones. Each run applies
+	 * a bounded amount of events, so a busy worker doesn't starve the others. A worker blocking in its
+	 * script (long loops, Atomics.wait) holds its thread until it returns.
+	 *
+	 * Creating a worker heap and its global scope can also be done ahead of time, so a Worker only has
+	 * to load its script. A heap is never reused by another Worker, as scripts leave state behind: when
+	 * a Worker finishes, its heap is destroyed and a fresh one is warmed up to return to the pool.
+	 */
+	class WorkerPool : public ThreadSafeRefCountedBase<WorkerPool>
+	{
+	public:
+		typedef IntrusiveRefCntPtr<WorkerPool> Ptr;
+
+		WorkerPool(WorkerWorker::Ptr worker) :
+			_lock(), _cv(), _worker(worker), _idle(), _warming(0), _active(0), _shutdown(false),
+			_min(0), _max(0), _idletimeout(std::chrono::seconds(30)), _threadcount(0), _threads(), _timers()
+		{
+			_threadcount = std::max(2u, std::thread::hardware_concurrency());
+		}
+
+		~WorkerPool()
 		{
-			std::lock_guard<std::recursive_mutex> lock(_lock);
-			if (_eventloop)
 			{
-				_eventloop->postEvent(make_intrusive<WorkerPostMessageEvent>(message));
+				std::unique_lock<std::mutex> lock(_lock);
+				_shutdown = true;
+				_cv.wait(lock, [this] { return _active == 0 && _warming == 0; });
+				for (auto &t : _threads)
+					t->cv.notify_all();
 			}
+			for (auto &t : _threads)
+				t->thread.join();
+			for (auto slot : _idle)
+				delete slot;
 		}
 
-		// Run eventloop in thread
-		void run()
+		/**
+		 * Keeps at least min and at most max idle contexts. Idle contexts above min are destroyed
+		 * after idleTimeout. The default of 0/0 doesn't keep any context: each Worker creates its
+		 * own when it starts, as if there was no pool.
+		 */
+		void configure(size_t min, size_t max, std::chrono::milliseconds idleTimeout)
 		{
-			if (!_thread)
-				_thread.reset(new std::thread(&WorkerData::internalRun, this));
+			std::lock_guard<std::mutex> lock(_lock);
+			_min = min;
+			_max = max < min ? min : max;
+			_idletimeout = idleTimeout;
+			notifyIdle();
+			fill();
 		}
 
-		void internalRun()
+		/**
+		 * Sets the amount of threads that run the worker loops, by default the amount of cores (at least 2).
+		 * The threads are started on first use, after that the amount can only grow.
+		 */
+		void setThreadCount(size_t count)
 		{
-			_eventloop->run();
+			std::lock_guard<std::mutex> lock(_lock);
+			_threadcount = count > 0 ? count : 1;
+			if (!_threads.empty())
+				startThreads();
 		}
 
-		~WorkerData()
+		/**
+		 * Sets the worker used to create the contexts, discarding the idle ones
+		 */
+		void setWorker(WorkerWorker::Ptr worker)
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			_worker = worker;
+			notifyIdle();
+			fill();
+		}
+
+		size_t idleCount()
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			return _idle.size();
+		}
+
+		/**
+		 * Starts a Worker on a context from the pool, or on a new one.
+		 * Returns immediately, the owner is called on a pool thread.
+		 */
+		WorkerSlot *acquire(WorkerStartup *owner)
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			WorkerSlot *slot = NULL;
+			for (auto idle : _idle)
+			{
+				// contexts of a previous worker will be trimmed
+				if (idle->context->worker() != _worker)
+					continue;
+				slot = idle;
+				break;
+			}
+			if (slot)
+			{
+				_idle.remove(slot);
+				slot->state = WorkerSlot::STARTING;
+			}
+			else
+				slot = new WorkerSlot(std::unique_ptr<WorkerContext>(), WorkerSlot::STARTING);
+			slot->owner = owner;
+			_active++;
+			schedule(slot);
+			fill();
+			return slot;
+		}
+
+		/**
+		 * Stops the event loop of an acquired context, its heap is destroyed by a pool thread once the
+		 * current run returns. Doesn't wait, can be called on the worker thread.
+		 */
+		void close(WorkerSlot *slot)
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			closeSlot(slot);
+		}
+
+		/**
+		 * Aborts the script running on the context, and the ones of the events still applied until it is released
+		 */
+		void interrupt(WorkerSlot *slot)
+		{
+			slot->interrupted.store(true);
+		}
+
+		/**
+		 * Stops the event loop of an acquired context and waits until a pool thread destroyed it.
+		 * The slot is deleted.
+		 */
+		void release(WorkerSlot *slot)
+		{
+			std::unique_lock<std::mutex> lock(_lock);
+			closeSlot(slot);
+			_cv.wait(lock, [slot] { return slot->state == WorkerSlot::FINISHED; });
+			_active--;
+			_cv.notify_all();
+			lock.unlock();
+			delete slot;
+		}
+	private:
+		struct WorkerThread
+		{
+			std::thread thread;
+			std::deque<WorkerSlot*> queue;
+			std::condition_variable cv;
+			bool idle;
+		};
+
+		// maximum amount of events applied each time a loop is run
+		static const size_t MAX_STEP_EVENTS = 64;
+
+		// _lock must be held
+		void closeSlot(WorkerSlot *slot)
+		{
+			// already closed
+			if (slot->state == WorkerSlot::RELEASED || slot->state == WorkerSlot::DESTROYING || slot->state == WorkerSlot::FINISHED)
+				return;
+			slot->state = WorkerSlot::RELEASED;
+			schedule(slot);
+		}
+
+		/**
+		 * Queues the slot to run, or to run again if it is running. Called from any thread.
+		 */
+		void wakeup(WorkerSlot *slot)
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+			if (slot->state == WorkerSlot::RUNNING)
+				schedule(slot);
+		}
+
+		// _lock must be held
+		void schedule(WorkerSlot *slot)
+		{
+			if (slot->running)
+			{
+				slot->pending = true;
+				return;
+			}
+			if (slot->queued)
+				return;
+			if (slot->timed)
+			{
+				_timers.erase(std::make_pair(slot->wakeAt, slot));
+				slot->timed = false;
+			}
+
+			startThreads();
+			if (slot->affinity >= _threads.size())
+				slot->affinity = 0;
+			slot->queued = true;
+			WorkerThread *t = _threads[slot->affinity].get();
+			t->queue.push_back(slot);
+			if (t->idle)
+				t->cv.notify_one();
+			else
+				notifyIdle(1);
+		}
+
+		// _lock must be held
+		void scheduleAt(WorkerSlot *slot, std::chrono::steady_clock::time_point wakeAt)
+		{
+			bool first = _timers.empty() || wakeAt < _timers.begin()->first;
+			slot->timed = true;
+			slot->wakeAt = wakeAt;
+			_timers.insert(std::make_pair(wakeAt, slot));
+			// idle threads may be sleeping past it
+			if (first)
+				notifyIdle(1);
+		}
+
+		// _lock must be held
+		void notifyIdle(size_t count = 0)
+		{
+			size_t notified = 0;
+			for (auto &t : _threads)
+			{
+				if (!t->idle)
+					continue;
+				t->cv.notify_one();
+				if (count > 0 && ++notified == count)
+					break;
+			}
+		}
+
+		// _lock must be held
+		void startThreads()
+		{
+			while (_threads.size() < _threadcount)
+			{
+				std::unique_ptr<WorkerThread> t(new WorkerThread());
+				t->idle = false;
+				t->thread = std::thread(&WorkerPool::threadMain, this, _threads.size());
+				_threads.push_back(std::move(t));
+			}
+		}
+
+		// _lock must be held
+		void fill()
+		{
+			while (!_shutdown && _idle.size() + _warming < _min)
+			{
+				_warming++;
+				schedule(new WorkerSlot(std::unique_ptr<WorkerContext>(), WorkerSlot::WARMING));
+			}
+		}
+
+		// _lock must be held
+		bool trim(WorkerSlot *slot, std::chrono::steady_clock::time_point now)
+		{
+			if (_shutdown || _idle.size() > _max || slot->context->worker() != _worker)
+				return true;
+			return _idletimeout.count() > 0 && _idle.size() > _min && now >= slot->idleSince + _idletimeout;
+		}
+
+		// _lock must be held
+		WorkerSlot *next(size_t index)
+		{
+			WorkerThread *t = _threads[index].get();
+			WorkerThread *from = t;
+			if (t->queue.empty())
+			{
+				// steal from the busiest thread
+				for (auto &other : _threads)
+					if (other->queue.size() > from->queue.size())
+						from = other.get();
+				if (from->queue.empty())
+					return NULL;
+			}
+			WorkerSlot *slot = from->queue.front();
+			from->queue.pop_front();
+			slot->queued = false;
+			slot->affinity = index;
+			return slot;
+		}
+
+		void threadMain(size_t index)
+		{
+			std::unique_lock<std::mutex> lock(_lock);
+			for (;;)
+			{
+				auto now = std::chrono::steady_clock::now();
+
+				// due timers
+				while (!_timers.empty() && _timers.begin()->first <= now)
+				{
+					WorkerSlot *slot = _timers.begin()->second;
+					_timers.erase(_timers.begin());
+					slot->timed = false;
+					schedule(slot);
+				}
+
+				// idle contexts to destroy
+				WorkerSlot *trimmed = NULL;
+				for (auto slot : _idle)
+				{
+					if (trim(slot, now))
+					{
+						trimmed = slot;
+						break;
+					}
+				}
+				if (trimmed)
+				{
+					_idle.remove(trimmed);
+					lock.unlock();
+					delete trimmed;
+					lock.lock();
+					continue;
+				}
+
+				WorkerSlot *slot = next(index);
+				if (!slot)
+				{
+					if (_shutdown && _active == 0 && _warming == 0)
+						break;
+
+					auto timeout = std::chrono::steady_clock::time_point::max();
+					if (!_timers.empty())
+						timeout = _timers.begin()->first;
+					if (_idletimeout.count() > 0 && _idle.size() > _min)
+						for (auto idle : _idle)
+							if (idle->idleSince + _idletimeout < timeout)
+								timeout = idle->idleSince + _idletimeout;
+
+					WorkerThread *t = _threads[index].get();
+					t->idle = true;
+					if (timeout == std::chrono::steady_clock::time_point::max())
+						t->cv.wait(lock);
+					else
+						t->cv.wait_until(lock, timeout);
+					t->idle = false;
+					continue;
+				}
+
+				run(lock, slot);
+			}
+		}
+
+		// _lock must be held
+		void run(std::unique_lock<std::mutex> &lock, WorkerSlot *slot)
+		{
+			slot->running = true;
+			slot->pending = false;
+
+			if (slot->state == WorkerSlot::WARMING)
+			{
+				// warm up a context
+				WorkerWorker::Ptr worker = _worker;
+				lock.unlock();
+				std::unique_ptr<WorkerContext> context;
+				try
+				{
+					context.reset(new WorkerContext(worker));
+				}
+				catch (std::exception &)
+				{
+				}
+				lock.lock();
+				_warming--;
+				if (!context || _shutdown || worker != _worker)
+				{
+					lock.unlock();
+					delete slot;
+					context.reset();
+					lock.lock();
+					_cv.notify_all();
+					return;
+				}
+				slot->context = std::move(context);
+				slot->state = WorkerSlot::IDLE;
+				slot->idleSince = std::chrono::steady_clock::now();
+				slot->running = false;
+				_idle.push_back(slot);
+				_cv.notify_all();
+				return;
+			}
+
+			if (slot->state == WorkerSlot::STARTING)
+			{
+				WorkerStartup *owner = slot->owner;
+				if (!slot->context)
+				{
+					// not from the pool, create the context
+					WorkerWorker::Ptr worker = _worker;
+					lock.unlock();
+					std::unique_ptr<WorkerContext> context;
+					try
+					{
+						context.reset(new WorkerContext(worker));
+					}
+					catch (std::exception &e)
+					{
+						owner->startupFailed(e);
+					}
+					lock.lock();
+					slot->context = std::move(context);
+				}
+
+				if (slot->context)
+				{
+					slot->context->setWakeup([this, slot] { this->wakeup(slot); });
+					lock.unlock();
+					{
+						dtel::detail::ExecInterruptScope interrupt(&slot->interrupted);
+						owner->startup(slot->context.get());
+					}
+					lock.lock();
+				}
+
+				if (slot->state == WorkerSlot::STARTING)
+				{
+					slot->state = slot->context ? WorkerSlot::RUNNING : WorkerSlot::FAILED;
+					// run the events posted until now
+					slot->pending = slot->state == WorkerSlot::RUNNING;
+				}
+			}
+			else if (slot->state == WorkerSlot::RUNNING)
+			{
+				EventLoop *eventloop = slot->context->eventLoop();
+				lock.unlock();
+				LoopRunner::looped_result_t timeout;
+				bool more;
+				{
+					dtel::detail::ExecInterruptScope interrupt(&slot->interrupted);
+					more = eventloop->step(timeout, MAX_STEP_EVENTS);
+				}
+				lock.lock();
+				if (more)
+					slot->pending = true;
+				else if (timeout)
+					scheduleAt(slot, *timeout);
+			}
+
+			if (slot->state == WorkerSlot::RELEASED)
+			{
+				// the heap is never reused
+				slot->state = WorkerSlot::DESTROYING;
+				lock.unlock();
+				slot->context.reset();
+				lock.lock();
+				slot->running = false;
+				slot->state = WorkerSlot::FINISHED;
+				_cv.notify_all();
+
+				// return a fresh context to the pool
+				fill();
+				return;
+			}
+
+			slot->running = false;
+			if (slot->pending && slot->state == WorkerSlot::RUNNING)
+			{
+				slot->pending = false;
+				schedule(slot);
+			}
+		}
+
+		std::mutex _lock;
+		std::condition_variable _cv;
+		WorkerWorker::Ptr _worker;
+		std::list<WorkerSlot*> _idle;
+		size_t _warming;
+		// acquired slots not yet released
+		size_t _active;
+		bool _shutdown;
+		size_t _min;
+		size_t _max;
+		std::chrono::milliseconds _idletimeout;
+		size_t _threadcount;
+		std::vector<std::unique_ptr<WorkerThread>> _threads;
+		std::set<std::pair<std::chrono::steady_clock::time_point, WorkerSlot*>> _timers;
+	};
+
+}
+
+/**
+ * WorkerHandler
+ */
+class WorkerHandler : public ThreadSafeRefCountedBase<WorkerHandler>
+{
+public:
+	typedef IntrusiveRefCntPtr<WorkerHandler> Ptr;
+
+	WorkerHandler(EventLoop *eventloop) :
+		_eventloop(eventloop), _worker(new WorkerWorker), _pool(new detail::WorkerPool(_worker))
+	{
+
+	}
+
+	EventLoop *eventLoop() const 
+	{
+		return _eventloop;
+	}
+
+	WorkerWorker::Ptr worker()
+	{
+		return _worker;
+	}
+
+	void setWorker(WorkerWorker::Ptr worker)
+	{
+		_worker = worker;
+		_pool->setWorker(worker);
+	}
+
+	/**
+	 * Keeps between min and max worker heaps warmed up, so new Workers start without creating them. Idle heaps above min are destroyed after idleTimeout (0 = never).
+	 * Set the worker before, heaps created by a previous worker are discarded.
+	 */
+	void setPool(size_t min, size_t max, std::chrono::milliseconds idleTimeout = std::chrono::seconds(30))
+	{
+		_pool->configure(min, max, idleTimeout);
+	}
+
+	/**
+	 * Sets the amount of threads that run the worker event loops, shared by all the Workers of the handler.
+	 * By default it is the amount of cores, at least 2.
+	 */
+	void setThreadCount(size_t count)
+	{
+		_pool->setThreadCount(count);
+	}
+
+	detail::WorkerPool::Ptr pool()
+	{
+		return _pool;
+	}
+private:
+	EventLoop *_eventloop;
+	WorkerWorker::Ptr _worker;
+	detail::WorkerPool::Ptr _pool;
+};
+
+namespace detail {
+
+	/**
+	* Storage of the handler inside duktape
+	*/
+	struct WorkerHandlerStorage
+	{
+		WorkerHandler::Ptr handler;
+	};
+
+	class WorkerData : public WorkerCallerPostMessage, public WorkerStartup
+	{
+	public:
+		WorkerData(WorkerHandler::Ptr handler, Ref::Ptr workerref) :
+			_handler(handler), _ctx(handler->eventLoop()->ctx()), _workerref(workerref), _lock(), _slot(NULL),
+			_terminated(false), _workerloop(NULL), _toworker(new MessageQueue()), _fromworker(new MessageQueue())
+		{
+			messagequeue_attach(_ctx, _fromworker.get(), workerref);
+		}
+
+		void onProcessException(const std::exception &e)
 		{
 			std::lock_guard<std::recursive_mutex> lock(_lock);
-			if (_eventloop)
+			// the errors of the aborted scripts are not reported
+			if (_terminated)
+				return;
+			_handler->eventLoop()->postEvent(make_intrusive<ErrorEvent>(_workerref, e.what()));
+		}
+
+		void callerPostMessage(dtel::detail::clone::Message message) override
+		{
+			_fromworker->send(std::move(message));
+		}
+
+		// This runs INSIDE the worker
+		void callerClose() override
+		{
+			WorkerSlot *slot;
 			{
-				_eventloop->terminate();
-				_thread->join();
-				delete _eventloop;
-				_eventloop = NULL;
+				std::lock_guard<std::recursive_mutex> lock(_lock);
+				slot = _slot;
 			}
-			if (_ctx)
-				_handler->worker()->destroyContext(_ctx);
+			// the messages not yet received and the pending events are discarded, the current script
+			// runs to completion, then the heap is destroyed
+			_toworker->close();
+			messagequeue_detach(_workerloop->ctx(), _toworker.get());
+			_workerloop->terminate();
+			if (slot)
+				_handler->pool()->close(slot);
 		}
 
-		EventLoop *eventLoop()
+		/**
+		 * Schedules the worker startup, which loads the url on a pool thread
+		 */
+		void start(const std::string &url)
 		{
-			return _eventloop;
+			std::lock_guard<std::recursive_mutex> lock(_lock);
+			_url = url;
+			try
+			{
+				_slot = _handler->pool()->acquire(this);
+			}
+			catch (std::exception &e)
+			{
+				onProcessException(e);
+			}
+		}
+
+		// This runs INSIDE the worker
+		void startup(WorkerContext *context) override
+		{
+			context->bind(this, [this](const std::exception &e) -> bool {
+				this->onProcessException(e);
+				return true;
+			});
+
+			_workerloop = context->eventLoop();
+
+			// messages posted before the worker was ready are received after the script is loaded
+			messagequeue_attach(context->ctx(), _toworker.get(), make_intrusive<ValueGlobal>());
+
+			std::string url;
+			{
+				std::lock_guard<std::recursive_mutex> lock(_lock);
+				url = _url;
+			}
+
+			try
+			{
+				_handler->worker()->loadUrl(context->ctx(), context->eventLoop(), url);
+			}
+			catch (std::exception &e)
+			{
+				onProcessException(e);
+			}
+		}
+
+		void startupFailed(const std::exception &e) override
+		{
+			onProcessException(e);
+		}
+
+		/**
+		 * Posts the message inside the worker, it is queued until the worker is ready
+		 */
+		void postMessage(dtel::detail::clone::Message message)
+		{
+			_toworker->send(std::move(message));
+		}
+
+		/**
+		 * Aborts the worker script and destroys its heap, without waiting for the Worker to be collected.
+		 * Messages in both directions are discarded.
+		 */
+		void terminate()
+		{
+			{
+				std::lock_guard<std::recursive_mutex> lock(_lock);
+				_terminated = true;
+			}
+			_toworker->close();
+			_fromworker->close();
+			release(true);
+		}
+
+		~WorkerData()
+		{
+			{
+				std::lock_guard<std::recursive_mutex> lock(_lock);
+				// the error of the aborted script is not reported
+				_terminated = true;
+			}
+			// a busy script would never return to the loop to be closed
+			release(true);
+			messagequeue_detach(_ctx, _fromworker.get());
 		}
 	private:
+		void release(bool interrupt)
+		{
+			WorkerSlot *slot;
+			{
+				std::lock_guard<std::recursive_mutex> lock(_lock);
+				slot = _slot;
+				_slot = NULL;
+			}
+			// the worker thread may still be starting, don't hold the lock while it finishes
+			if (slot)
+			{
+				if (interrupt)
+					_handler->pool()->interrupt(slot);
+				_handler->pool()->release(slot);
+			}
+			_toworker->attach(NULL, Value::Ptr());
+		}
+
 		WorkerHandler::Ptr _handler;
+		// heap of the Worker object
+		duk_context *_ctx;
 		Ref::Ptr _workerref;
 		std::recursive_mutex _lock;
-		EventLoop *_parenteventloop;
-		duk_context *_ctx;
-		EventLoop *_eventloop;
-		std::shared_ptr<std::thread> _thread;
+		WorkerSlot *_slot;
+		bool _terminated;
+		// only used on the worker thread
+		EventLoop *_workerloop;
+		std::string _url;
+		MessageQueue::Ptr _toworker;
+		MessageQueue::Ptr _fromworker;
 	};
 
 	inline WorkerHandlerStorage *workerhandler_from_worker(duk_context *ctx)
@@ -499,7 +1214,6 @@ DedicatedWorkerGlobalScope.prototype.postMessage = function(message) {
 		// data
 		duk_dup(ctx, -1);
 		WorkerData *data = new WorkerData(storage->handler, new Ref(ctx));
-		data->init();
 		duk_push_pointer(ctx, data);
 		duk_put_prop_string(ctx, -2, PROP_DATA);
 
@@ -507,11 +1221,17 @@ DedicatedWorkerGlobalScope.prototype.postMessage = function(message) {
 		duk_push_c_function(ctx, &r_Worker_finalizer, 1);
 		duk_set_finalizer(ctx, -2);
 
-		// start thread
-		std::string url(duk_get_string(ctx, 0));
-		data->loadUrl(url);
-		data->run();
+		// start, the url is loaded on a pool thread
+		data->start(duk_get_string(ctx, 0));
+
+		return 0;
+	}
 
+	duk_ret_t r_Worker_terminate(duk_context *ctx)
+	{
+		WorkerData *data = workerdata_from_this(ctx);
+		if (data)
+			data->terminate();
 		return 0;
 	}
 
@@ -519,9 +1239,16 @@ DedicatedWorkerGlobalScope.prototype.postMessage = function(message) {
 	{
 		WorkerData *data = workerdata_from_this(ctx);
 
-		// convert 0 to json
-		std::string message = dtel::detail::util::json_custom_encode(ctx, 0);
-		data->postMessage(message);
+		// serialize 0, transferring 1
+		bool ok;
+		{
+			dtel::detail::clone::Message message;
+			ok = dtel::detail::clone::encode(ctx, 0, 1, message);
+			if (ok)
+				data->postMessage(std::move(message));
+		}
+		if (!ok)
+			return duk_throw(ctx);
 
 		return 0;
 	}
@@ -547,20 +1274,6 @@ inline WorkerHandler::Ptr RegisterWorker(EventLoop *eventloop)
 
 var AbstractWorker = function() {
 	EventTarget.call(this);
-
-	var defevt = function(obj, name) {
-		Object.defineProperty(obj, "on"+name, {
-			get: function() { return this["_on"+name]; },
-			set: function(val) { 
-				if (this["_on"+name] != undefined)
-					this.removeEventListener(name, this["_on"+name]);
-				this["_on"+name] = val; 
-				this.addEventListener(name, val); 
-			}
-		});
-	}
-
-	defevt(this, "error");
 };
 
 AbstractWorker.prototype = Object.create(EventTarget.prototype);
@@ -572,6 +1285,14 @@ AbstractWorker.prototype.constructor = AbstractWorker;
 	};
 	duk_pop(ctx);
 
+	duk_get_global_string(ctx, "AbstractWorker");
+	duk_get_prop_string(ctx, -1, "prototype");
+	eventtarget::DefineEventHandlers(ctx, -1, { "error" });
+	duk_pop_2(ctx);
+
+	// MessageChannel, MessagePort
+	detail::r_MessagePort_Setup(ctx, eventloop);
+
 	// Worker
 	duk_push_global_object(ctx);
 	duk_push_c_function(ctx, &detail::r_Worker_construct, 1);
@@ -600,10 +1321,17 @@ Worker.prototype.constructor = Worker;
 	// get prototype
 	duk_get_prop_string(ctx, -1, "prototype");
 
+	// onmessage
+	eventtarget::DefineEventHandlers(ctx, -1, { "message" });
+
 	// postMessage
 	duk_push_c_function(ctx, &detail::r_Worker_postMessage, 2);
 	duk_put_prop_string(ctx, -2, "postMessage");
 
+	// terminate
+	duk_push_c_function(ctx, &detail::r_Worker_terminate, 0);
+	duk_put_prop_string(ctx, -2, "terminate");
+
 	// Worker constructor, prototype
 	duk_pop_2(ctx);
 